@@ -0,0 +1,393 @@
+// Batch mode of main (--batch): process every image of a directory, or of a file listing one path
+// per line, on a pool of worker processes.
+//
+// Every worker is a forked copy of the program with a session of its own (see cells_session), whose
+// images and scratch are reused for all its images. Workers are processes rather than threads so
+// that an image cbmp cannot read ends its worker only. Workers take the next image from a counter
+// shared with the other workers, and store their results in a table shared with the parent, which
+// writes the summary once they are all done.
+// With --pipeline every worker reads and writes its images while it processes others (see
+// pipeline.c); a worker ended by an image it cannot read then also loses the images it had in flight.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "cells.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
+
+// Result of one image, filled in by the worker that processed it.
+typedef struct batch_result_data
+{
+    int done;            // 1 once the image has been processed and written.
+    int worker;          // Worker that processed the image.
+    int cells;           // Cells detected.
+    int iterations;      // Erosion passes made.
+    int detects_skipped; // Detect calls skipped by the scheduler (see schedule.c).
+    int passes_saved;    // Erosion passes the scheduler did not make.
+    double load_ms;      // read_bitmap_image
+    double detect_ms;    // erodeAndDetectSized
+    double write_ms;     // write_bitmap_image
+} batch_result;
+
+// Memory shared by the parent and the workers.
+typedef struct batch_shared_data
+{
+    int next;                // Next image to process.
+    batch_result results[];  // One result per image.
+} batch_shared;
+
+// List of image paths, with the name of their output file.
+typedef struct batch_files_data
+{
+    char** inputs;
+    char** outputs;
+    int size;
+    int capacity;
+} batch_files;
+
+// Add the image input to the list. Its output is name, with '/' replaced by '_', in output_dir.
+static void batchAddFile(batch_files* files, const char* input, const char* name, const char* output_dir) {
+    if (files->size == files->capacity) {
+        files->capacity = files->capacity ? files->capacity * 2 : 64;
+        files->inputs = (char**) realloc(files->inputs, files->capacity * sizeof(char*));
+        files->outputs = (char**) realloc(files->outputs, files->capacity * sizeof(char*));
+    }
+    while (strncmp(name, "./", 2) == 0) {
+        name += 2;
+    }
+    size_t length = strlen(output_dir) + strlen(name) + 2;
+    char* output = (char*) malloc(length);
+    snprintf(output, length, "%s/%s", output_dir, name);
+    for (char* c = output + strlen(output_dir) + 1; *c; c++) {
+        if (*c == '/' || *c == '\\') {
+            *c = '_';
+        }
+    }
+    files->inputs[files->size] = strdup(input);
+    files->outputs[files->size] = output;
+    files->size++;
+}
+
+// Add every .bmp file under the directory path to the list, named by their path relative to root.
+static void batchAddDirectory(batch_files* files, const char* path, size_t root, const char* output_dir) {
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "Could not open directory %s\n", path);
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        size_t length = strlen(path) + strlen(entry->d_name) + 2;
+        char* child = (char*) malloc(length);
+        snprintf(child, length, "%s/%s", path, entry->d_name);
+        struct stat info;
+        if (stat(child, &info) == 0) {
+            size_t name_length = strlen(entry->d_name);
+            if (S_ISDIR(info.st_mode)) {
+                batchAddDirectory(files, child, root, output_dir);
+            } else if (name_length > 4 && strcmp(entry->d_name + name_length - 4, ".bmp") == 0) {
+                batchAddFile(files, child, child + root, output_dir);
+            }
+        }
+        free(child);
+    }
+    closedir(dir);
+}
+
+// Sort the files by input path, so the summary does not depend on the order of the directory.
+static void batchSortFiles(batch_files* files) {
+    for (int i = 1; i < files->size; i++) {
+        char* input = files->inputs[i];
+        char* output = files->outputs[i];
+        int j = i;
+        while (j > 0 && strcmp(files->inputs[j - 1], input) > 0) {
+            files->inputs[j] = files->inputs[j - 1];
+            files->outputs[j] = files->outputs[j - 1];
+            j--;
+        }
+        files->inputs[j] = input;
+        files->outputs[j] = output;
+    }
+}
+
+// Fill the list from input: every .bmp file under it if it is a directory, otherwise the paths it
+// lists, one per line (empty lines and lines starting with # are skipped).
+static void batchListFiles(batch_files* files, const char* input, const char* output_dir) {
+    struct stat info;
+    if (stat(input, &info) != 0) {
+        fprintf(stderr, "Could not open %s\n", input);
+        return;
+    }
+    if (S_ISDIR(info.st_mode)) {
+        batchAddDirectory(files, input, strlen(input) + 1, output_dir);
+        batchSortFiles(files);
+        return;
+    }
+    FILE* list = fopen(input, "r");
+    if (list == NULL) {
+        fprintf(stderr, "Could not open %s\n", input);
+        return;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), list) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0' && line[0] != '#') {
+            batchAddFile(files, line, line, output_dir);
+        }
+    }
+    fclose(list);
+}
+
+// A pipelined worker (see batchWorker).
+typedef struct batch_pipeline_data
+{
+    batch_shared* shared;
+    int image_count;
+    int worker;
+} batch_pipeline;
+
+// Next image for a pipelined worker, -1 if there are none left.
+static int batchNext(void* arg) {
+    batch_pipeline* batch = (batch_pipeline*) arg;
+    int i = __sync_fetch_and_add(&batch->shared->next, 1);
+    return i < batch->image_count ? i : -1;
+}
+
+// Store the result of an image once a pipelined worker has written it.
+static void batchStore(void* arg, pipeline_frame* frame, int stage) {
+    batch_pipeline* batch = (batch_pipeline*) arg;
+    if (stage != PIPELINE_WRITE) {
+        return;
+    }
+    batch_result* result = &batch->shared->results[frame->index];
+    result->worker = batch->worker;
+    result->cells = frame->cells;
+    result->iterations = frame->iterations;
+    result->detects_skipped = frame->detects_skipped;
+    result->passes_saved = frame->passes_saved;
+    result->load_ms = frame->seconds[PIPELINE_LOAD] * 1000.0;
+    result->detect_ms = frame->seconds[PIPELINE_COMPUTE] * 1000.0;
+    result->write_ms = frame->seconds[PIPELINE_WRITE] * 1000.0;
+    result->done = 1;
+}
+
+// Process images until there are none left, taking the next one from shared->next.
+static void batchWorker(batch_files* files, batch_shared* shared, int worker, int engine, int threads, int pipelined) {
+    cells_session session;
+    sessionInit(&session, threads);
+    if (pipelined) {
+        batch_pipeline batch = { shared, files->size, worker };
+        pipeline_job job = { files->inputs, files->outputs, files->size, batchNext, batchStore, &batch, engine };
+        pipeline_stats stats;
+        runPipeline(&session, &job, &stats);
+        sessionFree(&session);
+        return;
+    }
+    for (;;) {
+        int i = __sync_fetch_and_add(&shared->next, 1);
+        if (i >= files->size) {
+            break;
+        }
+        batch_result* result = &shared->results[i];
+        result->worker = worker;
+
+        double start = now_seconds();
+        read_bitmap_image(files->inputs[i], binary_threshold, &session.binary, &session.rgb);
+        double loaded = now_seconds();
+        result->cells = erodeAndDetectSized(&session, &session.binary, &session.rgb, engine, &result->iterations);
+        double detected = now_seconds();
+        result->detects_skipped = session.detects_skipped;
+        result->passes_saved = session.passes_saved;
+        write_bitmap_image(&session.rgb, files->outputs[i]);
+        double written = now_seconds();
+
+        result->load_ms = (loaded - start) * 1000.0;
+        result->detect_ms = (detected - loaded) * 1000.0;
+        result->write_ms = (written - detected) * 1000.0;
+        result->done = 1;
+    }
+    sessionFree(&session);
+}
+
+#ifndef _WIN32
+// Fork a worker process running batchWorker. Returns 0 if it could not be started.
+static int batchStartWorker(batch_files* files, batch_shared* shared, int worker, int engine, int threads, int pipelined) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        batchWorker(files, shared, worker, engine, threads, pipelined);
+        exit(0);
+    }
+    if (pid < 0) {
+        fprintf(stderr, "Could not start worker %d\n", worker);
+        return 0;
+    }
+    return 1;
+}
+#endif
+
+// Write text to the file as a JSON string.
+static void writeJsonString(FILE* file, const char* text) {
+    fputc('"', file);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') {
+            fputc('\\', file);
+        }
+        fputc(*text, file);
+    }
+    fputc('"', file);
+}
+
+// Write the summary of the batch as CSV, or as JSON if path ends in .json.
+static int batchWriteSummary(const char* path, batch_files* files, batch_shared* shared, int workers, double seconds) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write summary %s\n", path);
+        return 0;
+    }
+    size_t length = strlen(path);
+    int json = length > 5 && strcmp(path + length - 5, ".json") == 0;
+    int processed = 0;
+    for (int i = 0; i < files->size; i++) {
+        processed += shared->results[i].done;
+    }
+
+    if (json) {
+        fprintf(file, "{\n  \"images\": %d,\n  \"failed\": %d,\n  \"workers\": %d,\n", files->size, files->size - processed, workers);
+        fprintf(file, "  \"seconds\": %.6f,\n  \"images_per_second\": %.3f,\n  \"files\": [\n", seconds, processed / seconds);
+    } else {
+        fprintf(file, "file,output,status,cells,iterations,detects_skipped,passes_saved,load_ms,detect_ms,write_ms,total_ms,worker\n");
+    }
+    for (int i = 0; i < files->size; i++) {
+        batch_result* result = &shared->results[i];
+        double total_ms = result->load_ms + result->detect_ms + result->write_ms;
+        if (json) {
+            fprintf(file, "    {\"file\": ");
+            writeJsonString(file, files->inputs[i]);
+            fprintf(file, ", \"output\": ");
+            writeJsonString(file, files->outputs[i]);
+            fprintf(file, ", \"status\": \"%s\"", result->done ? "ok" : "failed");
+            if (result->done) {
+                fprintf(file, ", \"cells\": %d, \"iterations\": %d, \"detects_skipped\": %d, \"passes_saved\": %d, \"load_ms\": %.3f, \"detect_ms\": %.3f, \"write_ms\": %.3f, \"total_ms\": %.3f, \"worker\": %d",
+                        result->cells, result->iterations, result->detects_skipped, result->passes_saved, result->load_ms, result->detect_ms, result->write_ms, total_ms, result->worker);
+            }
+            fprintf(file, "}%s\n", i + 1 < files->size ? "," : "");
+        } else if (result->done) {
+            fprintf(file, "%s,%s,ok,%d,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%d\n", files->inputs[i], files->outputs[i],
+                    result->cells, result->iterations, result->detects_skipped, result->passes_saved, result->load_ms, result->detect_ms, result->write_ms, total_ms, result->worker);
+        } else {
+            fprintf(file, "%s,%s,failed,,,,,,,,,\n", files->inputs[i], files->outputs[i]);
+        }
+    }
+    if (json) {
+        fprintf(file, "  ]\n}\n");
+    }
+    fclose(file);
+    return 1;
+}
+
+// Process every image of input (a directory or a file list) with `workers` worker processes, each
+// using `threads` threads, and write the annotated images and the summary to output_dir. The
+// summary goes to summary_path, or output_dir/summary.csv if it is NULL. If pipelined is set, the
+// workers pipeline their images (see pipeline.c). Returns the exit status.
+int runBatch(char* input, char* output_dir, char* summary_path, int workers, int engine, int threads, int pipelined) {
+    batch_files files = { NULL, NULL, 0, 0 };
+    batchListFiles(&files, input, output_dir);
+    if (files.size == 0) {
+        fprintf(stderr, "No images found in %s\n", input);
+        return 1;
+    }
+#ifdef _WIN32
+    mkdir(output_dir);
+    workers = 1;
+#else
+    mkdir(output_dir, 0777);
+#endif
+    if (workers > files.size) {
+        workers = files.size;
+    }
+
+    // Detections, snapshots and profiles of several images would be mixed up.
+    cells_verbose = 0;
+    save_snapshots = 0;
+    profile_enabled = 0;
+
+    size_t shared_size = sizeof(batch_shared) + files.size * sizeof(batch_result);
+    double start = now_seconds();
+#ifdef _WIN32
+    batch_shared* shared = (batch_shared*) calloc(1, shared_size);
+    batchWorker(&files, shared, 0, engine, threads, pipelined);
+#else
+    batch_shared* shared = (batch_shared*) mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "Could not allocate the batch results\n");
+        return 1;
+    }
+    // Even a single worker runs in its own process, so the summary is written if it fails.
+    int running = 0;
+    int next_worker = workers;
+    for (int worker = 0; worker < workers; worker++) {
+        if (batchStartWorker(&files, shared, worker, engine, threads, pipelined)) {
+            running++;
+        }
+    }
+    if (running == 0) {
+        batchWorker(&files, shared, 0, engine, threads, pipelined);
+    }
+    // A worker exits at the first image it can not read (see _throw_error). It is replaced as
+    // long as there are images left, so one bad file does not stop the batch.
+    int status;
+    pid_t pid;
+    while ((pid = wait(&status)) > 0) {
+        if ((!WIFEXITED(status) || WEXITSTATUS(status) != 0) && shared->next < files.size) {
+            batchStartWorker(&files, shared, next_worker++, engine, threads, pipelined);
+        }
+    }
+#endif
+    double seconds = now_seconds() - start;
+
+    int processed = 0;
+    int total_cells = 0;
+    for (int i = 0; i < files.size; i++) {
+        if (shared->results[i].done) {
+            processed++;
+            total_cells += shared->results[i].cells;
+        } else {
+            fprintf(stderr, "Failed to process %s\n", files.inputs[i]);
+        }
+    }
+
+    char default_summary[4096];
+    if (summary_path == NULL) {
+        snprintf(default_summary, sizeof(default_summary), "%s/summary.csv", output_dir);
+        summary_path = default_summary;
+    }
+    int written = batchWriteSummary(summary_path, &files, shared, workers, seconds);
+
+    printf("Processed %d of %d images with %d worker(s) in %.3f s: %.2f images/s\n",
+           processed, files.size, workers, seconds, processed / seconds);
+    printf("Total cells detected: %d\n", total_cells);
+    printf("Summary: %s\n", summary_path);
+
+#ifdef _WIN32
+    free(shared);
+#else
+    munmap(shared, shared_size);
+#endif
+    for (int i = 0; i < files.size; i++) {
+        free(files.inputs[i]);
+        free(files.outputs[i]);
+    }
+    free(files.inputs);
+    free(files.outputs);
+    return processed == files.size && written ? 0 : 1;
+}
@@ -0,0 +1,1576 @@
+// Benchmarks for the cell detection pipeline.
+// To compile (linux/mac): gcc bench.c -o bench.out -std=c99 -O2 -pthread
+// To run (linux/mac): ./bench.out example.bmp samples/*/*.bmp
+// Benchmark suite, for comparing versions: ./bench.out --suite [options] [files]
+//   times every stage on its own and the whole pipeline over the files (default: example.bmp and
+//   every bitmap under samples/easy, medium, hard and impossible), pinned to one CPU.
+//   --repeat N             timed repetitions, the median is reported (default 5)
+//   --warmup N             untimed repetitions first (default 1)
+//   --cpu N                CPU to pin to (default: the one the benchmark starts on; linux only)
+//   --save-baseline FILE   store the results in FILE
+//   --baseline FILE        compare with the results stored in FILE, exit with 1 on a regression
+//   --threshold PCT        slowdown counted as a regression (default 15)
+
+#define _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include "cbmp.c"
+#include "cells.c"
+#include "elements.c"
+#include "components.c"
+#include "detections.c"
+#include "schedule.c"
+#include "distance.c"
+#include "parallel.c"
+#include "snapshot.c"
+#include "profile.c"
+#include "image.c"
+#include "session.c"
+#include "pipeline.c"
+
+#define DECODE_REPETITIONS 5
+#define IO_REPETITIONS 20
+#define IO_OUTPUT "bench_io.bmp"
+
+unsigned char bench_image_a[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS];
+unsigned char bench_image_b[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS];
+unsigned char bench_binary_a[BMP_WIDTH][BMP_HEIGTH];
+unsigned char bench_binary_b[BMP_WIDTH][BMP_HEIGTH];
+unsigned char bench_binary_c[BMP_WIDTH][BMP_HEIGTH];
+unsigned char bench_binary_d[BMP_WIDTH][BMP_HEIGTH];
+uint64_t bench_packed_a[BMP_WIDTH][PACKED_WORDS];
+uint64_t bench_packed_b[BMP_WIDTH][PACKED_WORDS];
+erosion_frontier bench_frontier;
+
+// Session of the single-image checks and benchmarks.
+cells_session bench_session;
+
+// Decode path under test, with the same signature as read_bitmap.
+typedef void (*decode_fn)(char*, unsigned char[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]);
+
+// Decode every file `repetitions` times and return the throughput in frames per second.
+double benchDecode(decode_fn decode, char** files, int file_count, int repetitions) {
+    // Warm up the page cache and the allocator.
+    for (int f = 0; f < file_count; f++) {
+        decode(files[f], bench_image_a);
+    }
+    double start = now_seconds();
+    for (int r = 0; r < repetitions; r++) {
+        for (int f = 0; f < file_count; f++) {
+            decode(files[f], bench_image_a);
+        }
+    }
+    double elapsed = now_seconds() - start;
+    return (double) repetitions * file_count / elapsed;
+}
+
+// Images in the layouts main uses, for read_bitmap_image and write_bitmap_image.
+image bench_binary_image;
+image bench_rgb_image;
+
+// Load and threshold path under test: mode 0 is read_bitmap_direct followed by rgbToBinary,
+// mode 1 is the fused read_bitmap_binary keeping the RGB image, mode 2 drops the RGB image,
+// mode 3 is read_bitmap_image keeping the RGB image as the rows of the file, mode 4 is the same
+// with the threshold chosen by Otsu's method.
+void loadThreshold(int mode, char* file) {
+    if (mode == 0) {
+        read_bitmap_direct(file, bench_image_a);
+        rgbToBinary(bench_image_a, bench_binary_a);
+    } else if (mode >= 3) {
+        read_bitmap_image(file, mode == 4 ? THRESHOLD_OTSU : BINARY_COLOUR_THRESHOLD, &bench_binary_image, &bench_rgb_image);
+    } else {
+        read_bitmap_binary(file, BINARY_COLOUR_THRESHOLD, bench_binary_a, mode == 1 ? bench_image_a : NULL);
+    }
+}
+
+// Load and threshold every file `repetitions` times and return the throughput in frames per second.
+double benchLoadThreshold(int mode, char** files, int file_count, int repetitions) {
+    for (int f = 0; f < file_count; f++) {
+        loadThreshold(mode, files[f]);
+    }
+    double start = now_seconds();
+    for (int r = 0; r < repetitions; r++) {
+        for (int f = 0; f < file_count; f++) {
+            loadThreshold(mode, files[f]);
+        }
+    }
+    double elapsed = now_seconds() - start;
+    return (double) repetitions * file_count / elapsed;
+}
+
+// The old write_bitmap: fill the pixel array of out_bmp one pixel at a time, then let bwrite
+// encode it into the file bytes. out_bmp must have a pixel array (set up by read_bitmap).
+void legacyWrite(unsigned char input_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], char* path) {
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        for (int y = 0; y < BMP_HEIGTH; y++) {
+            unsigned char* p = input_image_array[x][BMP_HEIGTH - 1 - y];
+            set_pixel_rgb(out_bmp, x, y, p[0], p[1], p[2]);
+        }
+    }
+    bwrite(out_bmp, path);
+}
+
+// Read the whole file into memory and return its size, or -1 if it cannot be read.
+long readWholeFile(char* path, unsigned char** contents) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+    *contents = malloc(size);
+    if (fread(*contents, 1, size, fp) != (size_t) size) {
+        size = -1;
+    }
+    fclose(fp);
+    return size;
+}
+
+// Golden test: the file written by write_bitmap must be the same, byte for byte, with the old
+// writer and with both I/O backends, and reading it back with mmap must give the same image.
+int checkWriters(char* file) {
+    char* names[] = { "legacy", "stdio", "mmap" };
+    unsigned char* contents[3];
+    long sizes[3];
+    read_bitmap(file, bench_image_a);
+    for (int w = 0; w < 3; w++) {
+        if (w == 0) {
+            legacyWrite(bench_image_a, IO_OUTPUT);
+        } else {
+            bmp_io_backend = w == 1 ? BMP_IO_STDIO : BMP_IO_MMAP;
+            write_bitmap(bench_image_a, IO_OUTPUT);
+        }
+        sizes[w] = readWholeFile(IO_OUTPUT, &contents[w]);
+    }
+    int ok = 1;
+    for (int w = 1; w < 3; w++) {
+        if (sizes[w] != sizes[0] || memcmp(contents[w], contents[0], sizes[0]) != 0) {
+            fprintf(stderr, "%s writer does not match the old write_bitmap on %s\n", names[w], file);
+            ok = 0;
+        }
+    }
+    read_bitmap_direct(IO_OUTPUT, bench_image_b);
+    if (memcmp(bench_image_a, bench_image_b, sizeof(bench_image_a)) != 0) {
+        fprintf(stderr, "mmap reader does not read back the image written from %s\n", file);
+        ok = 0;
+    }
+    bmp_io_backend = BMP_IO_STDIO;
+    for (int w = 0; w < 3; w++) {
+        free(contents[w]);
+    }
+    return ok;
+}
+
+// Golden test: keeping the RGB image as the rows of the file (read_bitmap_image, erodeAndDetectSized,
+// write_bitmap_image) must write the same file as the fixed [x][y][c] arrays. The padding at the end
+// of the rows is not compared: write_bitmap keeps the one of the first file read, the rows keep
+// their own. The time of reading and writing back the file is added to columns_ms and rows_ms.
+int checkFileRows(char* file, double* columns_ms, double* rows_ms) {
+    unsigned char* contents[2];
+    long sizes[2];
+    int cells[2];
+    int iterations;
+    for (int layout = 0; layout < 2; layout++) {
+        double start = now_seconds();
+        if (layout == 0) {
+            read_bitmap_binary(file, BINARY_COLOUR_THRESHOLD, bench_binary_a, bench_image_a);
+            write_bitmap(bench_image_a, IO_OUTPUT);
+        } else {
+            read_bitmap_image(file, BINARY_COLOUR_THRESHOLD, &bench_binary_image, &bench_rgb_image);
+            write_bitmap_image(&bench_rgb_image, IO_OUTPUT);
+        }
+        *(layout == 0 ? columns_ms : rows_ms) += (now_seconds() - start) * 1000;
+
+        if (layout == 0) {
+            read_bitmap_binary(file, BINARY_COLOUR_THRESHOLD, bench_binary_a, bench_image_a);
+            cells[0] = erodeAndDetect(&bench_session, bench_binary_a, bench_image_a, ENGINE_FULL, &iterations);
+            write_bitmap(bench_image_a, IO_OUTPUT);
+        } else {
+            read_bitmap_image(file, BINARY_COLOUR_THRESHOLD, &bench_binary_image, &bench_rgb_image);
+            cells[1] = erodeAndDetectSized(&bench_session, &bench_binary_image, &bench_rgb_image, ENGINE_FULL, &iterations);
+            write_bitmap_image(&bench_rgb_image, IO_OUTPUT);
+        }
+        sizes[layout] = readWholeFile(IO_OUTPUT, &contents[layout]);
+    }
+    int row_size = (BMP_WIDTH * BMP_CHANNELS + 3) & ~3;
+    int ok = cells[0] == cells[1] && sizes[0] == sizes[1] && sizes[0] >= 54 + (long) row_size * BMP_HEIGTH
+          && memcmp(contents[0], contents[1], 54) == 0;
+    for (int row = 0; ok && row < BMP_HEIGTH; row++) {
+        ok = memcmp(contents[0] + 54 + (long) row * row_size, contents[1] + 54 + (long) row * row_size, BMP_WIDTH * BMP_CHANNELS) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "the rows of the file give another result than the fixed arrays on %s\n", file);
+    }
+    free(contents[0]);
+    free(contents[1]);
+    return ok;
+}
+
+// Golden test: the threshold chosen by read_bitmap_binary with THRESHOLD_OTSU must be the one found
+// by an exhaustive search over a histogram of the decoded image, and the binary image the same as
+// with that threshold given. Returns the threshold, or -1 if they differ.
+int checkOtsu(char* file) {
+    read_bitmap_direct(file, bench_image_a);
+    long histogram[256] = { 0 };
+    long total = 0;
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        for (int y = 0; y < BMP_HEIGTH; y++) {
+            histogram[(bench_image_a[x][y][0] + bench_image_a[x][y][1] + bench_image_a[x][y][2]) / 3]++;
+            total++;
+        }
+    }
+    // Between-class variance of every split, each computed from scratch.
+    int level = 0;
+    double best = -1;
+    for (int t = 0; t < 255; t++) {
+        double n0 = 0, n1 = 0, s0 = 0, s1 = 0;
+        for (int v = 0; v < 256; v++) {
+            if (v <= t) {
+                n0 += histogram[v];
+                s0 += (double) v * histogram[v];
+            } else {
+                n1 += histogram[v];
+                s1 += (double) v * histogram[v];
+            }
+        }
+        if (n0 == 0 || n1 == 0) {
+            continue;
+        }
+        double variance = n0 * n1 * (s0 / n0 - s1 / n1) * (s0 / n0 - s1 / n1);
+        if (variance > best) {
+            best = variance;
+            level = t;
+        }
+    }
+    int threshold = read_bitmap_binary(file, THRESHOLD_OTSU, bench_binary_a, NULL);
+    read_bitmap_binary(file, 3 * level + 2, bench_binary_b, NULL);
+    if (threshold != 3 * level + 2 || memcmp(bench_binary_a, bench_binary_b, sizeof(bench_binary_a)) != 0) {
+        fprintf(stderr, "Otsu threshold %d of %s does not match %d\n", threshold, file, 3 * level + 2);
+        return -1;
+    }
+    return threshold;
+}
+
+// Drop the file from the page cache, so the next read comes from the disk.
+void dropFromCache(char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// Average time in ms to read `file` (write == 0) or to write it back (write == 1) with the given
+// backend. Cold reads drop the file from the page cache first; cold writes create a new file
+// instead of overwriting the last one. write == 2 is the old write_bitmap, for comparison.
+double benchIO(int backend, int write, int cold, char* file) {
+    bmp_io_backend = backend;
+    read_bitmap(file, bench_image_a);
+    double total = 0;
+    for (int r = 0; r < IO_REPETITIONS; r++) {
+        if (cold) {
+            if (write) {
+                unlink(IO_OUTPUT);
+            } else {
+                dropFromCache(file);
+            }
+        }
+        double start = now_seconds();
+        if (write == 2) {
+            legacyWrite(bench_image_a, IO_OUTPUT);
+        } else if (write) {
+            write_bitmap(bench_image_a, IO_OUTPUT);
+        } else {
+            read_bitmap_binary(file, BINARY_COLOUR_THRESHOLD, bench_binary_a, bench_image_a);
+        }
+        total += now_seconds() - start;
+    }
+    bmp_io_backend = BMP_IO_STDIO;
+    return total * 1000 / IO_REPETITIONS;
+}
+
+// Golden test: erode and detect the file with the full and the packed engine. Both must make the
+// same passes and detections and draw the same image.
+int checkPackedEngine(char* file) {
+    static unsigned char binary_copy[BMP_WIDTH][BMP_HEIGTH];
+    int iterations, packed_iterations;
+    read_bitmap_binary(file, BINARY_COLOUR_THRESHOLD, bench_binary_a, bench_image_a);
+    memcpy(binary_copy, bench_binary_a, sizeof(binary_copy));
+    memcpy(bench_image_b, bench_image_a, sizeof(bench_image_a));
+    int cells = erodeAndDetect(&bench_session, bench_binary_a, bench_image_a, ENGINE_FULL, &iterations);
+    detection* expected = (detection*) malloc((cells + 1) * sizeof(detection));
+    int count = bench_session.detections.size;
+    memcpy(expected, bench_session.detections.items, count * sizeof(detection));
+    int packed_cells = erodeAndDetect(&bench_session, binary_copy, bench_image_b, ENGINE_PACKED, &packed_iterations);
+    int same = packed_cells == cells && packed_iterations == iterations && bench_session.detections.size == count
+        && memcmp(bench_session.detections.items, expected, count * sizeof(detection)) == 0
+        && memcmp(bench_image_a, bench_image_b, sizeof(bench_image_a)) == 0;
+    free(expected);
+    if (!same) {
+        fprintf(stderr, "the packed engine does not match the full engine on %s\n", file);
+    }
+    return same;
+}
+
+// Golden test: erode the thresholded file with erode and erodePacked side by side until the
+// image stops changing, and check the images and wasEroded flags agree after every pass.
+int checkErodePacked(char* file) {
+    read_bitmap_binary(file, BINARY_COLOUR_THRESHOLD, bench_binary_a, NULL);
+    packBinary(bench_binary_a, bench_packed_a);
+    char wasEroded = 1;
+    for (int pass = 1; wasEroded && pass <= 100; pass++) {
+        wasEroded = erode(&bench_session, bench_binary_a, bench_image_a);
+        char packedWasEroded = erodePacked(bench_packed_a, bench_packed_b);
+        memcpy(bench_packed_a, bench_packed_b, sizeof(bench_packed_a));
+        unpackBinary(bench_packed_a, bench_binary_b);
+        if (wasEroded != packedWasEroded || memcmp(bench_binary_a, bench_binary_b, sizeof(bench_binary_a)) != 0) {
+            fprintf(stderr, "erodePacked does not match erode on %s after pass %d\n", file, pass);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Golden test: after every erosion pass of the file, run detectParallel and detectNaive on copies
+// of the binary image and check they find the same cells, clear the same pixels and draw the same
+// image. The time spent in each is added to detect_ms and naive_ms.
+int checkDetect(char* file, double* detect_ms, double* naive_ms) {
+    static unsigned char binary_copy[BMP_WIDTH][BMP_HEIGTH];
+    read_bitmap_binary(file, BINARY_COLOUR_THRESHOLD, bench_binary_a, bench_image_a);
+    memcpy(bench_image_b, bench_image_a, sizeof(bench_image_a));
+    char wasEroded = 1;
+    for (int pass = 1; wasEroded && pass <= 100; pass++) {
+        wasEroded = erode(&bench_session, bench_binary_a, bench_image_a);
+        memcpy(binary_copy, bench_binary_a, sizeof(binary_copy));
+        double start = now_seconds();
+        int cells = detectParallel(&bench_session, bench_binary_a, bench_image_a, NULL);
+        double middle = now_seconds();
+        int naive_cells = detectNaive(&bench_session, binary_copy, bench_image_b, NULL);
+        *detect_ms += (middle - start) * 1000.0;
+        *naive_ms += (now_seconds() - middle) * 1000.0;
+        if (cells != naive_cells || memcmp(bench_binary_a, binary_copy, sizeof(binary_copy)) != 0
+            || memcmp(bench_image_a, bench_image_b, sizeof(bench_image_a)) != 0) {
+            fprintf(stderr, "detectParallel does not match detectNaive on %s after pass %d\n", file, pass);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Copy the fixed array data (width x height x channels bytes) into img, with `padding` extra bytes
+// after every column so that img does not have the fixed layout.
+void copyToPaddedImage(unsigned char* data, int channels, int padding, image* img) {
+    image_free(img);
+    img->width = BMP_WIDTH;
+    img->height = BMP_HEIGTH;
+    img->channels = channels;
+    img->stride = BMP_HEIGTH * channels + padding;
+    img->capacity = (size_t) BMP_WIDTH * img->stride;
+    img->data = (unsigned char*) calloc(img->capacity, 1);
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        memcpy(img->data + (size_t) x * img->stride, data + (size_t) x * BMP_HEIGTH * channels, BMP_HEIGTH * channels);
+    }
+}
+
+// Check that the runtime-sized pipeline (erodeAndDetectSized on images without the fixed layout)
+// finds the same cells as the fixed-size one, and add the time of both to fixed_ms and sized_ms.
+int checkSized(char* file, double* fixed_ms, double* sized_ms) {
+    static image binary;
+    static image rgb;
+    int iterations;
+    read_bitmap_binary(file, BINARY_COLOUR_THRESHOLD, bench_binary_a, bench_image_a);
+    copyToPaddedImage(&bench_binary_a[0][0], 1, 64, &binary);
+    copyToPaddedImage(&bench_image_a[0][0][0], BMP_CHANNELS, 64, &rgb);
+    double start = now_seconds();
+    int cells = erodeAndDetect(&bench_session, bench_binary_a, bench_image_a, ENGINE_FULL, &iterations);
+    double middle = now_seconds();
+    int sized_cells = erodeAndDetectSized(&bench_session, &binary, &rgb, ENGINE_FULL, &iterations);
+    *fixed_ms += (middle - start) * 1000.0;
+    *sized_ms += (now_seconds() - middle) * 1000.0;
+    int same = cells == sized_cells;
+    for (int x = 0; same && x < BMP_WIDTH; x++) {
+        same = memcmp(rgb.data + (size_t) x * rgb.stride, bench_image_a[x], sizeof(bench_image_a[x])) == 0;
+    }
+    if (!same) {
+        fprintf(stderr, "erodeAndDetectSized does not match erodeAndDetect on %s\n", file);
+    }
+    return same;
+}
+
+// Golden test: with a minimum separation of r, every engine must keep exactly the detections made
+// without it that are not closer than r to an earlier kept one, found by comparing every pair.
+// The number of detections kept is added to *kept.
+int checkSeparation(char* file, int r, int* kept) {
+    int iterations;
+    read_bitmap_binary(file, BINARY_COLOUR_THRESHOLD, bench_binary_a, bench_image_a);
+    memcpy(bench_binary_b, bench_binary_a, sizeof(bench_binary_a));
+    detection_min_separation = 0;
+    int cells = erodeAndDetect(&bench_session, bench_binary_a, NULL, ENGINE_FULL, &iterations);
+    detection* all = (detection*) malloc((cells + 1) * sizeof(detection));
+    detection* expected = (detection*) malloc((cells + 1) * sizeof(detection));
+    memcpy(all, bench_session.detections.items, cells * sizeof(detection));
+    int count = 0;
+    for (int i = 0; i < cells; i++) {
+        int near = 0;
+        for (int j = 0; j < count && !near; j++) {
+            int dx = all[i].x - expected[j].x;
+            int dy = all[i].y - expected[j].y;
+            near = dx * dx + dy * dy < r * r;
+        }
+        if (!near) {
+            expected[count++] = all[i];
+        }
+    }
+    *kept += count;
+    detection_min_separation = r;
+    int same = 1;
+    for (int engine = ENGINE_FULL; same && engine <= ENGINE_PACKED; engine++) {
+        memcpy(bench_binary_a, bench_binary_b, sizeof(bench_binary_a));
+        same = erodeAndDetect(&bench_session, bench_binary_a, NULL, engine, &iterations) == count && bench_session.detections.size == count;
+        for (int i = 0; same && i < count; i++) {
+            same = bench_session.detections.items[i].x == expected[i].x && bench_session.detections.items[i].y == expected[i].y;
+        }
+        if (!same) {
+            fprintf(stderr, "minimum separation %d keeps other detections with engine %d on %s\n", r, engine, file);
+        }
+    }
+    detection_min_separation = 0;
+    free(all);
+    free(expected);
+    return same;
+}
+
+// Golden test: with the scheduler on (see schedule.c), the engine must make the same detections
+// and draw the same image as with it off, in as many passes less as it reports saved. The times
+// are added to on_ms and off_ms, and the detect calls skipped and passes saved to *skipped and
+// *saved.
+int checkSchedule(char* file, int engine, double* on_ms, double* off_ms, int* skipped, int* saved) {
+    static unsigned char input_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS];
+    static unsigned char off_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS];
+    int iterations[2];
+    int cells[2];
+    detection* off_detections = NULL;
+    read_bitmap_binary(file, BINARY_COLOUR_THRESHOLD, bench_binary_b, input_image);
+    for (int on = 0; on < 2; on++) {
+        memcpy(bench_binary_a, bench_binary_b, sizeof(bench_binary_a));
+        memcpy(bench_image_a, input_image, sizeof(bench_image_a));
+        schedule_enabled = on;
+        double start = now_seconds();
+        cells[on] = erodeAndDetect(&bench_session, bench_binary_a, bench_image_a, engine, &iterations[on]);
+        double elapsed = (now_seconds() - start) * 1000.0;
+        if (on) {
+            *on_ms += elapsed;
+            *skipped += bench_session.detects_skipped;
+            *saved += bench_session.passes_saved;
+        } else {
+            *off_ms += elapsed;
+            off_detections = (detection*) malloc((cells[0] + 1) * sizeof(detection));
+            memcpy(off_detections, bench_session.detections.items, cells[0] * sizeof(detection));
+            memcpy(off_image, bench_image_a, sizeof(off_image));
+        }
+    }
+    int same = cells[1] == cells[0] && iterations[1] + bench_session.passes_saved == iterations[0]
+        && memcmp(bench_image_a, off_image, sizeof(off_image)) == 0;
+    for (int i = 0; same && i < cells[0]; i++) {
+        same = bench_session.detections.items[i].x == off_detections[i].x && bench_session.detections.items[i].y == off_detections[i].y;
+    }
+    if (!same) {
+        fprintf(stderr, "the scheduler changes the result of engine %d on %s\n", engine, file);
+    }
+    free(off_detections);
+    return same;
+}
+
+// Golden test: label the components of the thresholded file with labelComponents, and with a flood
+// fill from every white pixel not reached yet, and check that both find the same components,
+// numbered in the same order, with the same area, coordinate sums and bounding box. The time of
+// each is added to label_ms and flood_ms.
+int checkComponents(char* file, double* label_ms, double* flood_ms) {
+    static int component_of[BMP_WIDTH][BMP_HEIGTH];
+    static int stack[BMP_WIDTH * BMP_HEIGTH];
+    static component_stats flood[(BMP_WIDTH + 1) / 2 * ((BMP_HEIGTH + 1) / 2) + 1];
+    read_bitmap_binary(file, BINARY_COLOUR_THRESHOLD, bench_binary_a, bench_image_a);
+    double start = now_seconds();
+    int count = labelComponents(&bench_session, &bench_binary_a[0][0], BMP_WIDTH, BMP_HEIGTH, BMP_HEIGTH);
+    double middle = now_seconds();
+    memset(component_of, 0, sizeof(component_of));
+    int flood_count = 0;
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        for (int y = 0; y < BMP_HEIGTH; y++) {
+            if (!bench_binary_a[x][y] || component_of[x][y]) {
+                continue;
+            }
+            component_stats* c = &flood[++flood_count];
+            memset(c, 0, sizeof(*c));
+            c->x_min = c->x_max = x;
+            c->y_min = c->y_max = y;
+            int top = 0;
+            stack[top++] = x * BMP_HEIGTH + y;
+            component_of[x][y] = flood_count;
+            while (top > 0) {
+                int px = stack[--top] / BMP_HEIGTH;
+                int py = stack[top] % BMP_HEIGTH;
+                c->area++;
+                c->sum_x += px;
+                c->sum_y += py;
+                if (px < c->x_min) c->x_min = px;
+                if (py < c->y_min) c->y_min = py;
+                if (px > c->x_max) c->x_max = px;
+                if (py > c->y_max) c->y_max = py;
+                for (int nx = px - 1; nx <= px + 1; nx++) {
+                    for (int ny = py - 1; ny <= py + 1; ny++) {
+                        if (nx >= 0 && ny >= 0 && nx < BMP_WIDTH && ny < BMP_HEIGTH && bench_binary_a[nx][ny] && !component_of[nx][ny]) {
+                            component_of[nx][ny] = flood_count;
+                            stack[top++] = nx * BMP_HEIGTH + ny;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    *label_ms += (middle - start) * 1000.0;
+    *flood_ms += (now_seconds() - middle) * 1000.0;
+    label_state* state = bench_session.labels;
+    int same = count == flood_count;
+    for (int x = 0; same && x < BMP_WIDTH; x++) {
+        for (int y = 0; same && y < BMP_HEIGTH; y++) {
+            if (!bench_binary_a[x][y]) {
+                continue;
+            }
+            component_stats* c = &state->components[state->parents[state->labels[x * BMP_HEIGTH + y]]];
+            component_stats* f = &flood[component_of[x][y]];
+            same = c->id == component_of[x][y] && c->area == f->area && c->sum_x == f->sum_x && c->sum_y == f->sum_y
+                && c->x_min == f->x_min && c->y_min == f->y_min && c->x_max == f->x_max && c->y_max == f->y_max;
+        }
+    }
+    if (!same) {
+        fprintf(stderr, "labelComponents does not match the flood fill on %s\n", file);
+    }
+    return same;
+}
+
+// True if the two tables hold the same cells in the same order.
+int sameCellTables(cell_table* a, cell_table* b) {
+    if (a->size != b->size) {
+        return 0;
+    }
+    for (int i = 0; i < a->size; i++) {
+        cell_record* p = &a->items[i];
+        cell_record* q = &b->items[i];
+        if (p->x != q->x || p->y != q->y || p->step != q->step || p->component != q->component || p->area != q->area
+            || p->sum_x != q->sum_x || p->sum_y != q->sum_y || p->x_min != q->x_min || p->y_min != q->y_min
+            || p->x_max != q->x_max || p->y_max != q->y_max) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Sessions processing images at once in checkSessions, one per pthread.
+#define SESSION_THREADS 4
+#define MEMORY_ROUNDS 3
+
+// What a session of checkSessions found in one file.
+typedef struct session_result_data
+{
+    int cells;
+    detection* detections;
+    int detection_count;
+    cell_table table;
+    unsigned char* output;      // Contents of the file written.
+    long output_size;
+} session_result;
+
+// A pthread of checkSessions: every file, from files[first] on, processed with a session of its own.
+typedef struct session_run_data
+{
+    char** files;
+    int file_count;
+    int index;                  // Run of checkSessions, names the file the session writes.
+    int first;
+    int threads;                // Threads of the pool of the session.
+    session_result* results;    // One per file.
+} session_run;
+
+// Read, erode and detect, and write every file of the run, with the full, frontier, distance and
+// packed engines in turn.
+static void* sessionRun(void* arg) {
+    session_run* run = (session_run*) arg;
+    cells_session session;
+    sessionInit(&session, run->threads);
+    char output[64];
+    snprintf(output, sizeof(output), "bench_session_%d.bmp", run->index);
+    for (int i = 0; i < run->file_count; i++) {
+        int f = (run->first + i) % run->file_count;
+        session_result* result = &run->results[f];
+        int iterations;
+        memset(&result->table, 0, sizeof(result->table));
+        session.cell_records = &result->table;
+        read_bitmap_image(run->files[f], BINARY_COLOUR_THRESHOLD, &session.binary, &session.rgb);
+        result->cells = erodeAndDetectSized(&session, &session.binary, &session.rgb, f % 4, &iterations);
+        result->detection_count = session.detections.size;
+        result->detections = (detection*) malloc((session.detections.size + 1) * sizeof(detection));
+        memcpy(result->detections, session.detections.items, session.detections.size * sizeof(detection));
+        write_bitmap_image(&session.rgb, output);
+        result->output_size = readWholeFile(output, &result->output);
+    }
+    remove(output);
+    sessionFree(&session);
+    return NULL;
+}
+
+static void freeSessionResults(session_result* results, int file_count) {
+    for (int f = 0; f < file_count; f++) {
+        free(results[f].detections);
+        free(results[f].table.items);
+        free(results[f].output);
+    }
+    free(results);
+}
+
+// Golden test: process every file with one session, then with SESSION_THREADS sessions at once on
+// as many pthreads, each starting at another file and some with a thread pool of their own. Every
+// session must find the same cells, detections and cell table and write the same file as the one
+// session alone. The time per image is stored in *single_ms and, for the sessions at once, the
+// wall time divided by all the images they processed in *concurrent_ms.
+int checkSessions(char** files, int file_count, double* single_ms, double* concurrent_ms) {
+    session_run runs[SESSION_THREADS + 1];
+    pthread_t threads[SESSION_THREADS];
+    for (int t = 0; t <= SESSION_THREADS; t++) {
+        runs[t].files = files;
+        runs[t].file_count = file_count;
+        runs[t].index = t;
+        runs[t].first = t % file_count;
+        runs[t].threads = 1 + t % 2;
+        runs[t].results = (session_result*) calloc(file_count, sizeof(session_result));
+    }
+    // The last run is the reference, on this thread alone.
+    double start = now_seconds();
+    sessionRun(&runs[SESSION_THREADS]);
+    *single_ms = (now_seconds() - start) * 1000.0 / file_count;
+
+    start = now_seconds();
+    int started = 0;
+    for (; started < SESSION_THREADS; started++) {
+        if (pthread_create(&threads[started], NULL, sessionRun, &runs[started]) != 0) {
+            fprintf(stderr, "Could not start session thread %d\n", started);
+            break;
+        }
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    *concurrent_ms = (now_seconds() - start) * 1000.0 / (started * file_count);
+
+    session_result* expected = runs[SESSION_THREADS].results;
+    int same = started == SESSION_THREADS;
+    for (int t = 0; same && t < SESSION_THREADS; t++) {
+        for (int f = 0; same && f < file_count; f++) {
+            session_result* result = &runs[t].results[f];
+            same = result->cells == expected[f].cells && result->detection_count == expected[f].detection_count
+                && memcmp(result->detections, expected[f].detections, result->detection_count * sizeof(detection)) == 0
+                && sameCellTables(&result->table, &expected[f].table)
+                && result->output_size > 0 && result->output_size == expected[f].output_size
+                && memcmp(result->output, expected[f].output, result->output_size) == 0;
+            if (!same) {
+                fprintf(stderr, "session %d gives another result than a single session on %s\n", t, files[f]);
+            }
+        }
+    }
+    for (int t = 0; t <= SESSION_THREADS; t++) {
+        freeSessionResults(runs[t].results, file_count);
+    }
+    return same;
+}
+
+// FNV-1a hash of the pixels of an image.
+static uint64_t hashImage(image* img) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t size = (size_t) img->stride * (img->layout == IMAGE_FILE_ROWS ? img->height : img->width);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ img->data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Page faults and buffers allocated per frame by checkMemory, while the buffers of the session and
+// of the images get their size (first round) and after that (steady).
+typedef struct memory_result_data
+{
+    double first_faults;
+    double first_allocations;
+    double steady_faults;
+    double steady_allocations;
+    double frame_ms;            // Time per frame after the first round.
+} memory_result;
+
+// Process every file MEMORY_ROUNDS times with one session, as main does (load + erode and detect
+// with the frontier engine + write), and count the page faults and buffers allocated per frame.
+// hashes gets a hash of the image written for every file in the last round, or, if check is set,
+// is compared with it: returns 0 if an image differs.
+int checkMemory(char** files, int file_count, uint64_t* hashes, int check, memory_result* result) {
+    cells_session session;
+    sessionInit(&session, 1);
+    int same = 1;
+    for (int round = 0; round < MEMORY_ROUNDS; round++) {
+        profile_repetition before = { 0 }, after = { 0 };
+        profileFaults(&before);
+        double start = now_seconds();
+        for (int f = 0; f < file_count; f++) {
+            int iterations;
+            read_bitmap_image(files[f], BINARY_COLOUR_THRESHOLD, &session.binary, &session.rgb);
+            erodeAndDetectSized(&session, &session.binary, &session.rgb, ENGINE_FRONTIER, &iterations);
+            write_bitmap_image(&session.rgb, IO_OUTPUT);
+            if (round == MEMORY_ROUNDS - 1) {
+                // A hash of the pixels written, so nothing is read back or allocated in the loop.
+                uint64_t hash = hashImage(&session.rgb);
+                if (check && hashes[f] != hash) {
+                    fprintf(stderr, "huge pages change the image written for %s\n", files[f]);
+                    same = 0;
+                }
+                hashes[f] = hash;
+            }
+        }
+        double seconds = now_seconds() - start;
+        profileFaults(&after);
+        double faults = (double) (after.minor_faults + after.major_faults - before.minor_faults - before.major_faults) / file_count;
+        double allocations = (double) (after.allocations - before.allocations) / file_count;
+        if (round == 0) {
+            result->first_faults = faults;
+            result->first_allocations = allocations;
+        } else {
+            result->steady_faults += faults / (MEMORY_ROUNDS - 1);
+            result->steady_allocations += allocations / (MEMORY_ROUNDS - 1);
+            result->frame_ms += seconds * 1000.0 / file_count / (MEMORY_ROUNDS - 1);
+        }
+    }
+    remove(IO_OUTPUT);
+    sessionFree(&session);
+    return same;
+}
+
+// What checkPipeline expects of every image, and what the pipeline gave.
+typedef struct pipeline_check_data
+{
+    int* cells;
+    uint64_t* hashes;
+    int mismatches;
+} pipeline_check;
+
+// Compare an image the pipeline has written with the one processed without it.
+static void checkPipelineFrame(void* arg, pipeline_frame* frame, int stage) {
+    pipeline_check* check = (pipeline_check*) arg;
+    if (stage == PIPELINE_WRITE && (frame->cells != check->cells[frame->index] || hashImage(&frame->rgb) != check->hashes[frame->index])) {
+        check->mismatches++;
+    }
+}
+
+// Golden test: process every file one step after the other with a session, as main does without
+// --pipeline, then with runPipeline. Every image must have the same cells and be written the same.
+// The times per image are stored in *sequential_ms and *pipelined_ms, the stages in *stats.
+int checkPipeline(char** files, int file_count, double* sequential_ms, double* pipelined_ms, pipeline_stats* stats) {
+    pipeline_check check = { (int*) malloc(file_count * sizeof(int)), (uint64_t*) malloc(file_count * sizeof(uint64_t)), 0 };
+    char** outputs = (char**) malloc(file_count * sizeof(char*));
+    cells_session session;
+    sessionInit(&session, 1);
+    double start = now_seconds();
+    for (int f = 0; f < file_count; f++) {
+        int iterations;
+        read_bitmap_image(files[f], BINARY_COLOUR_THRESHOLD, &session.binary, &session.rgb);
+        check.cells[f] = erodeAndDetectSized(&session, &session.binary, &session.rgb, ENGINE_FRONTIER, &iterations);
+        write_bitmap_image(&session.rgb, IO_OUTPUT);
+        check.hashes[f] = hashImage(&session.rgb);
+        outputs[f] = IO_OUTPUT;
+    }
+    *sequential_ms = (now_seconds() - start) * 1000.0 / file_count;
+
+    pipeline_job job = { files, outputs, file_count, NULL, checkPipelineFrame, &check, ENGINE_FRONTIER };
+    int processed = runPipeline(&session, &job, stats);
+    *pipelined_ms = stats->seconds * 1000.0 / file_count;
+    sessionFree(&session);
+    remove(IO_OUTPUT);
+
+    int same = processed == file_count && check.mismatches == 0;
+    if (!same) {
+        fprintf(stderr, "the pipeline processed %d of %d images, %d of them differently\n", processed, file_count, check.mismatches);
+    }
+    free(check.cells);
+    free(check.hashes);
+    free(outputs);
+    return same;
+}
+
+// Run erosion passes until the image stops changing and return the average time per pass in ms.
+// mode 0 uses erode (in place), mode 1 swaps two images with erodeInto, mode 2 uses erodePacked,
+// mode 3 uses the frontier engine.
+double benchErode(int mode, char** files, int file_count) {
+    int passes = 0;
+    double elapsed = 0;
+    for (int f = 0; f < file_count; f++) {
+        read_bitmap_binary(files[f], BINARY_COLOUR_THRESHOLD, bench_binary_a, NULL);
+        packBinary(bench_binary_a, bench_packed_a);
+        double start = now_seconds();
+        if (mode == 3) {
+            frontierInit(&bench_frontier, bench_binary_a);
+        }
+        char wasEroded = 1;
+        for (int pass = 1; wasEroded && pass <= 100; pass++) {
+            if (mode == 0) {
+                wasEroded = erode(&bench_session, bench_binary_a, bench_image_a);
+            } else if (mode == 3) {
+                wasEroded = frontierErode(&bench_frontier, bench_binary_a);
+            } else if (mode == 1) {
+                wasEroded = pass % 2 ? erodeInto(&bench_session, bench_binary_a, bench_binary_b) : erodeInto(&bench_session, bench_binary_b, bench_binary_a);
+            } else if (pass % 2) {
+                wasEroded = erodePacked(bench_packed_a, bench_packed_b);
+            } else {
+                wasEroded = erodePacked(bench_packed_b, bench_packed_a);
+            }
+            passes++;
+        }
+        elapsed += now_seconds() - start;
+    }
+    return elapsed * 1000.0 / passes;
+}
+
+// erodeBand as it was before the structuring elements could be chosen, with the default element
+// hard-coded and tested entry by entry, to compare the unrolled kernels with.
+char legacyErodeBand(unsigned char src[BMP_WIDTH][BMP_HEIGTH], unsigned char dst[BMP_WIDTH][BMP_HEIGTH], int x_begin, int x_end) {
+    static const int legacy_element[3][3] = {
+        {1, 1, 0},
+        {1, 1, 1},
+        {1, 1, 0}
+    };
+    char wasEroded = 0;
+    for (int x = x_begin; x < x_end; x++) {
+        for (int y = 1; y < BMP_HEIGTH - 1; y++) {
+            int erosion_result = 0;
+            if (src[x][y]) {
+                erosion_result = 1;
+                for (int i = 0; i < 3; i++) {
+                    for (int j = 0; j < 3; j++) {
+                        if (legacy_element[i][j] == 1 && src[x + i - 1][y + j - 1] == 0) {
+                            erosion_result = 0;
+                            wasEroded = 1;
+                        }
+                    }
+                }
+            }
+            dst[x][y] = erosion_result;
+        }
+        dst[x][0] = 0;
+        dst[x][BMP_HEIGTH - 1] = 0;
+    }
+    return wasEroded;
+}
+
+// Golden test: with erosion_element, erode the thresholded file with `kernel` (or step by step, if
+// the element is decomposed) and with erodeBandGeneric, the brute-force loop over the entries,
+// side by side until the image stops changing, and check the images and wasEroded flags agree
+// after every pass. The time of each is added to kernel_ms and generic_ms, and the number of
+// passes to *passes.
+int checkKernel(char* file, erode_kernel kernel, double* kernel_ms, double* generic_ms, int* passes) {
+    erode_kernel selected = erosion_element->kernel;
+    int steps = erosion_element->step_count;
+    read_bitmap_binary(file, BINARY_COLOUR_THRESHOLD, bench_binary_a, NULL);
+    memcpy(bench_binary_c, bench_binary_a, sizeof(bench_binary_c));
+    char wasEroded = 1;
+    int same = 1;
+    for (int pass = 1; same && wasEroded && pass <= 100; pass++) {
+        erosion_element->kernel = kernel;
+        erosion_element->step_count = steps;
+        double start = now_seconds();
+        wasEroded = pass % 2 ? erodeInto(&bench_session, bench_binary_a, bench_binary_b) : erodeInto(&bench_session, bench_binary_b, bench_binary_a);
+        double middle = now_seconds();
+        erosion_element->kernel = erodeBandGeneric;
+        erosion_element->step_count = 0;
+        char genericWasEroded = pass % 2 ? erodeInto(&bench_session, bench_binary_c, bench_binary_d) : erodeInto(&bench_session, bench_binary_d, bench_binary_c);
+        *kernel_ms += (middle - start) * 1000.0;
+        *generic_ms += (now_seconds() - middle) * 1000.0;
+        (*passes)++;
+        same = wasEroded == genericWasEroded
+            && (pass % 2 ? memcmp(bench_binary_b, bench_binary_d, sizeof(bench_binary_b))
+                         : memcmp(bench_binary_a, bench_binary_c, sizeof(bench_binary_a))) == 0;
+    }
+    erosion_element->kernel = selected;
+    erosion_element->step_count = steps;
+    if (!same) {
+        fprintf(stderr, "the %s kernel does not match erodeBandGeneric on %s\n", erosion_element->name, file);
+    }
+    return same;
+}
+
+// Run the erosion and detection loop on every file with the given engine and return the average
+// time per image in ms. The cell counts and annotated images are stored in cells and images.
+double benchEngine(int engine, char** files, int file_count, int* cells) {
+    double elapsed = 0;
+    for (int f = 0; f < file_count; f++) {
+        int iterations;
+        read_bitmap_binary(files[f], BINARY_COLOUR_THRESHOLD, bench_binary_a, bench_image_a);
+        double start = now_seconds();
+        cells[f] = erodeAndDetect(&bench_session, bench_binary_a, bench_image_a, engine, &iterations);
+        elapsed += now_seconds() - start;
+    }
+    return elapsed * 1000.0 / file_count;
+}
+
+// Stages of the suite. Each one but end_to_end runs on its own, on inputs prepared beforehand.
+#define SUITE_STAGES 6
+static const char* suite_stage_names[SUITE_STAGES] = { "load", "erode", "count", "detect", "write", "end_to_end" };
+
+// Per file: the binary image as loaded, and the image the detection with the most cells ran on.
+static unsigned char (*suite_binary)[BMP_WIDTH][BMP_HEIGTH];
+static unsigned char (*suite_detect)[BMP_WIDTH][BMP_HEIGTH];
+
+static int compareStrings(const void* a, const void* b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+// Add the .bmp files of directory to the list, sorted by name.
+void addBitmaps(const char* directory, char*** files, int* file_count) {
+    DIR* dir = opendir(directory);
+    if (dir == NULL) {
+        return;
+    }
+    int first = *file_count;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length < 4 || strcmp(entry->d_name + length - 4, ".bmp") != 0) {
+            continue;
+        }
+        char* path = malloc(strlen(directory) + length + 2);
+        sprintf(path, "%s/%s", directory, entry->d_name);
+        *files = realloc(*files, (*file_count + 1) * sizeof(char*));
+        (*files)[(*file_count)++] = path;
+    }
+    closedir(dir);
+    qsort(*files + first, *file_count - first, sizeof(char*), compareStrings);
+}
+
+// Pin the benchmark to one CPU, or to the one it runs on if cpu < 0. Returns the CPU, or -1.
+int pinToCpu(int cpu) {
+#ifdef __linux__
+    if (cpu < 0) {
+        cpu = sched_getcpu();
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (cpu >= 0 && sched_setaffinity(0, sizeof(set), &set) == 0) {
+        return cpu;
+    }
+#endif
+    return -1;
+}
+
+// Load the files and prepare the inputs of the erode, count and detect stages.
+void suitePrepare(char** files, int file_count) {
+    suite_binary = malloc(file_count * sizeof(*suite_binary));
+    suite_detect = malloc(file_count * sizeof(*suite_detect));
+    for (int f = 0; f < file_count; f++) {
+        read_bitmap_binary(files[f], BINARY_COLOUR_THRESHOLD, suite_binary[f], bench_image_a);
+        memcpy(suite_detect[f], suite_binary[f], sizeof(suite_detect[f]));
+        memcpy(bench_binary_a, suite_binary[f], sizeof(bench_binary_a));
+        int best = 0;
+        for (int pass = 1; pass <= MAX_EROSIONS; pass++) {
+            erodeInto(&bench_session, bench_binary_a, bench_binary_b);
+            if (countWhitePixels(bench_binary_b) == 0) {
+                break;
+            }
+            memcpy(bench_binary_a, bench_binary_b, sizeof(bench_binary_a));
+            int cells = detectParallel(&bench_session, bench_binary_a, bench_image_a, NULL);
+            if (cells > best) {
+                best = cells;
+                memcpy(suite_detect[f], bench_binary_b, sizeof(suite_detect[f]));
+            }
+        }
+    }
+}
+
+// Run every stage of the suite once over all files and add the time of each to seconds.
+void suiteRepetition(char** files, int file_count, double seconds[SUITE_STAGES]) {
+    for (int f = 0; f < file_count; f++) {
+        double start = now_seconds();
+        read_bitmap_image(files[f], BINARY_COLOUR_THRESHOLD, &bench_binary_image, &bench_rgb_image);
+        seconds[0] += now_seconds() - start;
+
+        start = now_seconds();
+        erodeInto(&bench_session, suite_binary[f], bench_binary_b);
+        seconds[1] += now_seconds() - start;
+
+        start = now_seconds();
+        volatile int white_pixels = countWhitePixels(suite_binary[f]);
+        (void) white_pixels;
+        seconds[2] += now_seconds() - start;
+
+        memcpy(bench_binary_a, suite_detect[f], sizeof(bench_binary_a));
+        start = now_seconds();
+        detectParallel(&bench_session, bench_binary_a, bench_image_a, NULL);
+        seconds[3] += now_seconds() - start;
+
+        start = now_seconds();
+        write_bitmap_image(&bench_rgb_image, IO_OUTPUT);
+        seconds[4] += now_seconds() - start;
+
+        // The whole pipeline, as main runs it with its default engine.
+        start = now_seconds();
+        int iterations;
+        read_bitmap_image(files[f], BINARY_COLOUR_THRESHOLD, &bench_binary_image, &bench_rgb_image);
+        erodeAndDetectSized(&bench_session, &bench_binary_image, &bench_rgb_image, ENGINE_FRONTIER, &iterations);
+        write_bitmap_image(&bench_rgb_image, IO_OUTPUT);
+        seconds[5] += now_seconds() - start;
+    }
+}
+
+// Read a baseline written by --save-baseline into baseline (ms per frame, 0 if missing).
+// Returns the number of files it was measured on, or -1 if it cannot be read.
+int readBaseline(char* path, double baseline[SUITE_STAGES]) {
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    int file_count = 0;
+    char line[256];
+    char name[64];
+    double value;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%63s %lf", name, &value) != 2) {
+            continue;
+        }
+        if (strcmp(name, "files") == 0) {
+            file_count = (int) value;
+        }
+        for (int stage = 0; stage < SUITE_STAGES; stage++) {
+            if (strcmp(name, suite_stage_names[stage]) == 0) {
+                baseline[stage] = value;
+            }
+        }
+    }
+    fclose(fp);
+    return file_count;
+}
+
+// The benchmark suite (--suite). Returns the exit code: 1 if a stage regressed against the baseline.
+int runSuite(char** files, int file_count, int repetitions, int warmup, int cpu, char* baseline_path, char* save_path, double threshold) {
+    int pinned = pinToCpu(cpu);
+    suitePrepare(files, file_count);
+
+    double* seconds = calloc((size_t) repetitions * SUITE_STAGES, sizeof(double));
+    double scratch[SUITE_STAGES];
+    for (int r = 0; r < warmup; r++) {
+        suiteRepetition(files, file_count, scratch);
+    }
+    for (int r = 0; r < repetitions; r++) {
+        suiteRepetition(files, file_count, seconds + (size_t) r * SUITE_STAGES);
+    }
+    unlink(IO_OUTPUT);
+
+    double baseline[SUITE_STAGES] = { 0 };
+    int baseline_files = baseline_path != NULL ? readBaseline(baseline_path, baseline) : 0;
+    if (baseline_files < 0) {
+        fprintf(stderr, "Could not read the baseline %s\n", baseline_path);
+        return 1;
+    }
+    if (baseline_path != NULL && baseline_files != file_count) {
+        fprintf(stderr, "Warning: the baseline was measured on %d file(s), not %d\n", baseline_files, file_count);
+    }
+
+    printf("suite: %d file(s), median of %d repetition(s) after %d warmup, ", file_count, repetitions, warmup);
+    if (pinned >= 0) {
+        printf("pinned to CPU %d\n", pinned);
+    } else {
+        printf("not pinned\n");
+    }
+    printf("  %-10s %9s %9s %9s", "stage", "ms/frame", "MPixel/s", "frames/s");
+    if (baseline_path != NULL) {
+        printf(" %9s %8s", "baseline", "change");
+    }
+    printf("\n");
+
+    double frame_ms[SUITE_STAGES];
+    double* stage_seconds = malloc(repetitions * sizeof(double));
+    int regressions = 0;
+    for (int stage = 0; stage < SUITE_STAGES; stage++) {
+        for (int r = 0; r < repetitions; r++) {
+            stage_seconds[r] = seconds[(size_t) r * SUITE_STAGES + stage];
+        }
+        qsort(stage_seconds, repetitions, sizeof(double), compareDoubles);
+        double median = stage_seconds[(repetitions - 1) / 2];
+        frame_ms[stage] = median * 1000 / file_count;
+        printf("  %-10s %9.3f %9.1f %9.1f", suite_stage_names[stage], frame_ms[stage],
+               (double) BMP_WIDTH * BMP_HEIGTH * file_count / median / 1e6, file_count / median);
+        if (baseline[stage] > 0) {
+            double change = (frame_ms[stage] / baseline[stage] - 1) * 100;
+            printf(" %9.3f %+7.1f%%", baseline[stage], change);
+            if (change > threshold) {
+                printf("  REGRESSION");
+                regressions++;
+            }
+        }
+        printf("\n");
+    }
+
+    if (save_path != NULL) {
+        FILE* fp = fopen(save_path, "w");
+        if (fp == NULL) {
+            perror(save_path);
+            return 1;
+        }
+        fprintf(fp, "# bench.out --suite: median ms per frame of every stage\n");
+        fprintf(fp, "files %d\n", file_count);
+        for (int stage = 0; stage < SUITE_STAGES; stage++) {
+            fprintf(fp, "%s %.4f\n", suite_stage_names[stage], frame_ms[stage]);
+        }
+        fclose(fp);
+        printf("Baseline written to %s\n", save_path);
+    }
+    if (regressions > 0) {
+        printf("%d stage(s) more than %.0f%% slower than the baseline\n", regressions, threshold);
+    }
+    free(stage_seconds);
+    free(seconds);
+    return regressions > 0;
+}
+
+int main(int argc, char** argv) {
+    cells_verbose = 0;
+    save_snapshots = 0;
+
+    int suite = 0;
+    int repetitions = 5;
+    int warmup = 1;
+    int cpu = -1;
+    char* baseline_path = NULL;
+    char* save_path = NULL;
+    double threshold = 15;
+    char** files = malloc(argc * sizeof(char*));
+    int file_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--suite") == 0) {
+            suite = 1;
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repetitions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            warmup = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+            cpu = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--save-baseline") == 0 && i + 1 < argc) {
+            save_path = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else {
+            files[file_count++] = argv[i];
+        }
+    }
+    if (repetitions < 1 || warmup < 0) {
+        fprintf(stderr, "--repeat must be at least 1 and --warmup at least 0\n");
+        return 1;
+    }
+    if (suite) {
+        if (file_count == 0) {
+            files[file_count++] = "example.bmp";
+            char* directories[] = { "samples/easy", "samples/medium", "samples/hard", "samples/impossible" };
+            for (int d = 0; d < 4; d++) {
+                addBitmaps(directories[d], &files, &file_count);
+            }
+        }
+        return runSuite(files, file_count, repetitions, warmup, cpu, baseline_path, save_path, threshold);
+    }
+    if (file_count == 0) {
+        files[file_count++] = "example.bmp";
+    }
+
+    // Both decoders must produce the same image before their speed is compared.
+    for (int f = 0; f < file_count; f++) {
+        read_bitmap(files[f], bench_image_a);
+        read_bitmap_direct(files[f], bench_image_b);
+        if (memcmp(bench_image_a, bench_image_b, sizeof(bench_image_a)) != 0) {
+            fprintf(stderr, "read_bitmap_direct does not match read_bitmap on %s\n", files[f]);
+            return 1;
+        }
+        rgbToBinary(bench_image_a, bench_binary_a);
+        read_bitmap_binary(files[f], BINARY_COLOUR_THRESHOLD, bench_binary_b, bench_image_b);
+        if (memcmp(bench_binary_a, bench_binary_b, sizeof(bench_binary_a)) != 0
+            || memcmp(bench_image_a, bench_image_b, sizeof(bench_image_a)) != 0) {
+            fprintf(stderr, "read_bitmap_binary does not match rgbToBinary on %s\n", files[f]);
+            return 1;
+        }
+        if (!checkErodePacked(files[f]) || !checkPackedEngine(files[f])) {
+            return 1;
+        }
+    }
+
+    double legacy = benchDecode(read_bitmap, files, file_count, DECODE_REPETITIONS);
+    double direct = benchDecode(read_bitmap_direct, files, file_count, DECODE_REPETITIONS);
+
+    printf("decode: %d file(s), %d repetitions\n", file_count, DECODE_REPETITIONS);
+    printf("  read_bitmap        %8.1f frames/s\n", legacy);
+    printf("  read_bitmap_direct %8.1f frames/s (%.1fx)\n", direct, direct / legacy);
+
+    for (int f = 0; f < file_count; f++) {
+        if (!checkWriters(files[f])) {
+            return 1;
+        }
+    }
+    // Latency of one read (load + threshold) and one write of the first file, per backend.
+    printf("file I/O, %s, ms per file:\n", files[0]);
+    printf("                  cold read  warm read cold write warm write\n");
+    char* backend_names[] = { "stdio", "mmap" };
+    for (int backend = BMP_IO_STDIO; backend <= BMP_IO_MMAP; backend++) {
+        printf("  %-14s %10.3f %10.3f %10.3f %10.3f\n", backend_names[backend],
+               benchIO(backend, 0, 1, files[0]), benchIO(backend, 0, 0, files[0]),
+               benchIO(backend, 1, 1, files[0]), benchIO(backend, 1, 0, files[0]));
+    }
+    printf("  %-14s %10s %10s %10.3f %10.3f\n", "old writer", "", "",
+           benchIO(BMP_IO_STDIO, 2, 1, files[0]), benchIO(BMP_IO_STDIO, 2, 0, files[0]));
+    unlink(IO_OUTPUT);
+
+    double separate = benchLoadThreshold(0, files, file_count, DECODE_REPETITIONS);
+    double fused = benchLoadThreshold(1, files, file_count, DECODE_REPETITIONS);
+    double fused_mask = benchLoadThreshold(2, files, file_count, DECODE_REPETITIONS);
+    double file_rows = benchLoadThreshold(3, files, file_count, DECODE_REPETITIONS);
+    double file_rows_otsu = benchLoadThreshold(4, files, file_count, DECODE_REPETITIONS);
+
+    printf("load + threshold:\n");
+    printf("  read_bitmap_direct + rgbToBinary %8.1f frames/s\n", separate);
+    printf("  read_bitmap_binary (with RGB)    %8.1f frames/s (%.1fx)\n", fused, fused / separate);
+    printf("  read_bitmap_binary (mask only)   %8.1f frames/s (%.1fx)\n", fused_mask, fused_mask / separate);
+    printf("  read_bitmap_image (file rows)    %8.1f frames/s (%.1fx)\n", file_rows, file_rows / separate);
+    printf("  read_bitmap_image (otsu)         %8.1f frames/s (%.1fx)\n", file_rows_otsu, file_rows_otsu / separate);
+
+    double columns_ms = 0;
+    double rows_ms = 0;
+    for (int f = 0; f < file_count; f++) {
+        if (!checkFileRows(files[f], &columns_ms, &rows_ms)) {
+            return 1;
+        }
+    }
+    unlink(IO_OUTPUT);
+    printf("read and write back, per image:\n");
+    printf("  [x][y][c] arrays %8.2f ms\n", columns_ms / file_count);
+    printf("  file rows        %8.2f ms (%.1fx)\n", rows_ms / file_count, columns_ms / rows_ms);
+
+    double erode_ms = benchErode(0, files, file_count);
+    double into_ms = benchErode(1, files, file_count);
+    double packed_ms = benchErode(2, files, file_count);
+    double frontier_pass_ms = benchErode(3, files, file_count);
+
+    // Bytes read and written per pass: erode copies the image before eroding it (the old main
+    // loop made another, unused copy on top of that); erodeInto only reads src and writes dst.
+    double image_mb = sizeof(bench_binary_a) / 1e6;
+    double packed_mb = sizeof(bench_packed_a) / 1e6;
+    printf("erosion pass:\n");
+    printf("  erode (in place)    %8.3f ms, %5.2f MB moved\n", erode_ms, 4 * image_mb);
+    printf("  erodeInto ping-pong %8.3f ms, %5.2f MB moved (%.1fx)\n", into_ms, 2 * image_mb, erode_ms / into_ms);
+    printf("  erodePacked         %8.3f ms, %5.2f MB moved (%.1fx)\n", packed_ms, 2 * packed_mb, erode_ms / packed_ms);
+    printf("  frontierErode       %8.3f ms (%.1fx)\n", frontier_pass_ms, erode_ms / frontier_pass_ms);
+
+    // Every registry element: its unrolled kernel against erodeBandGeneric (and, for the default
+    // element, against the hard-coded loop it replaced), and the cells every engine finds with it.
+    printf("structuring elements, erosion pass:\n");
+    int* element_cells = malloc(file_count * sizeof(int));
+    int* element_engine_cells = malloc(file_count * sizeof(int));
+    for (int e = 0; e < structuring_element_count; e++) {
+        erosion_element = &structuring_elements[e];
+        double kernel_ms = 0, generic_ms = 0, legacy_ms = 0, unused_ms = 0;
+        int passes = 0, legacy_passes = 0;
+        for (int f = 0; f < file_count; f++) {
+            if (!checkKernel(files[f], erosion_element->kernel, &kernel_ms, &generic_ms, &passes)
+                || (e == 0 && !checkKernel(files[f], legacyErodeBand, &legacy_ms, &unused_ms, &legacy_passes))) {
+                return 1;
+            }
+        }
+        benchEngine(ENGINE_FULL, files, file_count, element_cells);
+        for (int engine = ENGINE_FRONTIER; engine <= ENGINE_PACKED; engine++) {
+            benchEngine(engine, files, file_count, element_engine_cells);
+            if (memcmp(element_cells, element_engine_cells, file_count * sizeof(int)) != 0) {
+                fprintf(stderr, "the engines do not find the same cells with the %s element\n", erosion_element->name);
+                return 1;
+            }
+        }
+        int total = 0;
+        for (int f = 0; f < file_count; f++) {
+            total += element_cells[f];
+        }
+        printf("  %-8s unrolled %6.3f ms, generic %6.3f ms (%.1fx)", erosion_element->name,
+               kernel_ms / passes, generic_ms / passes, generic_ms / kernel_ms);
+        if (e == 0) {
+            printf(", hard-coded before %6.3f ms (%.1fx)", legacy_ms / legacy_passes, legacy_ms / legacy_passes / (kernel_ms / passes));
+        }
+        printf(", %d cells\n", total);
+    }
+    erosion_element = &structuring_elements[0];
+
+    // Decomposed elements against the brute-force loop over the entries of their combination. The
+    // time per pass of the steps should hardly grow with the size of the element.
+    char* decomposed[] = { "disk:2", "rect:3x3", "rect:7x7", "rect:15x15", "rect:31x1", "rect:1x31", "rect:9x21", "diamond:3", "diamond:8", "disk:6" };
+    printf("decomposed elements, erosion pass:\n");
+    for (int e = 0; e < (int) (sizeof(decomposed) / sizeof(decomposed[0])); e++) {
+        selectStructuringElement(decomposed[e]);
+        double steps_ms = 0, brute_ms = 0;
+        int passes = 0;
+        for (int f = 0; f < file_count; f++) {
+            if (!checkKernel(files[f], erosion_element->kernel, &steps_ms, &brute_ms, &passes)) {
+                return 1;
+            }
+        }
+        printf("  %-10s %2d step(s) %6.3f ms, brute force %7.3f ms (%.1fx), %3d entries\n", decomposed[e],
+               erosion_element->step_count, steps_ms / passes, brute_ms / passes, brute_ms / steps_ms, erosion_element->count);
+    }
+    erosion_element = &structuring_elements[0];
+    free(element_cells);
+    free(element_engine_cells);
+
+    double detect_ms = 0;
+    double naive_ms = 0;
+    for (int f = 0; f < file_count; f++) {
+        if (!checkDetect(files[f], &detect_ms, &naive_ms)) {
+            return 1;
+        }
+    }
+    printf("detect, per image:\n");
+    printf("  detectNaive                %8.2f ms\n", naive_ms / file_count);
+    printf("  detectParallel             %8.2f ms (%.1fx)\n", detect_ms / file_count, naive_ms / detect_ms);
+
+    double fixed_ms = 0;
+    double sized_ms = 0;
+    for (int f = 0; f < file_count; f++) {
+        if (!checkSized(files[f], &fixed_ms, &sized_ms)) {
+            return 1;
+        }
+    }
+    printf("image size, full engine per image:\n");
+    printf("  950x950 specialization %8.2f ms\n", fixed_ms / file_count);
+    printf("  runtime-sized          %8.2f ms (%.1fx)\n", sized_ms / file_count, fixed_ms / sized_ms);
+
+    // Every engine must find the same cells as the full engine.
+    char* engine_names[] = { "full", "frontier", "distance", "packed" };
+    int engines = sizeof(engine_names) / sizeof(engine_names[0]);
+    int* reference_cells = malloc(file_count * sizeof(int));
+    int* engine_cells = malloc(file_count * sizeof(int));
+    printf("erode and detect, per image:\n");
+    double full_ms = benchEngine(ENGINE_FULL, files, file_count, reference_cells);
+    printf("  %-8s engine %8.2f ms\n", engine_names[ENGINE_FULL], full_ms);
+    for (int engine = 0; engine < engines; engine++) {
+        if (engine == ENGINE_FULL) {
+            continue;
+        }
+        double engine_ms = benchEngine(engine, files, file_count, engine_cells);
+        for (int f = 0; f < file_count; f++) {
+            if (engine_cells[f] != reference_cells[f]) {
+                fprintf(stderr, "%s engine found %d cells instead of %d in %s\n", engine_names[engine], engine_cells[f], reference_cells[f], files[f]);
+                return 1;
+            }
+        }
+        printf("  %-8s engine %8.2f ms (%.1fx)\n", engine_names[engine], engine_ms, full_ms / engine_ms);
+    }
+
+    // Fixed and Otsu threshold (--threshold otsu), frontier engine.
+    double fixed_pipeline_ms = 0, otsu_pipeline_ms = 0;
+    int fixed_passes = 0, otsu_passes = 0, otsu_sum = 0;
+    for (int f = 0; f < file_count; f++) {
+        int threshold = checkOtsu(files[f]);
+        if (threshold < 0) {
+            return 1;
+        }
+        otsu_sum += threshold;
+        for (int mode = 0; mode < 2; mode++) {
+            int iterations;
+            double start = now_seconds();
+            read_bitmap_image(files[f], mode ? THRESHOLD_OTSU : BINARY_COLOUR_THRESHOLD, &bench_binary_image, &bench_rgb_image);
+            erodeAndDetectSized(&bench_session, &bench_binary_image, &bench_rgb_image, ENGINE_FRONTIER, &iterations);
+            double elapsed = (now_seconds() - start) * 1000.0;
+            if (mode) {
+                otsu_pipeline_ms += elapsed;
+                otsu_passes += iterations;
+            } else {
+                fixed_pipeline_ms += elapsed;
+                fixed_passes += iterations;
+            }
+        }
+    }
+    printf("threshold, load + erode and detect per image:\n");
+    printf("  fixed %3d    %8.2f ms, %5.2f erosion passes\n", BINARY_COLOUR_THRESHOLD, fixed_pipeline_ms / file_count, (double) fixed_passes / file_count);
+    printf("  otsu (~%3d) %8.2f ms, %5.2f erosion passes (%.2fx)\n", otsu_sum / file_count, otsu_pipeline_ms / file_count,
+           (double) otsu_passes / file_count, fixed_pipeline_ms / otsu_pipeline_ms);
+
+    // Skipped detect calls and early stop (--no-schedule turns them off), full and frontier engines.
+    printf("scheduler, erode and detect per image:\n");
+    for (int engine = ENGINE_FULL; engine <= ENGINE_FRONTIER; engine++) {
+        double on_ms = 0, off_ms = 0;
+        int skipped = 0, saved = 0;
+        for (int f = 0; f < file_count; f++) {
+            if (!checkSchedule(files[f], engine, &on_ms, &off_ms, &skipped, &saved)) {
+                return 1;
+            }
+        }
+        schedule_enabled = 1;
+        printf("  %-8s engine off %8.2f ms, on %8.2f ms (%.2fx), %5.2f detect calls skipped, %4.2f passes saved\n", engine_names[engine],
+               off_ms / file_count, on_ms / file_count, off_ms / on_ms, (double) skipped / file_count, (double) saved / file_count);
+    }
+
+    // Duplicate suppression (--min-separation) against a scan of every pair.
+    int separations[] = { 8, 14, 24 };
+    printf("minimum separation, cells kept over all images:\n");
+    for (int s = 0; s < (int) (sizeof(separations) / sizeof(separations[0])); s++) {
+        int kept = 0;
+        for (int f = 0; f < file_count; f++) {
+            if (!checkSeparation(files[f], separations[s], &kept)) {
+                return 1;
+            }
+        }
+        printf("  %2d pixels %6d\n", separations[s], kept);
+    }
+
+    // The cell table (--cells) must be the same with every engine.
+    double label_ms = 0;
+    double flood_ms = 0;
+    for (int f = 0; f < file_count; f++) {
+        if (!checkComponents(files[f], &label_ms, &flood_ms)) {
+            return 1;
+        }
+    }
+    printf("cell table (--cells), per image:\n");
+    printf("  flood fill       %8.2f ms\n", flood_ms / file_count);
+    printf("  labelComponents  %8.2f ms (%.1fx)\n", label_ms / file_count, flood_ms / label_ms);
+    static cell_table engine_tables[4];
+    for (int engine = 0; engine < engines; engine++) {
+        bench_session.cell_records = &engine_tables[engine];
+        double table_ms = benchEngine(engine, files, file_count, engine_cells);
+        bench_session.cell_records = NULL;
+        int table_cells = 0;
+        for (int f = 0; f < file_count; f++) {
+            table_cells += engine_cells[f];
+        }
+        if (engine_tables[engine].size != table_cells) {
+            fprintf(stderr, "%s engine recorded %d cells instead of %d\n", engine_names[engine], engine_tables[engine].size, table_cells);
+            return 1;
+        }
+        if (!sameCellTables(&engine_tables[engine], &engine_tables[ENGINE_FULL])) {
+            fprintf(stderr, "%s engine gives a different cell table than the full engine\n", engine_names[engine]);
+            return 1;
+        }
+        printf("  %-8s engine with the table %8.2f ms\n", engine_names[engine], table_ms);
+    }
+
+    // Sessions (cells_session) processing images at once on pthreads must not affect each other.
+    double single_session_ms, concurrent_sessions_ms;
+    if (!checkSessions(files, file_count, &single_session_ms, &concurrent_sessions_ms)) {
+        return 1;
+    }
+    printf("sessions, load + erode and detect + write per image:\n");
+    printf("  1 session          %8.2f ms\n", single_session_ms);
+    printf("  %d sessions at once %8.2f ms (%.1fx)\n", SESSION_THREADS, concurrent_sessions_ms, single_session_ms / concurrent_sessions_ms);
+
+    // Page faults and allocations per frame of a session, with and without huge pages. After the
+    // first round every buffer is reused, so both should be about 0; huge pages must not change
+    // the images written.
+    uint64_t* memory_hashes = (uint64_t*) malloc(file_count * sizeof(uint64_t));
+    printf("memory per frame, one session (faults, buffers allocated):\n");
+    for (int huge = 0; huge <= 1; huge++) {
+        memory_result memory = { 0, 0, 0, 0, 0 };
+        bmp_huge_pages = huge;
+        int same = checkMemory(files, file_count, memory_hashes, huge, &memory);
+        bmp_huge_pages = 0;
+        if (!same) {
+            return 1;
+        }
+        printf("  huge pages %-3s  first %8.1f faults %5.2f buffers, then %6.1f faults %5.2f buffers, %8.2f ms\n",
+               huge ? "on" : "off", memory.first_faults, memory.first_allocations, memory.steady_faults, memory.steady_allocations, memory.frame_ms);
+    }
+    free(memory_hashes);
+
+    // Load, compute and write overlapped on three threads (see pipeline.c), against one after the
+    // other. On a single core the stages only take turns, so the pipeline cannot be faster there.
+    double sequential_ms, pipelined_ms;
+    pipeline_stats pipeline_times;
+    if (!checkPipeline(files, file_count, &sequential_ms, &pipelined_ms, &pipeline_times)) {
+        return 1;
+    }
+    printf("pipeline, load + erode and detect + write per image:\n");
+    printf("  one after the other %8.2f ms\n", sequential_ms);
+    printf("  pipelined           %8.2f ms (%.2fx)\n", pipelined_ms, sequential_ms / pipelined_ms);
+    pipelineReport(&pipeline_times);
+
+    // Snapshots of every pass with the full engine. The loop only queues them; the time snapshotStop
+    // then waits for the writer thread to finish is shown apart. Every run must find the same cells.
+    mkdir("results", 0777);
+    double off_ms = benchEngine(ENGINE_FULL, files, file_count, engine_cells);
+    printf("snapshots of every pass (results/step_*), full engine per image:\n");
+    printf("  off          %8.2f ms\n", off_ms);
+    char* format_names[] = { "bmp", "pbm" };
+    double snapshots_per_image = 0;
+    for (int format = SNAPSHOT_BMP; format <= SNAPSHOT_PBM; format++) {
+        snapshot_format = format;
+        save_snapshots = 1;
+        snapshots_queued = 0;
+        double snapshot_ms = benchEngine(ENGINE_FULL, files, file_count, engine_cells);
+        double drain_start = now_seconds();
+        int waited = snapshotStop();
+        double drain_ms = (now_seconds() - drain_start) * 1000.0 / file_count;
+        save_snapshots = 0;
+        snapshots_per_image = (double) snapshots_queued / file_count;
+        for (int f = 0; f < file_count; f++) {
+            if (engine_cells[f] != reference_cells[f]) {
+                fprintf(stderr, "snapshots changed the cells found in %s\n", files[f]);
+                return 1;
+            }
+        }
+        printf("  queued %s   %8.2f ms (%+.1f%%), then %.2f ms waiting for the writer, %d waited for a slot\n",
+               format_names[format], snapshot_ms, (snapshot_ms / off_ms - 1) * 100, drain_ms, waited);
+    }
+    snapshot_format = SNAPSHOT_BMP;
+
+    // What the loop used to spend on every snapshot: expand to RGB and write the bitmap.
+    read_bitmap_binary(files[0], BINARY_COLOUR_THRESHOLD, bench_binary_a, bench_image_a);
+    double sync_start = now_seconds();
+    for (int r = 0; r < IO_REPETITIONS; r++) {
+        binaryToRGB(bench_binary_a, bench_image_b);
+        write_bitmap(bench_image_b, "results/step_0.bmp");
+    }
+    double sync_ms = (now_seconds() - sync_start) * 1000.0 / IO_REPETITIONS;
+    printf("  written in the loop, as before: %.2f ms per snapshot, %.1f per image, about %.2f ms per image\n",
+           sync_ms, snapshots_per_image, off_ms + sync_ms * snapshots_per_image);
+
+    // Scaling of the full engine from 1 to N threads, N being the number of cores (at least 4, so
+    // the parallel path is checked on small machines too). Every run must find the same cells.
+    int cores = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cores < 4 ? 4 : cores;
+    if (max_threads > MAX_THREADS) max_threads = MAX_THREADS;
+    printf("full engine scaling, %d core(s), per image:\n", cores);
+    double single_ms = 0;
+    for (int threads = 1; threads <= max_threads; threads = threads * 2 > max_threads && threads < max_threads ? max_threads : threads * 2) {
+        threadPoolStart(&bench_session, threads);
+        double threads_ms = benchEngine(ENGINE_FULL, files, file_count, engine_cells);
+        for (int f = 0; f < file_count; f++) {
+            if (engine_cells[f] != reference_cells[f]) {
+                fprintf(stderr, "%d threads found %d cells instead of %d in %s\n", threads, engine_cells[f], reference_cells[f], files[f]);
+                return 1;
+            }
+        }
+        if (threads == 1) {
+            single_ms = threads_ms;
+        }
+        printf("  %2d thread(s) %8.2f ms (%.1fx)\n", threads, threads_ms, single_ms / threads_ms);
+    }
+    threadPoolStop(&bench_session);
+
+    free(reference_cells);
+    free(engine_cells);
+    return 0;
+}
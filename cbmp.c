@@ -1,7 +1,28 @@
+// fseeko/ftello and posix_madvise are POSIX, not C99. main.c and bench.c define these first when
+// they include this file.
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "cbmp.h"
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 // Constants
 
 #define BITS_PER_BYTE 8
@@ -23,6 +44,19 @@
 #define DEPTH_BYTES 2
 #define DEPTH_OFFSET 28
 
+#define THRESHOLD_BLOCK_ROWS 16
+
+// 64-bit file offsets, for bitmaps larger than 2 GB.
+#ifdef _WIN32
+#define _bseek _fseeki64
+#define _btell _ftelli64
+typedef long long _boffset;
+#else
+#define _bseek fseeko
+#define _btell ftello
+typedef off_t _boffset;
+#endif
+
 
 // Pixel structure
 typedef struct pixel_data
@@ -38,6 +72,13 @@ typedef struct BMP_data
 {
     unsigned int file_byte_number;
     unsigned char* file_byte_contents;
+    int mapped;                      // file_byte_contents is a read-only mapping of the file, not buffer.
+
+    unsigned char* buffer;           // Buffer the file is read into, kept to read the next one (see _bopen_reuse).
+    size_t buffer_size;
+    int buffer_mapped;               // See bmp_buffer_alloc.
+    unsigned char* flags;            // Threshold flags of THRESHOLD_BLOCK_ROWS rows, kept as well.
+    size_t flags_size;
 
     unsigned int pixel_array_start;
 
@@ -48,11 +89,81 @@ typedef struct BMP_data
     pixel* pixels;
 } BMP;
 
+// Template for write_bitmap, from the first bitmap read with the fixed-size functions.
 BMP* out_bmp = NULL;
 
+// How whole bitmaps are read and written, BMP_IO_STDIO or BMP_IO_MMAP (see cbmp.h).
+int bmp_io_backend = BMP_IO_STDIO;
+
+// Back large buffers with huge pages (see bmp_buffer_alloc), and the buffers allocated so far.
+int bmp_huge_pages = 0;
+long bmp_allocations = 0;
+
+// Bitmap file read or written a rectangle at a time (see bmp_stream_open).
+struct bmp_stream_data
+{
+    FILE* fp;
+    unsigned char* header;           // The first pixel_array_start bytes of the file.
+    unsigned int pixel_array_start;
+    int width;
+    int height;
+    unsigned int depth;
+    _boffset row_size;
+    unsigned char* row;              // One row of file bytes.
+    unsigned char* flags;            // Threshold flags of one row, see _threshold_row.
+    bmp_stream* source;              // For written files: the file the alpha channel comes from.
+};
+
 // Private (ex-public) function declarations
 BMP* bopen(char* file_path);
 BMP* b_deep_copy(BMP* to_copy);
+// Copy the header and file bytes of an image opened with _bopen_header, without a pixel array.
+// Used as the template for write_bitmap_image, which encodes straight into the file bytes.
+BMP* _b_bytes_copy(BMP* to_copy)
+{
+    BMP* copy = (BMP*) calloc(1, sizeof(BMP));
+    copy->file_byte_number = to_copy->file_byte_number;
+    copy->pixel_array_start = to_copy->pixel_array_start;
+    copy->width = to_copy->width;
+    copy->height = to_copy->height;
+    copy->depth = to_copy->depth;
+
+    copy->buffer = (unsigned char*) bmp_buffer_alloc(copy->file_byte_number, &copy->buffer_mapped);
+    copy->buffer_size = copy->file_byte_number;
+    copy->file_byte_contents = copy->buffer;
+    memcpy(copy->file_byte_contents, to_copy->file_byte_contents, copy->file_byte_number);
+    copy->mapped = 0;
+
+    copy->pixels = NULL;
+    return copy;
+}
+
+// Copy the header and file bytes of an image opened with _bopen_header, to be used as the
+// template for write_bitmap. Pixels are only seeded with the alpha channel, since
+// write_bitmap overwrites red, green and blue anyway.
+BMP* _b_template_copy(BMP* to_copy)
+{
+    BMP* copy = _b_bytes_copy(to_copy);
+    copy->pixels = (pixel*) calloc(copy->width * copy->height, sizeof(pixel));
+
+    int channels = copy->depth / BITS_PER_BYTE;
+    if (channels > ALPHA)
+    {
+        int row_size = ((int) (copy->depth * copy->width + 31) / 32) * 4;
+        unsigned int x, y;
+        for (y = 0; y < copy->height; y++)
+        {
+            unsigned char* row = copy->file_byte_contents + copy->pixel_array_start + y * row_size;
+            for (x = 0; x < copy->width; x++)
+            {
+                copy->pixels[y * copy->width + x].alpha = row[x * channels + ALPHA];
+            }
+        }
+    }
+
+    return copy;
+}
+
 int get_width(BMP* bmp);
 int get_height(BMP* bmp);
 unsigned int get_depth(BMP* bmp);
@@ -67,7 +178,7 @@ unsigned int _get_int_from_buffer(unsigned int bytes,
                                   unsigned int offset,
                                   unsigned char* buffer);
 unsigned int _get_file_byte_number(FILE* fp);
-unsigned char* _get_file_byte_contents(FILE* fp, unsigned int file_byte_number);
+void _read_file_byte_contents(FILE* fp, unsigned char* buffer, unsigned int file_byte_number);
 int _validate_file_type(unsigned char* file_byte_contents);
 int _validate_depth(unsigned int depth);
 unsigned int _get_pixel_array_start(unsigned char* file_byte_contents);
@@ -78,6 +189,23 @@ void _update_file_byte_contents(BMP* bmp, int index, int offset, int channel);
 void _populate_pixel_array(BMP* bmp);
 void _map(BMP* bmp, void (*f)(BMP* bmp, int, int, int));
 void _get_pixel(BMP* bmp, int index, int offset, int channel);
+BMP* _bopen_header(char* file_path);
+BMP* _bopen_reuse(char* file_path, BMP* bmp);
+void _b_release_contents(BMP* bmp);
+void _b_own_contents(BMP* bmp);
+BMP* _b_template_copy(BMP* to_copy);
+BMP* _b_bytes_copy(BMP* to_copy);
+void _decode_pixel_rows(BMP* bmp, unsigned char output_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]);
+void _threshold_row(unsigned char* row, int row_bytes, int threshold, unsigned char* flags);
+void _level_row(unsigned char* row, int row_bytes, unsigned char* levels);
+void _threshold_levels(unsigned char* levels, int count, unsigned char level);
+int _otsu_level(unsigned int histogram[4][256]);
+int _threshold_fixed_rows(BMP* bmp, int threshold, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char output_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]);
+void _encode_pixel_rows(BMP* bmp, unsigned char* rgb, int rgb_stride, unsigned char* file_bytes);
+void _write_encoded(BMP* bmp, unsigned char* rgb, int rgb_stride, char* file_path);
+void _write_file_rows(BMP* bmp, image* rgb, char* file_path);
+void _image_reserve(image* img, size_t size);
+unsigned char* _b_flags(BMP* bmp, size_t size);
 
 // Public function implementations
 void read_bitmap(char * input_file_path, unsigned char output_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]){
@@ -108,28 +236,550 @@ void read_bitmap(char * input_file_path, unsigned char output_image_array[BMP_WI
   bclose(in_bmp);
 }
 
+// Same result as read_bitmap, but decodes the pixel array in place, row by row,
+// straight into output_image_array (no intermediate pixel array, no per-byte malloc).
+void read_bitmap_direct(char * input_file_path, unsigned char output_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]){
+  BMP* in_bmp = _bopen_header(input_file_path);
+  if (in_bmp->width != BMP_WIDTH || in_bmp->height != BMP_HEIGTH) {
+    _throw_error("Invalid bitmap width and/or height. Must be 950x950 pixels.");
+  }
+  if (out_bmp==NULL) {
+    out_bmp = _b_template_copy(in_bmp);
+  }
+  _decode_pixel_rows(in_bmp, output_image_array);
+  bclose(in_bmp);
+}
+
+// Threshold the pixel rows of bmp into binary (column stride binary_stride) and, if rgb is not NULL,
+// decode them into rgb (column stride rgb_stride). flags must hold THRESHOLD_BLOCK_ROWS rows of
+// width * 4 bytes. Inlined with constant strides into read_bitmap_binary for the fixed size.
+// With THRESHOLD_OTSU, the pass writes the brightness of every pixel, (red + green + blue) / 3,
+// into binary instead, and counts it in a histogram on the way. The threshold is then chosen from
+// the histogram and applied to binary, which is much smaller than the file and already in cache
+// order, so the file is still read once. Returns the threshold used.
+static inline int _threshold_pixel_rows(BMP* bmp, int threshold, unsigned char* binary, int binary_stride,
+                                        unsigned char* rgb, int rgb_stride, unsigned char* flags)
+{
+  int width = bmp->width;
+  int height = bmp->height;
+  int channels = bmp->depth / BITS_PER_BYTE;
+  int row_size = ((int) (bmp->depth * bmp->width + 31) / 32) * 4;
+  unsigned char* pixels = bmp->file_byte_contents + bmp->pixel_array_start;
+  int otsu = threshold == THRESHOLD_OTSU;
+  // Four histograms, for the columns x % 4, so that the counts of neighbouring pixels, which
+  // often have the same brightness, do not wait on each other. They are added up by _otsu_level.
+  unsigned int histogram[4][256];
+  if (otsu) {
+    memset(histogram, 0, sizeof(histogram));
+  }
+  // Rows are handled in blocks so that the transposed writes into the column-major
+  // arrays touch THRESHOLD_BLOCK_ROWS consecutive bytes at a time.
+  for (int y0 = 0; y0 < height; y0 += THRESHOLD_BLOCK_ROWS) {
+    int rows = height - y0 < THRESHOLD_BLOCK_ROWS ? height - y0 : THRESHOLD_BLOCK_ROWS;
+    for (int r = 0; r < rows; r++) {
+      if (otsu) {
+        _level_row(pixels + (y0 + r) * row_size, width * channels, flags + r * width * 4);
+      } else {
+        _threshold_row(pixels + (y0 + r) * row_size, width * channels, threshold, flags + r * width * 4);
+      }
+    }
+    for (int x = 0; x < width; x++) {
+      unsigned char* column = binary + (size_t) x * binary_stride + height - 1 - y0;
+      for (int r = 0; r < rows; r++) {
+        column[-r] = flags[r * width * 4 + x * channels];
+      }
+      if (otsu) {
+        unsigned int* counts = histogram[x & 3];
+        for (int r = 0; r < rows; r++) {
+          counts[column[-r]]++;
+        }
+      }
+      if (rgb != NULL) {
+        for (int r = 0; r < rows; r++) {
+          unsigned char* p = pixels + (y0 + r) * row_size + x * channels;
+          unsigned char* out = rgb + (size_t) x * rgb_stride + (height - 1 - y0 - r) * BMP_CHANNELS;
+          out[0] = p[RED];
+          out[1] = p[GREEN];
+          out[2] = p[BLUE];
+        }
+      }
+    }
+  }
+  if (!otsu) {
+    return threshold;
+  }
+  // A brightness above level is a channel sum above 3 * level + 2.
+  unsigned char level = (unsigned char) _otsu_level(histogram);
+  for (int x = 0; x < width; x++) {
+    _threshold_levels(binary + (size_t) x * binary_stride, height, level);
+  }
+  return 3 * level + 2;
+}
+
+// _threshold_pixel_rows for a 950x950 bitmap, into the fixed arrays.
+int _threshold_fixed_rows(BMP* bmp, int threshold, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char output_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS])
+{
+  unsigned char flags[THRESHOLD_BLOCK_ROWS][BMP_WIDTH * 4];
+  return _threshold_pixel_rows(bmp, threshold, &binary_image[0][0], BMP_HEIGTH,
+                               output_image_array != NULL ? &output_image_array[0][0][0] : NULL, BMP_HEIGTH * BMP_CHANNELS, &flags[0][0]);
+}
+
+// Load the bitmap and threshold it in a single pass over the file rows. A pixel is white (1)
+// in binary_image when red + green + blue > threshold. The RGB image is only written when
+// output_image_array is not NULL. Returns the threshold used. Also sets up out_bmp. The file is
+// read into a new buffer every call; read_bitmap_image reuses the one kept with the image.
+int read_bitmap_binary(char * input_file_path, int threshold, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char output_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]){
+  BMP* in_bmp = _bopen_header(input_file_path);
+  if (in_bmp->width != BMP_WIDTH || in_bmp->height != BMP_HEIGTH) {
+    _throw_error("Invalid bitmap width and/or height. Must be 950x950 pixels.");
+  }
+  if (out_bmp==NULL) {
+    out_bmp = _b_template_copy(in_bmp);
+  }
+  threshold = _threshold_fixed_rows(in_bmp, threshold, binary_image, output_image_array);
+  bclose(in_bmp);
+  return threshold;
+}
+
+// Make img a width x height IMAGE_COLUMNS image with the given number of channels, reusing its
+// buffer when it is large enough. The pixels are left as they are. img must be zeroed before its
+// first use. An image that already has that size and layout keeps its stride.
+void image_resize(image* img, int width, int height, int channels){
+  if (img->data != NULL && img->layout == IMAGE_COLUMNS && img->width == width && img->height == height && img->channels == channels
+      && img->stride >= height * channels && (size_t) width * img->stride <= img->capacity) {
+    return;
+  }
+  img->width = width;
+  img->height = height;
+  img->channels = channels;
+  img->stride = height * channels;
+  img->layout = IMAGE_COLUMNS;
+  _image_reserve(img, (size_t) width * img->stride);
+}
+
+// Make sure img->data holds at least size bytes.
+void _image_reserve(image* img, size_t size){
+  if (size > img->capacity) {
+    if (img->data != NULL) {
+      bmp_buffer_free(img->data, img->capacity, img->mapped);
+    }
+    img->data = (unsigned char*) bmp_buffer_alloc(size, &img->mapped);
+    if (img->data == NULL) {
+      _throw_error("Not enough memory for the image");
+    }
+    img->capacity = size;
+  }
+}
+
+// Free the buffer and header of img.
+void image_free(image* img){
+  if (img->data != NULL) {
+    bmp_buffer_free(img->data, img->capacity, img->mapped);
+  }
+  img->data = NULL;
+  img->capacity = 0;
+  img->mapped = 0;
+  if (img->header != NULL) {
+    bclose(img->header);
+    img->header = NULL;
+  }
+}
+
+// Allocate size bytes for a file buffer or an image. With bmp_huge_pages on, a buffer of at least
+// BMP_HUGE_PAGE_SIZE is mapped from reserved huge pages, or else from pages the kernel is asked to
+// back with transparent huge pages; the size is rounded up to whole huge pages. *mapped tells
+// bmp_buffer_free how to give it back.
+void* bmp_buffer_alloc(size_t size, int* mapped){
+  __sync_fetch_and_add(&bmp_allocations, 1);
+  *mapped = 0;
+#if !defined(_WIN32) && defined(MAP_ANONYMOUS)
+  if (bmp_huge_pages && size >= BMP_HUGE_PAGE_SIZE) {
+    size_t rounded = (size + BMP_HUGE_PAGE_SIZE - 1) / BMP_HUGE_PAGE_SIZE * BMP_HUGE_PAGE_SIZE;
+    void* buffer = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    buffer = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (buffer == MAP_FAILED) {
+      buffer = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+      if (buffer != MAP_FAILED) {
+        madvise(buffer, rounded, MADV_HUGEPAGE);
+      }
+#endif
+    }
+    if (buffer != MAP_FAILED) {
+      *mapped = 1;
+      return buffer;
+    }
+  }
+#endif
+  return malloc(size);
+}
+
+// Free a buffer of size bytes from bmp_buffer_alloc.
+void bmp_buffer_free(void* buffer, size_t size, int mapped){
+#if !defined(_WIN32) && defined(MAP_ANONYMOUS)
+  if (mapped) {
+    munmap(buffer, (size + BMP_HUGE_PAGE_SIZE - 1) / BMP_HUGE_PAGE_SIZE * BMP_HUGE_PAGE_SIZE);
+    return;
+  }
+#endif
+  free(buffer);
+}
+
+// Same as read_bitmap_binary, for a bitmap of any size: binary_image is resized to the size of the
+// file. If output_image is not NULL, it gets the pixel array of the file as it is, in the
+// IMAGE_FILE_ROWS layout, so no pixel is moved around to read it or to write it back with
+// write_bitmap_image, and its header keeps the file for that. 950x950 bitmaps use the fixed-size
+// path for the binary image. Returns the threshold used. Only the two images are written to, so
+// other images can be read on other threads at the same time. The file is read into the header
+// of output_image (of binary_image without one), whose buffers are reused from one bitmap to the
+// next, so reading frames of the same size allocates nothing.
+int read_bitmap_image(char * input_file_path, int threshold, image* binary_image, image* output_image){
+  image* holder = output_image != NULL ? output_image : binary_image;
+  BMP* in_bmp = holder->header = _bopen_reuse(input_file_path, holder->header);
+  image_resize(binary_image, in_bmp->width, in_bmp->height, 1);
+  if (in_bmp->width == BMP_WIDTH && in_bmp->height == BMP_HEIGTH) {
+    threshold = _threshold_fixed_rows(in_bmp, threshold, FIXED_BINARY(binary_image), NULL);
+  } else {
+    unsigned char* flags = _b_flags(in_bmp, (size_t) THRESHOLD_BLOCK_ROWS * in_bmp->width * 4);
+    threshold = _threshold_pixel_rows(in_bmp, threshold, binary_image->data, binary_image->stride, NULL, 0, flags);
+  }
+  if (output_image != NULL) {
+    int row_size = ((int) (in_bmp->depth * in_bmp->width + 31) / 32) * 4;
+    output_image->width = in_bmp->width;
+    output_image->height = in_bmp->height;
+    output_image->channels = in_bmp->depth / BITS_PER_BYTE;
+    output_image->stride = row_size;
+    output_image->layout = IMAGE_FILE_ROWS;
+    _image_reserve(output_image, (size_t) row_size * in_bmp->height);
+    memcpy(output_image->data, in_bmp->file_byte_contents + in_bmp->pixel_array_start, (size_t) row_size * in_bmp->height);
+  }
+  return threshold;
+}
+
 void write_bitmap(unsigned char input_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], char * output_file_path){
   if (out_bmp == NULL) {
     _throw_error("The function 'read_bitmap' must be called at least once before calling the function 'write_bitmap'.");
   }
-  unsigned char r;
-  unsigned char g;
-  unsigned char b;
-  for (int x = 0; x < BMP_WIDTH; x++)
-  {
-    for (int y = 0; y < BMP_HEIGTH; y++)
-    {
-      r = input_image_array[x][BMP_HEIGTH-1-y][0];
-      g = input_image_array[x][BMP_HEIGTH-1-y][1];
-      b = input_image_array[x][BMP_HEIGTH-1-y][2];
-      set_pixel_rgb(out_bmp, x, y, r, g, b);
+  _write_encoded(out_bmp, &input_image_array[0][0][0], BMP_HEIGTH * BMP_CHANNELS, output_file_path);
+}
+
+// Same as write_bitmap, for an RGB image of any size. The header comes from input_image->header,
+// set by read_bitmap_image; a 950x950 IMAGE_COLUMNS image without one is written with out_bmp.
+void write_bitmap_image(image* input_image, char * output_file_path){
+  BMP* template = input_image->header;
+  if (template == NULL && input_image->layout == IMAGE_COLUMNS && IMAGE_IS_FIXED(input_image)) {
+    write_bitmap(FIXED_RGB(input_image), output_file_path);
+    return;
+  }
+  if (template == NULL || (int) template->width != input_image->width || (int) template->height != input_image->height) {
+    _throw_error("The function 'read_bitmap_image' must be called for an image of the same size before calling the function 'write_bitmap_image'.");
+  }
+  if (input_image->layout == IMAGE_FILE_ROWS) {
+    if ((int) template->depth != input_image->channels * BITS_PER_BYTE) {
+      _throw_error("The function 'read_bitmap_image' must be called for an image of the same size before calling the function 'write_bitmap_image'.");
+    }
+    _write_file_rows(template, input_image, output_file_path);
+    return;
+  }
+  _write_encoded(template, input_image->data, input_image->stride, output_file_path);
+}
+
+// Encode the RGB image rgb (column stride rgb_stride, in the layout of the fixed arrays) into the
+// pixel rows of file_bytes, laid out as the file of bmp. If file_bytes are not bmp's own, every row
+// is first copied from bmp, so the padding and alpha bytes are the same as in bmp's file.
+void _encode_pixel_rows(BMP* bmp, unsigned char* rgb, int rgb_stride, unsigned char* file_bytes){
+  int channels = bmp->depth / BITS_PER_BYTE;
+  int row_size = ((int) (bmp->depth * bmp->width + 31) / 32) * 4;
+  int width = bmp->width;
+  int height = bmp->height;
+  for (int y = 0; y < height; y++) {
+    size_t offset = bmp->pixel_array_start + (size_t) y * row_size;
+    unsigned char* row = file_bytes + offset;
+    if (file_bytes != bmp->file_byte_contents) {
+      memcpy(row, bmp->file_byte_contents + offset, row_size);
     }
+    unsigned char* in = rgb + (height - 1 - y) * BMP_CHANNELS;
+    for (int x = 0; x < width; x++) {
+      row[RED] = in[0];
+      row[GREEN] = in[1];
+      row[BLUE] = in[2];
+      row += channels;
+      in += rgb_stride;
+    }
+  }
+}
+
+// Write rgb to file_path as a bitmap with the header of bmp, using the backend of bmp_io_backend.
+// stdio encodes into bmp's file bytes and writes them out with one fwrite. mmap sizes the file,
+// maps it and encodes straight into the mapping, so the file bytes are not copied once more.
+void _write_encoded(BMP* bmp, unsigned char* rgb, int rgb_stride, char* file_path){
+#ifndef _WIN32
+  if (bmp_io_backend == BMP_IO_MMAP) {
+    int fd = open(file_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+      _throw_error("Could not open the output file");
+    }
+    if (ftruncate(fd, bmp->file_byte_number) != 0) {
+      _throw_error("Could not resize the output file");
+    }
+    void* mapping = mmap(NULL, bmp->file_byte_number, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+      _throw_error("Could not map the output file");
+    }
+    unsigned char* file_bytes = (unsigned char*) mapping;
+    memcpy(file_bytes, bmp->file_byte_contents, bmp->pixel_array_start);
+    _encode_pixel_rows(bmp, rgb, rgb_stride, file_bytes);
+    size_t pixels_end = bmp->pixel_array_start + (size_t) (((int) (bmp->depth * bmp->width + 31) / 32) * 4) * bmp->height;
+    memcpy(file_bytes + pixels_end, bmp->file_byte_contents + pixels_end, bmp->file_byte_number - pixels_end);
+    munmap(mapping, bmp->file_byte_number);
+    close(fd);
+    return;
+  }
+#endif
+  if (bmp->mapped) {
+    _b_own_contents(bmp);
+  }
+  _encode_pixel_rows(bmp, rgb, rgb_stride, bmp->file_byte_contents);
+  FILE* fp = fopen(file_path, "wb");
+  if (fp == NULL) {
+    _throw_error("Could not open the output file");
+  }
+  fwrite(bmp->file_byte_contents, sizeof(char), bmp->file_byte_number, fp);
+  fclose(fp);
+}
+
+// Store value in the `bytes` bytes at buffer, least significant byte first, as in bitmap headers.
+static void _put_int_to_buffer(unsigned int bytes, unsigned int value, unsigned char* buffer){
+  for (unsigned int i = 0; i < bytes; i++) {
+    buffer[i] = (value >> (BITS_PER_BYTE * i)) & 0xFF;
   }
-  bwrite(out_bmp, output_file_path);
+}
+
+// Write a binary image (one channel, 0 or 1) as a black and white 24-bit bitmap. The header is
+// made here instead of coming from a bitmap read before, and no global state is used, so this can
+// be called from another thread while the main one reads and writes bitmaps.
+void write_bitmap_binary(image* binary_image, char * output_file_path){
+  int width = binary_image->width;
+  int height = binary_image->height;
+  int row_size = ((24 * width + 31) / 32) * 4;
+  unsigned char header[54] = { 'B', 'M' };
+  _put_int_to_buffer(4, sizeof(header) + (unsigned int) row_size * height, header + 2);
+  _put_int_to_buffer(PIXEL_ARRAY_START_BYTES, sizeof(header), header + PIXEL_ARRAY_START_OFFSET);
+  _put_int_to_buffer(4, 40, header + 14);                // Size of the info header.
+  _put_int_to_buffer(WIDTH_BYTES, width, header + WIDTH_OFFSET);
+  _put_int_to_buffer(HEIGHT_BYTES, height, header + HEIGHT_OFFSET);
+  _put_int_to_buffer(2, 1, header + 26);                 // Colour planes.
+  _put_int_to_buffer(DEPTH_BYTES, 24, header + DEPTH_OFFSET);
+  _put_int_to_buffer(4, (unsigned int) row_size * height, header + 34);
+
+  FILE* fp = fopen(output_file_path, "wb");
+  if (fp == NULL) {
+    _throw_error("Could not open the output file");
+  }
+  fwrite(header, 1, sizeof(header), fp);
+  unsigned char* row = (unsigned char*) calloc(row_size, 1);
+  for (int y = height - 1; y >= 0; y--) {
+    for (int x = 0; x < width; x++) {
+      unsigned char value = binary_image->data[(size_t) x * binary_image->stride + y] ? 255 : 0;
+      row[3 * x] = row[3 * x + 1] = row[3 * x + 2] = value;
+    }
+    fwrite(row, 1, row_size, fp);
+  }
+  free(row);
+  fclose(fp);
+}
+
+// Write rgb, an IMAGE_FILE_ROWS image of bmp's size and depth, with the header of bmp: the header,
+// the rows and whatever follows them in bmp's file are copied out as they are.
+void _write_file_rows(BMP* bmp, image* rgb, char* file_path){
+  size_t pixels_size = (size_t) rgb->stride * rgb->height;
+  size_t pixels_end = bmp->pixel_array_start + pixels_size;
+#ifndef _WIN32
+  if (bmp_io_backend == BMP_IO_MMAP) {
+    int fd = open(file_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+      _throw_error("Could not open the output file");
+    }
+    if (ftruncate(fd, bmp->file_byte_number) != 0) {
+      _throw_error("Could not resize the output file");
+    }
+    void* mapping = mmap(NULL, bmp->file_byte_number, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+      _throw_error("Could not map the output file");
+    }
+    unsigned char* file_bytes = (unsigned char*) mapping;
+    memcpy(file_bytes, bmp->file_byte_contents, bmp->pixel_array_start);
+    memcpy(file_bytes + bmp->pixel_array_start, rgb->data, pixels_size);
+    memcpy(file_bytes + pixels_end, bmp->file_byte_contents + pixels_end, bmp->file_byte_number - pixels_end);
+    munmap(mapping, bmp->file_byte_number);
+    close(fd);
+    return;
+  }
+#endif
+  FILE* fp = fopen(file_path, "wb");
+  if (fp == NULL) {
+    _throw_error("Could not open the output file");
+  }
+  fwrite(bmp->file_byte_contents, sizeof(char), bmp->pixel_array_start, fp);
+  fwrite(rgb->data, sizeof(char), pixels_size, fp);
+  fwrite(bmp->file_byte_contents + pixels_end, sizeof(char), bmp->file_byte_number - pixels_end, fp);
+  fclose(fp);
+}
+
+// Open a bitmap to read it a rectangle at a time with bmp_stream_read. Only the header is read
+// here, so memory use does not depend on the size of the file. Stores its size in *width and *height.
+bmp_stream* bmp_stream_open(char * input_file_path, int* width, int* height){
+  FILE* fp = fopen(input_file_path, "rb");
+  if (fp == NULL) {
+    perror("Error opening file");
+    exit(EXIT_FAILURE);
+  }
+  unsigned char start[DEPTH_OFFSET + DEPTH_BYTES];
+  if (fread(start, 1, sizeof(start), fp) != sizeof(start) || !_validate_file_type(start)) {
+    _throw_error("Invalid file type");
+  }
+  bmp_stream* stream = (bmp_stream*) calloc(1, sizeof(bmp_stream));
+  stream->fp = fp;
+  stream->pixel_array_start = _get_pixel_array_start(start);
+  stream->width = _get_width(start);
+  stream->height = _get_height(start);
+  stream->depth = _get_depth(start);
+  if (!_validate_depth(stream->depth)) {
+    _throw_error("Invalid file depth");
+  }
+  if (stream->width <= 0 || stream->height <= 0 || stream->pixel_array_start < sizeof(start)) {
+    _throw_error("Invalid bitmap width and/or height");
+  }
+  stream->row_size = ((_boffset) stream->depth * stream->width + 31) / 32 * 4;
+
+  stream->header = (unsigned char*) malloc(stream->pixel_array_start);
+  rewind(fp);
+  if (fread(stream->header, 1, stream->pixel_array_start, fp) != stream->pixel_array_start) {
+    _throw_error("There was a problem reading the file");
+  }
+  if (_bseek(fp, 0, SEEK_END) != 0 || _btell(fp) < stream->pixel_array_start + stream->row_size * stream->height) {
+    _throw_error("Invalid pixel array size");
+  }
+  stream->row = (unsigned char*) malloc(stream->row_size);
+  stream->flags = (unsigned char*) malloc(stream->row_size);
+  *width = stream->width;
+  *height = stream->height;
+  return stream;
+}
+
+// Create a bitmap with the same header and size as source, to be written a rectangle at a time
+// with bmp_stream_write. The pixels start out black.
+bmp_stream* bmp_stream_create(char * output_file_path, bmp_stream* source){
+  FILE* fp = fopen(output_file_path, "wb+");
+  if (fp == NULL) {
+    _throw_error("Could not open the output file");
+  }
+  bmp_stream* stream = (bmp_stream*) calloc(1, sizeof(bmp_stream));
+  *stream = *source;
+  stream->fp = fp;
+  stream->header = NULL;
+  stream->row = (unsigned char*) malloc(stream->row_size);
+  stream->flags = NULL;
+  stream->source = source;
+  fwrite(source->header, 1, source->pixel_array_start, fp);
+  // Size the file by writing its last byte.
+  unsigned char zero = 0;
+  _bseek(fp, stream->pixel_array_start + stream->row_size * stream->height - 1, SEEK_SET);
+  fwrite(&zero, 1, 1, fp);
+  return stream;
+}
+
+// Seek to pixel (x, y) of the stream, y = 0 being the top of the picture.
+void _bstream_seek(bmp_stream* stream, int x, int y)
+{
+  _boffset file_row = stream->height - 1 - y;
+  if (_bseek(stream->fp, stream->pixel_array_start + file_row * stream->row_size + (_boffset) x * (stream->depth / BITS_PER_BYTE), SEEK_SET) != 0) {
+    _throw_error("There was a problem seeking in the file");
+  }
+}
+
+// Read the width x height rectangle at (x0, y0) into binary_image (thresholded like read_bitmap_binary)
+// and, if it is not NULL, output_image. Both are resized to width x height. THRESHOLD_OTSU cannot be
+// used here, since the threshold of the whole picture is not known from one rectangle.
+void bmp_stream_read(bmp_stream* stream, int x0, int y0, int width, int height, int threshold, image* binary_image, image* output_image){
+  int channels = stream->depth / BITS_PER_BYTE;
+  image_resize(binary_image, width, height, 1);
+  if (output_image != NULL) {
+    image_resize(output_image, width, height, BMP_CHANNELS);
+  }
+  for (int y = 0; y < height; y++) {
+    _bstream_seek(stream, x0, y0 + y);
+    if (fread(stream->row, 1, (size_t) width * channels, stream->fp) != (size_t) width * channels) {
+      _throw_error("There was a problem reading the file");
+    }
+    _threshold_row(stream->row, width * channels, threshold, stream->flags);
+    for (int x = 0; x < width; x++) {
+      binary_image->data[(size_t) x * binary_image->stride + y] = stream->flags[x * channels];
+    }
+    if (output_image != NULL) {
+      for (int x = 0; x < width; x++) {
+        unsigned char* p = stream->row + x * channels;
+        unsigned char* out = output_image->data + (size_t) x * output_image->stride + y * BMP_CHANNELS;
+        out[0] = p[RED];
+        out[1] = p[GREEN];
+        out[2] = p[BLUE];
+      }
+    }
+  }
+}
+
+// Write the width x height rectangle of input_image at (image_x, image_y) to the rectangle at
+// (x0, y0) of a stream made with bmp_stream_create. For 32-bit bitmaps the alpha channel is
+// copied from the source bitmap.
+void bmp_stream_write(bmp_stream* stream, int x0, int y0, int width, int height, image* input_image, int image_x, int image_y){
+  int channels = stream->depth / BITS_PER_BYTE;
+  for (int y = 0; y < height; y++) {
+    if (channels > ALPHA) {
+      _bstream_seek(stream->source, x0, y0 + y);
+      if (fread(stream->row, 1, (size_t) width * channels, stream->source->fp) != (size_t) width * channels) {
+        _throw_error("There was a problem reading the file");
+      }
+    }
+    for (int x = 0; x < width; x++) {
+      unsigned char* in = input_image->data + (size_t) (image_x + x) * input_image->stride + (image_y + y) * BMP_CHANNELS;
+      unsigned char* p = stream->row + x * channels;
+      p[RED] = in[0];
+      p[GREEN] = in[1];
+      p[BLUE] = in[2];
+    }
+    _bstream_seek(stream, x0, y0 + y);
+    fwrite(stream->row, 1, (size_t) width * channels, stream->fp);
+  }
+}
+
+// Close a stream opened with bmp_stream_open or bmp_stream_create.
+void bmp_stream_close(bmp_stream* stream){
+  fclose(stream->fp);
+  free(stream->header);
+  free(stream->row);
+  free(stream->flags);
+  free(stream);
 }
 
 // Private (ex-public) function declarations
 BMP* bopen(char* file_path)
+{
+    BMP* bmp = _bopen_header(file_path);
+    _populate_pixel_array(bmp);
+    return bmp;
+}
+
+// Read the file and parse the header, but leave bmp->pixels unpopulated (NULL).
+BMP* _bopen_header(char* file_path)
+{
+    return _bopen_reuse(file_path, NULL);
+}
+
+// Same as _bopen_header, reading into bmp, a bitmap opened before, unless it is NULL. Its file
+// buffer is reused when the file fits in it, so reading one frame after another allocates nothing.
+BMP* _bopen_reuse(char* file_path, BMP* bmp)
 {
     FILE* fp = fopen(file_path, "rb");
 
@@ -139,11 +789,51 @@ BMP* bopen(char* file_path)
         exit(EXIT_FAILURE);
     }
 
-    BMP* bmp = (BMP*) malloc(sizeof(BMP));
+    if (bmp == NULL)
+    {
+        bmp = (BMP*) calloc(1, sizeof(BMP));
+    }
+    _b_release_contents(bmp);
     bmp->file_byte_number = _get_file_byte_number(fp);
-    bmp->file_byte_contents = _get_file_byte_contents(fp, bmp->file_byte_number);
+#ifndef _WIN32
+    // Map the file instead of copying it into a buffer. The pages are read in as the pixel rows
+    // are decoded, and the kernel is told they are read front to back so it reads ahead.
+    if (bmp_io_backend == BMP_IO_MMAP && bmp->file_byte_number > 0)
+    {
+        void* mapping = mmap(NULL, bmp->file_byte_number, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (mapping != MAP_FAILED)
+        {
+            posix_madvise(mapping, bmp->file_byte_number, POSIX_MADV_SEQUENTIAL);
+            bmp->file_byte_contents = (unsigned char*) mapping;
+            bmp->mapped = 1;
+        }
+    }
+#endif
+    if (bmp->file_byte_contents == NULL)
+    {
+        if (bmp->file_byte_number > bmp->buffer_size)
+        {
+            if (bmp->buffer != NULL)
+            {
+                bmp_buffer_free(bmp->buffer, bmp->buffer_size, bmp->buffer_mapped);
+            }
+            bmp->buffer = (unsigned char*) bmp_buffer_alloc(bmp->file_byte_number, &bmp->buffer_mapped);
+            if (bmp->buffer == NULL)
+            {
+                _throw_error("Not enough memory for the file");
+            }
+            bmp->buffer_size = bmp->file_byte_number;
+        }
+        _read_file_byte_contents(fp, bmp->buffer, bmp->file_byte_number);
+        bmp->file_byte_contents = bmp->buffer;
+    }
     fclose(fp);
 
+    if (bmp->file_byte_number < DEPTH_OFFSET + DEPTH_BYTES)
+    {
+        _throw_error("Invalid file size");
+    }
+
     if(!_validate_file_type(bmp->file_byte_contents))
     {
         _throw_error("Invalid file type");
@@ -164,21 +854,79 @@ BMP* bopen(char* file_path)
         _throw_error("Invalid file depth");
     }
 
-    _populate_pixel_array(bmp);
+    int row_size = ((int) (bmp->depth * bmp->width + 31) / 32) * 4;
+    if (bmp->pixel_array_start + (unsigned int) row_size * bmp->height > bmp->file_byte_number)
+    {
+        _throw_error("Invalid pixel array size");
+    }
 
     return bmp;
 }
 
+// Unmap the file bytes of bmp if they are a mapping and free its pixel array. The file buffer
+// and the flags are kept for the next file read into bmp.
+void _b_release_contents(BMP* bmp)
+{
+    free(bmp->pixels);
+    bmp->pixels = NULL;
+#ifndef _WIN32
+    if (bmp->mapped)
+    {
+        munmap(bmp->file_byte_contents, bmp->file_byte_number);
+    }
+#endif
+    bmp->file_byte_contents = NULL;
+    bmp->mapped = 0;
+}
+
+// Copy the file bytes of bmp into its own buffer if they are a read-only mapping, so they can be
+// encoded into.
+void _b_own_contents(BMP* bmp)
+{
+    unsigned char* mapping = bmp->file_byte_contents;
+    if (bmp->file_byte_number > bmp->buffer_size)
+    {
+        if (bmp->buffer != NULL)
+        {
+            bmp_buffer_free(bmp->buffer, bmp->buffer_size, bmp->buffer_mapped);
+        }
+        bmp->buffer = (unsigned char*) bmp_buffer_alloc(bmp->file_byte_number, &bmp->buffer_mapped);
+        bmp->buffer_size = bmp->file_byte_number;
+    }
+    memcpy(bmp->buffer, mapping, bmp->file_byte_number);
+#ifndef _WIN32
+    munmap(mapping, bmp->file_byte_number);
+#endif
+    bmp->file_byte_contents = bmp->buffer;
+    bmp->mapped = 0;
+}
+
+// Flags buffer of at least size bytes for thresholding bmp, kept with bmp for the next file.
+unsigned char* _b_flags(BMP* bmp, size_t size)
+{
+    if (size > bmp->flags_size)
+    {
+        free(bmp->flags);
+        bmp->flags = (unsigned char*) malloc(size);
+        bmp->flags_size = size;
+        __sync_fetch_and_add(&bmp_allocations, 1);
+    }
+    return bmp->flags;
+}
+
 BMP* b_deep_copy(BMP* to_copy)
 {
-    BMP* copy = (BMP*) malloc(sizeof(BMP));
+    BMP* copy = (BMP*) calloc(1, sizeof(BMP));
     copy->file_byte_number = to_copy->file_byte_number;
     copy->pixel_array_start = to_copy->pixel_array_start;
     copy->width = to_copy->width;
     copy->height = to_copy->height;
     copy->depth = to_copy->depth;
 
-    copy->file_byte_contents = (unsigned char*) malloc(copy->file_byte_number * sizeof(unsigned char));
+    copy->buffer = (unsigned char*) bmp_buffer_alloc(copy->file_byte_number, &copy->buffer_mapped);
+    copy->buffer_size = copy->file_byte_number;
+    copy->file_byte_contents = copy->buffer;
+    copy->mapped = 0;
 
     unsigned int i;
     for (i = 0; i < copy->file_byte_number; i++)
@@ -247,10 +995,12 @@ void bwrite(BMP* bmp, char* file_name)
 
 void bclose(BMP* bmp)
 {
-    free(bmp->pixels);
-    bmp->pixels = NULL;
-    free(bmp->file_byte_contents);
-    bmp->file_byte_contents = NULL;
+    _b_release_contents(bmp);
+    if (bmp->buffer != NULL)
+    {
+        bmp_buffer_free(bmp->buffer, bmp->buffer_size, bmp->buffer_mapped);
+    }
+    free(bmp->flags);
     free(bmp);
     bmp = NULL;
 }
@@ -264,20 +1014,19 @@ void _throw_error(char* message)
     exit(1);
 }
 
+// The `bytes` bytes at buffer + offset, least significant byte first, as in bitmap headers.
 unsigned int _get_int_from_buffer(unsigned int bytes,
                                   unsigned int offset,
                                   unsigned char* buffer)
 {
-    unsigned char* _buffer = (unsigned char*) malloc(bytes * sizeof(unsigned char));
+    unsigned int value = 0;
 
     unsigned int i;
     for (i = 0; i < bytes; i++)
     {
-        _buffer[i] = buffer[i + offset];
+        value |= (unsigned int) buffer[i + offset] << (BITS_PER_BYTE * i);
     }
 
-    unsigned int value = *(unsigned int*) _buffer;
-    free(_buffer);
     return value;
 }
 
@@ -290,18 +1039,14 @@ unsigned int _get_file_byte_number(FILE* fp)
     return byte_number;
 }
 
-unsigned char* _get_file_byte_contents(FILE* fp, unsigned int file_byte_number)
+void _read_file_byte_contents(FILE* fp, unsigned char* buffer, unsigned int file_byte_number)
 {
-    unsigned char* buffer = (unsigned char*) malloc(file_byte_number * sizeof(char));
     unsigned int result = fread(buffer, 1, file_byte_number, fp);
 
     if (result != file_byte_number)
     {
         _throw_error("There was a problem reading the file");
     }
-
-
-    return buffer;
 }
 
 int _validate_file_type(unsigned char* file_byte_contents)
@@ -409,3 +1154,176 @@ void _get_pixel(BMP* bmp, int index, int offset, int channel)
             break;
     }
 }
+
+// Decode the pixel array of bmp directly into output_image_array. Rows are stored
+// bottom-up in the file and padded to a multiple of 4 bytes.
+void _decode_pixel_rows(BMP* bmp, unsigned char output_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS])
+{
+    int channels = bmp->depth / BITS_PER_BYTE;
+    int row_size = ((int) (bmp->depth * bmp->width + 31) / 32) * 4;
+
+    unsigned int x, y;
+    for (y = 0; y < bmp->height; y++)
+    {
+        unsigned char* row = bmp->file_byte_contents + bmp->pixel_array_start + y * row_size;
+        unsigned int out_y = BMP_HEIGTH - 1 - y;
+        for (x = 0; x < bmp->width; x++)
+        {
+            unsigned char* p = row + x * channels;
+            output_image_array[x][out_y][0] = p[RED];
+            output_image_array[x][out_y][1] = p[GREEN];
+            output_image_array[x][out_y][2] = p[BLUE];
+        }
+    }
+}
+
+// Otsu's threshold of the brightness histogram, given as four histograms to add up: the level t
+// that best splits the pixels into the levels <= t and > t, i.e. maximizes the between-class
+// variance w0 * w1 * (mean0 - mean1)^2.
+int _otsu_level(unsigned int histogram[4][256])
+{
+    double counts[256];
+    double total = 0;
+    double sum = 0;
+    for (int level = 0; level < 256; level++)
+    {
+        counts[level] = (double) histogram[0][level] + histogram[1][level] + histogram[2][level] + histogram[3][level];
+        total += counts[level];
+        sum += level * counts[level];
+    }
+    double below = 0;
+    double below_sum = 0;
+    double best = -1;
+    int threshold = 0;
+    for (int level = 0; level < 255; level++)
+    {
+        below += counts[level];
+        below_sum += level * counts[level];
+        double above = total - below;
+        if (below == 0 || above == 0)
+        {
+            continue;
+        }
+        double difference = below_sum / below - (sum - below_sum) / above;
+        double variance = below * above * difference * difference;
+        if (variance > best)
+        {
+            best = variance;
+            threshold = level;
+        }
+    }
+    return threshold;
+}
+
+// For every byte offset i of the row, set levels[i] to (row[i] + row[i+1] + row[i+2]) / 3, like
+// _threshold_row sets its flags. The division is a multiplication by 21846 / 65536, which is
+// exact for sums up to 765.
+void _level_row(unsigned char* row, int row_bytes, unsigned char* levels)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    __m256i third256 = _mm256_set1_epi16(21846);
+    for (; i + 32 + 2 <= row_bytes; i += 32)
+    {
+        __m256i b0 = _mm256_loadu_si256((__m256i*) (row + i));
+        __m256i b1 = _mm256_loadu_si256((__m256i*) (row + i + 1));
+        __m256i b2 = _mm256_loadu_si256((__m256i*) (row + i + 2));
+        __m256i lo = _mm256_add_epi16(_mm256_add_epi16(
+                         _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b0)),
+                         _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b1))),
+                         _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b2)));
+        __m256i hi = _mm256_add_epi16(_mm256_add_epi16(
+                         _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b0, 1)),
+                         _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b1, 1))),
+                         _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b2, 1)));
+        __m256i packed = _mm256_packus_epi16(_mm256_mulhi_epu16(lo, third256), _mm256_mulhi_epu16(hi, third256));
+        _mm256_storeu_si256((__m256i*) (levels + i), _mm256_permute4x64_epi64(packed, 0xD8));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i third = _mm_set1_epi16(21846);
+    for (; i + 16 + 2 <= row_bytes; i += 16)
+    {
+        __m128i b0 = _mm_loadu_si128((__m128i*) (row + i));
+        __m128i b1 = _mm_loadu_si128((__m128i*) (row + i + 1));
+        __m128i b2 = _mm_loadu_si128((__m128i*) (row + i + 2));
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(b0, zero), _mm_unpacklo_epi8(b1, zero)), _mm_unpacklo_epi8(b2, zero));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(b0, zero), _mm_unpackhi_epi8(b1, zero)), _mm_unpackhi_epi8(b2, zero));
+        __m128i packed = _mm_packus_epi16(_mm_mulhi_epu16(lo, third), _mm_mulhi_epu16(hi, third));
+        _mm_storeu_si128((__m128i*) (levels + i), packed);
+    }
+#endif
+    for (; i + 2 < row_bytes; i++)
+    {
+        levels[i] = (row[i] + row[i + 1] + row[i + 2]) / 3;
+    }
+}
+
+// Replace each of the count levels by 1 if it is above level, 0 otherwise, 16 at a time (SSE2):
+// the saturated difference with level is not 0 exactly for those, and its minimum with 1 is the flag.
+void _threshold_levels(unsigned char* levels, int count, unsigned char level)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    __m128i limit = _mm_set1_epi8((char) level);
+    __m128i one = _mm_set1_epi8(1);
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((__m128i*) (levels + i));
+        _mm_storeu_si128((__m128i*) (levels + i), _mm_min_epu8(_mm_subs_epu8(v, limit), one));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        levels[i] = levels[i] > level;
+    }
+}
+
+// For every byte offset i of the row, set flags[i] to 1 if row[i] + row[i+1] + row[i+2] > threshold.
+// Only the offsets where a pixel starts are meaningful, i.e. flags[x * channels] for pixel x.
+// The sums are computed 32 (AVX2) or 16 (SSE2) offsets at a time, with a scalar tail.
+void _threshold_row(unsigned char* row, int row_bytes, int threshold, unsigned char* flags)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    __m256i limit256 = _mm256_set1_epi16((short) threshold);
+    __m256i one256 = _mm256_set1_epi8(1);
+    for (; i + 32 + 2 <= row_bytes; i += 32)
+    {
+        __m256i b0 = _mm256_loadu_si256((__m256i*) (row + i));
+        __m256i b1 = _mm256_loadu_si256((__m256i*) (row + i + 1));
+        __m256i b2 = _mm256_loadu_si256((__m256i*) (row + i + 2));
+        __m256i lo = _mm256_add_epi16(_mm256_add_epi16(
+                         _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b0)),
+                         _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b1))),
+                         _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b2)));
+        __m256i hi = _mm256_add_epi16(_mm256_add_epi16(
+                         _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b0, 1)),
+                         _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b1, 1))),
+                         _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b2, 1)));
+        __m256i packed = _mm256_packs_epi16(_mm256_cmpgt_epi16(lo, limit256), _mm256_cmpgt_epi16(hi, limit256));
+        packed = _mm256_permute4x64_epi64(packed, 0xD8);
+        _mm256_storeu_si256((__m256i*) (flags + i), _mm256_and_si256(packed, one256));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i limit = _mm_set1_epi16((short) threshold);
+    __m128i one = _mm_set1_epi8(1);
+    for (; i + 16 + 2 <= row_bytes; i += 16)
+    {
+        __m128i b0 = _mm_loadu_si128((__m128i*) (row + i));
+        __m128i b1 = _mm_loadu_si128((__m128i*) (row + i + 1));
+        __m128i b2 = _mm_loadu_si128((__m128i*) (row + i + 2));
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(b0, zero), _mm_unpacklo_epi8(b1, zero)), _mm_unpacklo_epi8(b2, zero));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(b0, zero), _mm_unpackhi_epi8(b1, zero)), _mm_unpackhi_epi8(b2, zero));
+        __m128i packed = _mm_packs_epi16(_mm_cmpgt_epi16(lo, limit), _mm_cmpgt_epi16(hi, limit));
+        _mm_storeu_si128((__m128i*) (flags + i), _mm_and_si128(packed, one));
+    }
+#endif
+    for (; i + 2 < row_bytes; i++)
+    {
+        flags[i] = row[i] + row[i + 1] + row[i + 2] > threshold;
+    }
+}
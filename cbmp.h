@@ -5,8 +5,82 @@
 #define BMP_HEIGTH 950
 #define BMP_CHANNELS 3
 
+#include <stddef.h>
+
+// Layouts of an image (image.layout), with y = 0 at the top of the picture.
+// IMAGE_COLUMNS: pixel (x, y) starts at data[x * stride + y * channels], red first, the same layout
+// as the fixed [x][y][c] arrays. Used for binary images and wherever pixels are read by column.
+// IMAGE_FILE_ROWS: the pixel array of the bitmap file as it is, so it is read and written without
+// transposing it. Rows are bottom-up, so pixel (x, y) starts at data[(height - 1 - y) * stride +
+// x * channels], with blue first and the alpha byte of 32-bit files kept; stride is the padded row size.
+#define IMAGE_COLUMNS 0
+#define IMAGE_FILE_ROWS 1
+
+struct BMP_data;
+
+// Image of any size, for bitmaps that are not BMP_WIDTH x BMP_HEIGTH or are kept in file order.
+// Everything needed to read and write it back is in the image, so images can be read and written
+// on several threads at once.
+typedef struct image_data
+{
+    int width;
+    int height;
+    int channels;       // 1 for binary images, BMP_CHANNELS (or 4 for IMAGE_FILE_ROWS) for RGB images.
+    int stride;         // Bytes from column x to column x + 1 (row to row for IMAGE_FILE_ROWS).
+    int layout;         // IMAGE_COLUMNS or IMAGE_FILE_ROWS.
+    size_t capacity;    // Bytes allocated for data.
+    int mapped;         // data comes from bmp_buffer_alloc as a mapping.
+    unsigned char* data;
+    struct BMP_data* header;    // Header and file bytes it is written back with (see read_bitmap_image), or NULL.
+} image;
+
+// True if the image has the fixed size and layout, so its data can be used as the fixed arrays
+// (FIXED_BINARY for binary images, FIXED_RGB for RGB images) by the specialized 950x950 code.
+#define IMAGE_IS_FIXED(img) ((img)->width == BMP_WIDTH && (img)->height == BMP_HEIGTH && (img)->layout == IMAGE_COLUMNS && (img)->stride == BMP_HEIGTH * (img)->channels)
+#define FIXED_BINARY(img) ((unsigned char (*)[BMP_HEIGTH]) (img)->data)
+#define FIXED_RGB(img) ((unsigned char (*)[BMP_HEIGTH][BMP_CHANNELS]) (img)->data)
+
+// Threshold that makes read_bitmap_binary and read_bitmap_image choose one for every image with
+// Otsu's method, from a histogram of the pixel brightness built while thresholding (see
+// _threshold_pixel_rows). They return the threshold chosen, as a sum of the channels like the
+// fixed one.
+#define THRESHOLD_OTSU -1
+
+// How whole bitmaps are read and written (bmp_io_backend). With BMP_IO_MMAP the input file is
+// mapped instead of copied into a buffer, and the output file is mapped and encoded into directly.
+// Where mmap is not available (Windows) BMP_IO_MMAP falls back to stdio.
+#define BMP_IO_STDIO 0
+#define BMP_IO_MMAP 1
+extern int bmp_io_backend;
+
+// Buffers for files and images (bmp_buffer_alloc). With bmp_huge_pages on, buffers of at least
+// BMP_HUGE_PAGE_SIZE are backed by huge pages where the system has them (Linux), so a frame is
+// mapped by a few TLB entries and faulted in a few large pages. bmp_allocations counts the buffers
+// allocated so far by bmp_buffer_alloc, the bitmap readers and the session arenas, to check that
+// reading and processing frame after frame allocates nothing once every buffer has its size.
+#define BMP_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+extern int bmp_huge_pages;
+extern long bmp_allocations;
+
+// Bitmap file opened for reading or writing rectangles of pixels, without loading the whole file.
+typedef struct bmp_stream_data bmp_stream;
+
 // Public function declarations
 void read_bitmap(char * input_file_path, unsigned char output_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]);
+void read_bitmap_direct(char * input_file_path, unsigned char output_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]);
+int read_bitmap_binary(char * input_file_path, int threshold, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char output_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]);
 void write_bitmap(unsigned char input_image_array[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], char * output_file_path);
+void image_resize(image* img, int width, int height, int channels);
+void image_free(image* img);
+void* bmp_buffer_alloc(size_t size, int* mapped);
+void bmp_buffer_free(void* buffer, size_t size, int mapped);
+int read_bitmap_image(char * input_file_path, int threshold, image* binary_image, image* output_image);
+void write_bitmap_image(image* input_image, char * output_file_path);
+void write_bitmap_binary(image* binary_image, char * output_file_path);
+bmp_stream* bmp_stream_open(char * input_file_path, int* width, int* height);
+bmp_stream* bmp_stream_create(char * output_file_path, bmp_stream* source);
+void bmp_stream_read(bmp_stream* stream, int x0, int y0, int width, int height, int threshold, image* binary_image, image* output_image);
+void bmp_stream_write(bmp_stream* stream, int x0, int y0, int width, int height, image* input_image, int image_x, int image_y);
+void bmp_stream_close(bmp_stream* stream);
 
 #endif // CBMP_CBMP_H
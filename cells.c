@@ -0,0 +1,623 @@
+// Image processing steps of the cell detection pipeline.
+// Included by main.c and bench.c after cbmp.c.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "cells.h"
+
+// Get the colour of the RGB image at pixel x, y.
+int getColourIntensity(unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], unsigned int x, unsigned int y) {
+    // Return 1 if pixel is white and 0 if the pixel is black.
+    int sum = bmp_image[x][y][0] + bmp_image[x][y][1] + bmp_image[x][y][2];
+    return sum > BINARY_COLOUR_THRESHOLD;
+}
+
+// Switch colour of pixel (x,y) between black and white.
+void switchColour(unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned int x, unsigned int y) {
+    // Switch between black and white.
+    binary_image[x][y] = !(binary_image[x][y]);
+}
+
+
+// Write a 2D list binary_image from the RGB bitmap bmp_image.
+void rgbToBinary (unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH]) {
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        for (int y = 0; y < BMP_HEIGTH; y++) {
+            if (getColourIntensity(bmp_image, x, y)) {
+                binary_image[x][y] = 1;
+            } else {
+                binary_image[x][y] = 0;
+            }
+        }
+    }
+}
+
+
+// Write an RGB bitmap bmp_image from the 2D list binary_image.
+// Note that this image will neccisarily be polarised, any pixel will be either completely black or completely white.
+void binaryToRGB (unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]) {
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        for (int y = 0; y < BMP_HEIGTH; y++) {
+            for (int c = 0; c < BMP_CHANNELS; c++) {
+                bmp_image[x][y][c] = binary_image[x][y] * 255;
+            }
+        }
+    }
+}
+
+// Save a snapshot of the current binary image under results/step_<step>.bmp. The file is written
+// by the snapshot writer thread (see snapshot.c), so this returns before it is on disk.
+void saveErosionStepImage(unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], int step) {
+    snapshotSubmit(&binary_image[0][0], BMP_WIDTH, BMP_HEIGTH, BMP_HEIGTH, step);
+}
+
+// Print progress and detections to stdout.
+int cells_verbose = 1;
+
+// Channel sum above which a pixel is white, or THRESHOLD_OTSU to choose it for every image (--threshold).
+int binary_threshold = BINARY_COLOUR_THRESHOLD;
+
+// Save a snapshot of the binary image after every save_snapshots-th erosion pass (0: never).
+int save_snapshots = 0;
+
+// Monotonic wall clock in seconds.
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Apply the erosion algorithm with erosion_element to the band of src with x_begin <= x < x_end and write
+// the result to the same band of dst. The band must not include the left and right borders (the
+// erosion_element->radius columns at each side). Pixels just outside the band are read from src, so
+// bands can be eroded independently.
+char erodeBand (unsigned char src[BMP_WIDTH][BMP_HEIGTH], unsigned char dst[BMP_WIDTH][BMP_HEIGTH], int x_begin, int x_end) {
+    return erosion_element->kernel(src, dst, x_begin, x_end);
+}
+
+// Apply the erosion algorithm to src using a structuring element and write the result to dst.
+// src is only read, so the erosion loop can swap the two images each pass instead of copying.
+// Decomposed elements use the scratch of the session.
+char erodeInto (cells_session* session, unsigned char src[BMP_WIDTH][BMP_HEIGTH], unsigned char dst[BMP_WIDTH][BMP_HEIGTH]) {
+    if (erosion_element->step_count > 0) {
+        return erodeSteps(session, src, dst);
+    }
+    int radius = erosion_element->radius;
+    char wasEroded = erodeBand(src, dst, radius, BMP_WIDTH - radius);
+
+    // Vertical borders:
+    for (int x = 0; x < radius; x++) {
+        memset(dst[x], 0, BMP_HEIGTH);  // Left border
+        memset(dst[BMP_WIDTH - 1 - x], 0, BMP_HEIGTH);  // Right border
+    }
+    return wasEroded;
+}
+
+
+
+// Apply the erosion algorithm to the binary image in place. The image is first copied to session->eroded.
+char erode (cells_session* session, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]) {
+    image_resize(&session->eroded, BMP_WIDTH, BMP_HEIGTH, 1);
+    unsigned char (*src)[BMP_HEIGTH] = FIXED_BINARY(&session->eroded);
+    memcpy(src, binary_image, BMP_WIDTH * BMP_HEIGTH);
+    return erodeInto(session, src, binary_image);
+}
+
+
+
+// Append a window to the list.
+void windowListPush(window_list* list, int window) {
+    if (list->size == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 256;
+        list->items = (int*) realloc(list->items, list->capacity * sizeof(int));
+    }
+    if (list->size > 0 && list->items[list->size - 1] > window) {
+        list->sorted = 0;
+    }
+    list->items[list->size++] = window;
+}
+
+int compareWindows(const void* a, const void* b) {
+    return *(const int*) a - *(const int*) b;
+}
+
+// Min-heap operations on a window list, so windows can be taken out in scan order.
+void windowHeapPush(window_list* heap, int window) {
+    windowListPush(heap, window);
+    int i = heap->size - 1;
+    while (i > 0 && heap->items[(i - 1) / 2] > heap->items[i]) {
+        int parent = (i - 1) / 2;
+        int tmp = heap->items[parent];
+        heap->items[parent] = heap->items[i];
+        heap->items[i] = tmp;
+        i = parent;
+    }
+}
+
+int windowHeapPop(window_list* heap) {
+    int top = heap->items[0];
+    heap->items[0] = heap->items[--heap->size];
+    int i = 0;
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = 2 * i + 2;
+        if (left < heap->size && heap->items[left] < heap->items[smallest]) smallest = left;
+        if (right < heap->size && heap->items[right] < heap->items[smallest]) smallest = right;
+        if (smallest == i) break;
+        int tmp = heap->items[smallest];
+        heap->items[smallest] = heap->items[i];
+        heap->items[i] = tmp;
+        i = smallest;
+    }
+    return top;
+}
+
+// Register a cell detected with its capturing area at (x, y) in session->detections: mark it with a
+// red square on bmp_image, unless bmp_image is NULL (the caller then draws the detections itself).
+void drawCell(cells_session* session, unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], int x, int y) {
+    for (int i = 1; i <= testsize && bmp_image != NULL; i++) {
+        for (int j = 1; j <= testsize; j++) {
+            bmp_image[x + i][y + j][0] = 255;
+            bmp_image[x + i][y + j][1] = 0;
+            bmp_image[x + i][y + j][2] = 0;
+        }
+    }
+    detectionAdd(session, x, y);
+}
+
+// Number of white pixels in the area of w x h pixels at (x, y), from the summed-area table.
+#define AREA_SUM(table, x, y, w, h) ((table)[(x) + (w)][(y) + (h)] - (table)[x][(y) + (h)] - (table)[(x) + (w)][y] + (table)[x][y])
+
+// Summed-area table of the session for an image of width x height pixels: (width + 1) x (height + 1)
+// entries, entry (x, y) at x * (height + 1) + y, with the sums over nothing (x = 0 or y = 0) set to 0.
+unsigned int* sessionAreaTable(cells_session* session, int width, int height) {
+    size_t size = (size_t) (width + 1) * (height + 1);
+    if (size > session->area_table_size) {
+        if (session->area_table != NULL) {
+            bmp_buffer_free(session->area_table, session->area_table_size * sizeof(unsigned int), session->area_table_mapped);
+        }
+        session->area_table = (unsigned int*) bmp_buffer_alloc(size * sizeof(unsigned int), &session->area_table_mapped);
+        session->area_table_size = size;
+    }
+    memset(session->area_table, 0, (height + 1) * sizeof(unsigned int));
+    for (int x = 1; x <= width; x++) {
+        session->area_table[(size_t) x * (height + 1)] = 0;
+    }
+    return session->area_table;
+}
+
+// Detect cells in the binary image using sliding window approach, scanning the pixels of every
+// window. Reference implementation of detectParallel.
+int detectNaive(cells_session* session, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], erosion_frontier* frontier) {
+    int cells = 0;
+    for (int x = 1; x < BMP_WIDTH - testsize - 1; x++) {
+        for (int y = 1; y < BMP_HEIGTH - testsize - 1; y++) {
+            
+            // Check if at least one pixel is white in the capturing area (12x12 square)
+            int has_white_pixel = 0;
+            for (int dx = 0; dx < testsize; dx++) {
+                for (int dy = 0; dy < testsize; dy++) {
+                    if (binary_image[x + dx][y + dy] == 1) {
+                        has_white_pixel = 1;
+                        break;
+                    }
+                }
+                if (has_white_pixel) break;
+            }
+            
+            // If at least one pixel is white in the capturing area
+            if (has_white_pixel) {
+                
+                // Check if all pixels in the exclusion frame are black
+                int exclusion_frame_clear = 1;
+                
+                // Check top and bottom rows of exclusion frame
+                for (int dy = -1; dy <= testsize; dy++) {
+                    if (y + dy >= 0 && y + dy < BMP_HEIGTH) {
+                        if (binary_image[x - 1][y + dy] == 1 || binary_image[x + testsize][y + dy] == 1) {
+                            exclusion_frame_clear = 0;
+                            break;
+                        }
+                    }
+                }
+                
+                // Check left and right columns of exclusion frame (excluding corners already checked)
+                if (exclusion_frame_clear) {
+                    for (int dx = 0; dx < testsize; dx++) {
+                        if (x + dx >= 0 && x + dx < BMP_WIDTH) {
+                            if (binary_image[x + dx][y - 1] == 1 || binary_image[x + dx][y + testsize] == 1) {
+                                exclusion_frame_clear = 0;
+                                break;
+                            }
+                        }
+                    }
+                }
+                
+                // If all pixels in the exclusion frame are black, register a cell detection
+                if (exclusion_frame_clear) {
+                    if (detectionIsNew(session, x, y)) {
+                        cells++;
+                        drawCell(session, bmp_image, x, y);
+                        recordCell(session, x, y, binary_image[x] + y, BMP_HEIGTH);
+                    }
+
+                    // Set all pixels inside the capturing area to black to prevent detecting the same cell twice
+                    if (frontier != NULL) {
+                        frontierClear(frontier, binary_image, x, y, testsize);
+                    } else {
+                        for (int dx = 0; dx < testsize; dx++) {
+                            for (int dy = 0; dy < testsize; dy++) {
+                                binary_image[x + dx][y + dy] = 0;
+                            }
+                        }
+                    }
+
+                }
+            }
+        }
+    }
+    return cells;
+}
+
+// Pack the binary image into 64 pixels per word along y. Bit b of packed_image[x][w] holds pixel (x, w * 64 + b).
+void packBinary(unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], uint64_t packed_image[BMP_WIDTH][PACKED_WORDS]) {
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        for (int w = 0; w < PACKED_WORDS; w++) {
+            uint64_t word = 0;
+            int y0 = w * 64;
+            int bits = BMP_HEIGTH - y0 < 64 ? BMP_HEIGTH - y0 : 64;
+            for (int b = 0; b < bits; b++) {
+                word |= (uint64_t) (binary_image[x][y0 + b] != 0) << b;
+            }
+            packed_image[x][w] = word;
+        }
+    }
+}
+
+// Unpack a bit-packed image back into one byte (0 or 1) per pixel.
+void unpackBinary(uint64_t packed_image[BMP_WIDTH][PACKED_WORDS], unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH]) {
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        for (int y = 0; y < BMP_HEIGTH; y++) {
+            binary_image[x][y] = (packed_image[x][y >> 6] >> (y & 63)) & 1;
+        }
+    }
+}
+
+// Bits of column x shifted so that bit y holds pixel y - 1 (the neighbour above) or y + 1 (below).
+#define PACKED_PREV(column, w) (((column)[w] << 1) | ((w) > 0 ? (column)[(w) - 1] >> 63 : 0))
+#define PACKED_NEXT(column, w) (((column)[w] >> 1) | ((w) + 1 < PACKED_WORDS ? (column)[(w) + 1] << 63 : 0))
+
+// Same erosion as erode with the default element, on bit-packed images: reads src and writes dst,
+// 64 pixels per operation. The default structuring element keeps pixel (x, y) white only if (x-1, y-1),
+// (x-1, y), (x, y-1), (x, y), (x, y+1), (x+1, y-1) and (x+1, y) are all white.
+// Returns 1 if any white pixel away from the image border was eroded.
+char erodePacked(uint64_t src[BMP_WIDTH][PACKED_WORDS], uint64_t dst[BMP_WIDTH][PACKED_WORDS]) {
+    uint64_t eroded = 0;
+
+    // Pixels away from the top and bottom border, i.e. 1 <= y < BMP_HEIGTH - 1.
+    uint64_t interior[PACKED_WORDS];
+    for (int w = 0; w < PACKED_WORDS; w++) {
+        interior[w] = ~(uint64_t) 0;
+        if (BMP_HEIGTH - w * 64 < 64) {
+            interior[w] = ((uint64_t) 1 << (BMP_HEIGTH - w * 64)) - 1;
+        }
+    }
+    interior[0] &= ~(uint64_t) 1;
+    interior[(BMP_HEIGTH - 1) >> 6] &= ~((uint64_t) 1 << ((BMP_HEIGTH - 1) & 63));
+
+    for (int x = 1; x < BMP_WIDTH - 1; x++) {
+        uint64_t* left = src[x - 1];
+        uint64_t* centre = src[x];
+        uint64_t* right = src[x + 1];
+        for (int w = 0; w < PACKED_WORDS; w++) {
+            uint64_t result = centre[w] & PACKED_PREV(centre, w) & PACKED_NEXT(centre, w)
+                            & left[w] & PACKED_PREV(left, w)
+                            & right[w] & PACKED_PREV(right, w)
+                            & interior[w];
+            eroded |= centre[w] & interior[w] & ~result;
+            dst[x][w] = result;
+        }
+    }
+
+    // Left and right borders are always black.
+    for (int w = 0; w < PACKED_WORDS; w++) {
+        dst[0][w] = 0;
+        dst[BMP_WIDTH - 1][w] = 0;
+    }
+    return eroded != 0;
+}
+
+// Count the white pixels of a bit-packed image.
+int countPackedPixels(uint64_t packed_image[BMP_WIDTH][PACKED_WORDS]) {
+    int white_pixels = 0;
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        for (int w = 0; w < PACKED_WORDS; w++) {
+            white_pixels += __builtin_popcountll(packed_image[x][w]);
+        }
+    }
+    return white_pixels;
+}
+
+// Count the white pixels of the binary image.
+int countWhitePixels(unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH]) {
+    int white_pixels = 0;
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        for (int y = 0; y < BMP_HEIGTH; y++) {
+            if (binary_image[x][y] == 1) {
+                white_pixels++;
+            }
+        }
+    }
+    return white_pixels;
+}
+
+// Add the white pixel (x, y) to the frontier, unless it is outside the image or already queued.
+void frontierPush(erosion_frontier* frontier, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], int x, int y) {
+    if (x < 0 || x >= BMP_WIDTH || y < 0 || y >= BMP_HEIGTH) {
+        return;
+    }
+    if (binary_image[x][y] && !frontier->queued[x][y]) {
+        frontier->queued[x][y] = 1;
+        frontier->pixels[frontier->size++] = x * BMP_HEIGTH + y;
+    }
+}
+
+// Pixel (x, y) just turned black: queue every white pixel whose structuring element covers it.
+void frontierPushNeighbours(erosion_frontier* frontier, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], int x, int y) {
+    structuring_element* se = erosion_element;
+    for (int k = 0; k < se->count; k++) {
+        if (se->dx[k] != 0 || se->dy[k] != 0) {
+            frontierPush(frontier, binary_image, x - se->dx[k], y - se->dy[k]);
+        }
+    }
+}
+
+// Start incremental erosion of the binary image. The first pass visits every white pixel,
+// since border pixels and pixels next to black ones can be anywhere.
+void frontierInit(erosion_frontier* frontier, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH]) {
+    frontier->size = 0;
+    frontier->white_pixels = 0;
+    memset(frontier->queued, 0, sizeof(frontier->queued));
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        for (int y = 0; y < BMP_HEIGTH; y++) {
+            if (binary_image[x][y]) {
+                frontier->white_pixels++;
+                frontierPush(frontier, binary_image, x, y);
+            }
+        }
+    }
+}
+
+// Erode the binary image in place, with the same result as erode, but only visiting the pixels in
+// the frontier. The pixels that turn black put their white neighbours in the frontier for the
+// next pass, and frontier->white_pixels is updated as pixels are cleared.
+char frontierErode(erosion_frontier* frontier, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH]) {
+    structuring_element* se = erosion_element;
+    char wasEroded = 0;
+    int eroded = 0;
+
+    // Find the pixels to erode. The image is not changed yet, so every pixel sees the same input as in erode.
+    for (int k = 0; k < frontier->size; k++) {
+        int x = frontier->pixels[k] / BMP_HEIGTH;
+        int y = frontier->pixels[k] % BMP_HEIGTH;
+        frontier->queued[x][y] = 0;
+        if (!binary_image[x][y]) {
+            continue;
+        }
+        // Border pixels are set to black, but that does not count as erosion.
+        if (x < se->radius || y < se->radius || x >= BMP_WIDTH - se->radius || y >= BMP_HEIGTH - se->radius) {
+            frontier->eroded[eroded++] = frontier->pixels[k];
+            continue;
+        }
+        int erosion_result = 1;
+        for (int e = 0; e < se->count && erosion_result; e++) {
+            if (binary_image[x + se->dx[e]][y + se->dy[e]] == 0) {
+                erosion_result = 0;
+            }
+        }
+        if (!erosion_result) {
+            frontier->eroded[eroded++] = frontier->pixels[k];
+            wasEroded = 1;
+        }
+    }
+
+    // Clear them, then queue their white neighbours for the next pass.
+    frontier->size = 0;
+    for (int k = 0; k < eroded; k++) {
+        binary_image[frontier->eroded[k] / BMP_HEIGTH][frontier->eroded[k] % BMP_HEIGTH] = 0;
+    }
+    frontier->white_pixels -= eroded;
+    for (int k = 0; k < eroded; k++) {
+        frontierPushNeighbours(frontier, binary_image, frontier->eroded[k] / BMP_HEIGTH, frontier->eroded[k] % BMP_HEIGTH);
+    }
+    return wasEroded;
+}
+
+// Clear the size x size area at (x0, y0), as detect does after a detection, and queue the
+// white neighbours of the cleared pixels.
+void frontierClear(erosion_frontier* frontier, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], int x0, int y0, int size) {
+    int cleared = 0;
+    for (int x = x0; x < x0 + size; x++) {
+        for (int y = y0; y < y0 + size; y++) {
+            if (binary_image[x][y]) {
+                binary_image[x][y] = 0;
+                frontier->eroded[cleared++] = x * BMP_HEIGTH + y;
+            }
+        }
+    }
+    frontier->white_pixels -= cleared;
+    for (int k = 0; k < cleared; k++) {
+        frontierPushNeighbours(frontier, binary_image, frontier->eroded[k] / BMP_HEIGTH, frontier->eroded[k] % BMP_HEIGTH);
+    }
+}
+
+// Erode the binary image and detect cells after every pass, until erosion no longer changes the
+// image, no white pixels are left (or the next pass would leave none, see schedule.c), or
+// MAX_EROSIONS passes have been made. Detections are drawn on bmp_image. engine selects how erosion is done (ENGINE_FULL, ENGINE_FRONTIER, ENGINE_DISTANCE or ENGINE_PACKED);
+// they all give the same result. With a thread pool (session->threads > 1) the full engine erodes on
+// it, and the full, frontier and packed engines detect on it (see parallel.c). Returns the number of cells detected and stores the number of passes in *iterations.
+// The packed engine erodes a bit-packed copy of the image with erodePacked and unpacks it for
+// detection, which clears pixels of the unpacked image, so it is packed again after a detect call.
+// erodePacked only has the default element; with any other the packed engine erodes like the full one.
+// binary_image is used as scratch and does not hold the final image afterwards.
+int erodeAndDetect(cells_session* session, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], int engine, int* iterations) {
+    if (engine == ENGINE_FRONTIER && session->frontier == NULL) {
+        session->frontier = (erosion_frontier*) sessionAlloc(session, sizeof(erosion_frontier));
+    }
+    erosion_frontier* frontier = session->frontier;
+    int packed = engine == ENGINE_PACKED && erosion_element == &structuring_elements[0];
+    if (packed && session->packed == NULL) {
+        session->packed = (uint64_t (*)[PACKED_WORDS]) sessionAlloc(session, 2 * BMP_WIDTH * sizeof(session->packed[0]));
+    }
+    image_resize(&session->eroded, BMP_WIDTH, BMP_HEIGTH, 1);
+
+    // The binary image currently being worked on, and the one the next erosion pass writes to.
+    unsigned char (*current_image)[BMP_HEIGTH] = binary_image;
+    unsigned char (*eroded_image)[BMP_HEIGTH] = FIXED_BINARY(&session->eroded);
+
+    // The same two for the packed engine. current_image stays binary_image, unpacked every pass.
+    uint64_t (*packed_image)[PACKED_WORDS] = session->packed;
+    uint64_t (*packed_eroded)[PACKED_WORDS] = packed ? session->packed + BMP_WIDTH : NULL;
+
+    detectionsReset(session);
+    if (session->cell_records != NULL) {
+        labelComponents(session, &binary_image[0][0], BMP_WIDTH, BMP_HEIGTH, BMP_HEIGTH);
+    }
+    session->detects_skipped = 0;
+    session->passes_saved = 0;
+
+    // Save the initial binary image as step 0 (before any erosion)
+    if (SNAPSHOT_DUE(0)) {
+        profile_mark snapshot_mark = profileStart();
+        saveErosionStepImage(current_image, 0);
+        profileStop(PROFILE_SNAPSHOT, snapshot_mark);
+    }
+
+    if (engine == ENGINE_DISTANCE) {
+        return distanceErodeAndDetect(session, binary_image, bmp_image, iterations);
+    }
+
+    int white_pixels;
+    profile_mark mark = profileStart();
+    if (engine == ENGINE_FRONTIER) {
+        frontierInit(frontier, current_image);
+        white_pixels = frontier->white_pixels;
+        profileStop(PROFILE_ERODE, mark);
+    } else {
+        white_pixels = countWhitePixels(current_image);
+        profileStop(PROFILE_COUNT, mark);
+    }
+    if (packed) {
+        mark = profileStart();
+        packBinary(current_image, packed_image);
+        profileStop(PROFILE_ERODE, mark);
+    }
+    profileInitialWhite(session, white_pixels);
+    if (cells_verbose) {
+        printf("Initial white pixels after binary conversion: %d\n", white_pixels);
+    }
+
+    int erosion_iterations = 0;
+    int total_cells = 0;
+    char wasEroded;
+    do {
+        if (cells_verbose) {
+            printf("Starting erosion with structuring element '%s'...\n", erosion_element->name);
+        }
+        mark = profileStart();
+        if (engine == ENGINE_FRONTIER) {
+            wasEroded = frontierErode(frontier, current_image);
+            white_pixels = frontier->white_pixels;
+            profileStop(PROFILE_ERODE, mark);
+        } else if (packed) {
+            wasEroded = erodePacked(packed_image, packed_eroded);
+            uint64_t (*previous_packed)[PACKED_WORDS] = packed_image;
+            packed_image = packed_eroded;
+            packed_eroded = previous_packed;
+            unpackBinary(packed_image, current_image);
+            profileStop(PROFILE_ERODE, mark);
+
+            mark = profileStart();
+            white_pixels = countPackedPixels(packed_image);
+            profileStop(PROFILE_COUNT, mark);
+        } else {
+            // erodeParallel counts the white pixels too, so its count is part of the erosion time.
+            if (session->threads > 1) {
+                wasEroded = erodeParallel(session, current_image, eroded_image, &white_pixels);
+            } else {
+                wasEroded = erodeInto(session, current_image, eroded_image);
+            }
+            profileStop(PROFILE_ERODE, mark);
+
+            // Swap the images, so the eroded image becomes the current one.
+            unsigned char (*previous_image)[BMP_HEIGTH] = current_image;
+            current_image = eroded_image;
+            eroded_image = previous_image;
+
+            if (session->threads <= 1) {
+                mark = profileStart();
+                white_pixels = countWhitePixels(current_image);
+                profileStop(PROFILE_COUNT, mark);
+            }
+        }
+        erosion_iterations++;
+
+        // Save snapshot after this erosion iteration
+        if (SNAPSHOT_DUE(erosion_iterations)) {
+            mark = profileStart();
+            saveErosionStepImage(current_image, erosion_iterations);
+            profileStop(PROFILE_SNAPSHOT, mark);
+        }
+
+        if (cells_verbose) {
+            printf("After erosion %d: %d white pixels remaining, wasEroded=%d\n",
+                   erosion_iterations, white_pixels, wasEroded);
+        }
+
+        // Stop if no white pixels remain or max erosions reached
+        if (white_pixels == 0 || erosion_iterations > MAX_EROSIONS) {
+            profilePass(session, white_pixels, 0);
+            break;
+        }
+
+        // detectParallel also runs on this thread alone when the pool is not started: its
+        // summed-area table tests every window in constant time, and a detection only makes it
+        // test the windows around it again. It is skipped when no window can fire (see schedule.c).
+        mark = profileStart();
+        session->cell_records_step = erosion_iterations;
+        int outlook = scheduleOutlook(session, &current_image[0][0], BMP_WIDTH, BMP_HEIGTH, BMP_HEIGTH);
+        int cells = 0;
+        if (outlook & OUTLOOK_DETECT) {
+            cells = detectParallel(session, current_image, bmp_image, engine == ENGINE_FRONTIER ? frontier : NULL);
+            if (packed) {
+                packBinary(current_image, packed_image);
+            }
+        } else {
+            session->detects_skipped++;
+        }
+        profileStop(PROFILE_DETECT, mark);
+        profilePass(session, white_pixels, cells);
+        total_cells += cells;
+
+        // The next pass would leave no white pixels and end the loop: erosion removes them all, or
+        // detection has cleared them (it clears at most testsize x testsize pixels per cell).
+        if (schedule_enabled && save_snapshots == 0 && cells > 0 && white_pixels <= cells * testsize * testsize) {
+            int white_left = engine == ENGINE_FRONTIER ? frontier->white_pixels : countWhitePixels(current_image);
+            if (white_left == 0) {
+                outlook |= OUTLOOK_LAST;
+            }
+        }
+        if ((outlook & OUTLOOK_LAST) && wasEroded) {
+            session->passes_saved++;
+            break;
+        }
+
+    } while (wasEroded);
+
+    *iterations = erosion_iterations;
+    return total_cells;
+}
@@ -0,0 +1,317 @@
+#ifndef CELLS_CELLS_H
+#define CELLS_CELLS_H
+
+#include <stdint.h>
+#include "cbmp.h"
+
+#define testsize 12
+#define BINARY_COLOUR_THRESHOLD 270
+
+// Limit erosions to prevent removing all pixels
+#define MAX_EROSIONS 100
+
+// Erosion engines for erodeAndDetect.
+#define ENGINE_FULL 0        // Erode the whole image every pass, swapping two images.
+#define ENGINE_FRONTIER 1    // Only visit pixels next to ones that turned black in the previous pass.
+#define ENGINE_DISTANCE 2    // Compute when each pixel turns black once, then only visit windows that can fire.
+#define ENGINE_PACKED 3      // Erode bit-packed images, 64 pixels per operation (default element only).
+
+// What scheduleOutlook finds before a detect call (see schedule.c), as bit flags.
+#define OUTLOOK_DETECT 1     // A window can fire: detect has to run.
+#define OUTLOOK_LAST 2       // The next erosion pass turns the image black: the loop can stop.
+
+// Most threads the parallel mode can use (see parallel.c).
+#define MAX_THREADS 64
+
+// Blocks of the session arena (see sessionAlloc): the usual size and the alignment of what is
+// handed out, a cache line.
+#define SESSION_ARENA_BLOCK (8 * 1024 * 1024)
+#define SESSION_ARENA_ALIGN 64
+
+// Stages of the image pipeline (see pipeline.c), and the frames in flight in it at most.
+#define PIPELINE_LOAD 0       // read_bitmap_image, on a thread of its own.
+#define PIPELINE_COMPUTE 1    // erodeAndDetectSized, on the calling thread and the session's pool.
+#define PIPELINE_WRITE 2      // write_bitmap_image, on a thread of its own.
+#define PIPELINE_STAGES 3
+#define PIPELINE_FRAMES 4
+
+// Chains of the spatial hash of the detections, a power of 2 (see detections.c).
+#define DETECTION_SLOTS 1024
+
+// Snapshot file formats (see snapshot.c).
+#define SNAPSHOT_BMP 0
+#define SNAPSHOT_PBM 1
+
+// True if the binary image after erosion `step` is to be saved as a snapshot.
+#define SNAPSHOT_DUE(step) (save_snapshots > 0 && (step) % save_snapshots == 0)
+
+// Stages timed by the profiler (see profile.c).
+#define PROFILE_LOAD 0
+#define PROFILE_ERODE 1
+#define PROFILE_COUNT 2
+#define PROFILE_DETECT 3
+#define PROFILE_SNAPSHOT 4
+#define PROFILE_WRITE 5
+#define PROFILE_STAGES 6
+
+// Largest structuring element, SE_MAX_SIZE x SE_MAX_SIZE pixels around the pixel (see elements.c).
+#define SE_MAX_SIZE 31
+
+// Steps of a decomposed structuring element, eroded one after the other (see elements.c).
+#define SE_STEP_ROW 0        // Line of `size` pixels along x.
+#define SE_STEP_COLUMN 1     // Line of `size` pixels along y.
+#define SE_STEP_ELEMENT 2    // The element structuring_elements[size].
+#define SE_MAX_STEPS 16
+
+// Number of 64-bit words holding one column of a bit-packed binary image.
+#define PACKED_WORDS ((BMP_HEIGTH + 63) / 64)
+
+// State of the incremental (frontier) erosion engine.
+typedef struct erosion_frontier_data
+{
+    int white_pixels;                                // Number of white pixels left in the image.
+    int size;                                        // Number of pixels to visit in the next pass.
+    int pixels[BMP_WIDTH * BMP_HEIGTH];              // Pixels to visit, as x * BMP_HEIGTH + y.
+    int eroded[BMP_WIDTH * BMP_HEIGTH];              // Scratch list of pixels turning black.
+    unsigned char queued[BMP_WIDTH][BMP_HEIGTH];     // 1 if the pixel is already in pixels.
+} erosion_frontier;
+
+// Growable list of window indices (x * BMP_HEIGTH + y), also used as a min-heap.
+typedef struct window_list_data
+{
+    int* items;
+    int size;
+    int capacity;
+    int sorted;
+} window_list;
+
+// A detection: the capturing area at (x, y), linked to the next one of its chain (see detections.c).
+typedef struct detection_data
+{
+    int x;
+    int y;
+    int next;
+} detection;
+
+// Detections of a run, in order, also indexed by position.
+typedef struct detection_list_data
+{
+    detection* items;
+    int size;
+    int capacity;
+} detection_list;
+
+// Point in time taken by profileStart: wall clock and cycle counter.
+typedef struct profile_mark_data
+{
+    double seconds;
+    uint64_t cycles;
+} profile_mark;
+
+// Erosion of the columns x_begin <= x < x_end of src into dst, see erodeBand.
+typedef char (*erode_kernel)(unsigned char src[BMP_WIDTH][BMP_HEIGTH], unsigned char dst[BMP_WIDTH][BMP_HEIGTH], int x_begin, int x_end);
+
+// A step of a decomposed structuring element.
+typedef struct se_step_data
+{
+    int type;       // SE_STEP_ROW, SE_STEP_COLUMN or SE_STEP_ELEMENT.
+    int size;       // Length of the line, or index of the element.
+} se_step;
+
+// A structuring element: pixel (x, y) stays white only if the pixels (x + dx[k], y + dy[k]) are
+// all white. Pixels closer than radius to the image border are always black. If step_count is not
+// 0, the element is the combination of the steps and erodeInto erodes it step by step.
+typedef struct structuring_element_data
+{
+    char* name;
+    int radius;
+    int count;                              // Number of entries, the pixel itself included.
+    int dx[SE_MAX_SIZE * SE_MAX_SIZE];
+    int dy[SE_MAX_SIZE * SE_MAX_SIZE];
+    erode_kernel kernel;                    // Erosion unrolled for this element, or erodeBandGeneric.
+    int step_count;
+    se_step steps[SE_MAX_STEPS];
+} structuring_element;
+
+// A detected cell, with the connected components of the binary image it was found in (see components.c).
+typedef struct cell_record_data
+{
+    int x;              // Capturing area of the detection.
+    int y;
+    int step;           // Erosion pass the cell was detected after.
+    int component;      // Number of the largest component of the cell.
+    int area;           // White pixels of the cell before erosion.
+    long sum_x;         // Sums of the coordinates of those pixels, for the centroid.
+    long sum_y;
+    int x_min;          // Bounding box of the cell, inclusive.
+    int y_min;
+    int x_max;
+    int y_max;
+} cell_record;
+
+// Growable list of detected cells.
+typedef struct cell_table_data
+{
+    cell_record* items;
+    int size;
+    int capacity;
+} cell_table;
+
+// Work run by the thread pool: one call per band, band = 0 .. bands - 1.
+typedef void (*band_task)(void* arg, int band, int bands);
+
+// Everything the processing of one image keeps between calls (see session.c): its images, the
+// results of the last run, its thread pool and the scratch of the engines. Sessions share no
+// state, so several images can be processed at once, one session per thread; the options
+// (erosion_element, binary_threshold, ...) are only read. A zeroed session is ready to use and
+// runs on the calling thread; the scratch is allocated on first use and freed by sessionFree.
+// Scratch of a fixed size comes from the arena of the session (sessionAlloc), the rest grows as
+// needed and is kept, so after the first image of a size the session allocates nothing.
+typedef struct cells_session_data
+{
+    image rgb;                              // Image as read from the file, drawn on (main, batch and tiled mode).
+    image binary;                           // Binary image, used as scratch by the erosion loop.
+    image eroded;                           // Image the next erosion pass writes to.
+
+    detection_list detections;              // Detections of the last run, in order (see detections.c).
+    int detection_heads[DETECTION_SLOTS];   // First detection of every chain, -1 if none.
+    cell_table* cell_records;               // If not NULL, every detection is also added to it (see components.c).
+    int cell_records_step;                  // Erosion pass the detections recorded now are made after.
+    int detects_skipped;                    // Detect calls skipped in the last run (see schedule.c).
+    int passes_saved;                       // Erosion passes not made in the last run.
+    int windows_tested;                     // Windows tested by detection in this pass, for the profile.
+    int pixels_cleared;                     // White pixels cleared by detection in this pass, likewise.
+
+    int threads;                            // Threads of the pool, the caller included (0 or 1: no pool).
+    struct thread_pool_data* pool;          // See parallel.c.
+    erosion_frontier* frontier;             // Frontier engine.
+    uint64_t (*packed)[PACKED_WORDS];       // Packed engine: two bit-packed images, one after the other.
+    struct distance_state_data* distance;   // Distance engine, see distance.c.
+    struct label_state_data* labels;        // Component labels, see components.c.
+    struct schedule_state_data* schedule;   // See schedule.c.
+    struct step_state_data* steps;          // Scratch of erodeSteps, see elements.c.
+    unsigned int* area_table;               // Summed-area table of detectParallel and detectSized.
+    size_t area_table_size;                 // Entries allocated for area_table.
+    int area_table_mapped;                  // See bmp_buffer_alloc.
+    struct arena_block_data* arena;         // Blocks of sessionAlloc, see session.c.
+    window_list candidates[MAX_THREADS];    // Windows that fire before any detection, per band.
+    window_list retest;                     // Windows to test again after a detection.
+} cells_session;
+
+// An image going through the pipeline, with its results. The frames are reused for the next images.
+typedef struct pipeline_frame_data
+{
+    int index;                          // Image of the run.
+    image binary;
+    image rgb;                          // As read, then with the detections drawn on it.
+    int threshold;                      // Threshold used, see read_bitmap_image.
+    int cells;                          // Cells detected.
+    int iterations;                     // Erosion passes made.
+    int detects_skipped;                // As in the session after the image (see schedule.c).
+    int passes_saved;
+    double seconds[PIPELINE_STAGES];    // Time spent on the image by every stage.
+} pipeline_frame;
+
+// Time spent by every stage of a pipeline run, working and waiting for a frame: the load stage
+// waits for a frame the write stage is done with, the others for one from the stage before them.
+typedef struct pipeline_stats_data
+{
+    double busy[PIPELINE_STAGES];
+    double waiting[PIPELINE_STAGES];
+    double seconds;                     // Wall time of the run.
+    int frames;                         // Images processed.
+} pipeline_stats;
+
+// Images for runPipeline and what to do with their results.
+typedef struct pipeline_job_data
+{
+    char** inputs;                      // Path of every image.
+    char** outputs;                     // Where to write it.
+    int count;                          // Images 0 .. count - 1 are processed in order, unless next is set.
+    int (*next)(void* arg);             // If not NULL, index of the next image, or -1 when none are left.
+    void (*hook)(void* arg, pipeline_frame* frame, int stage);  // If not NULL, called after every stage, on its thread.
+    void* arg;
+    int engine;
+} pipeline_job;
+
+extern structuring_element structuring_elements[];
+extern int structuring_element_count;
+extern structuring_element* erosion_element;
+extern int cells_verbose;
+extern int binary_threshold;
+extern int save_snapshots;
+extern int snapshot_format;
+extern int snapshots_queued;
+extern int detection_min_separation;
+extern int schedule_enabled;
+extern int profile_enabled;
+
+// Public function declarations
+double now_seconds(void);
+int getColourIntensity(unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], unsigned int x, unsigned int y);
+void switchColour(unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned int x, unsigned int y);
+void rgbToBinary (unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH]);
+void binaryToRGB (unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]);
+void saveErosionStepImage(unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], int step);
+void snapshotSubmit(unsigned char* binary, int width, int height, int stride, int step);
+int snapshotStop(void);
+profile_mark profileStart(void);
+void profileStop(int stage, profile_mark start);
+void profileBeginRepetition(void);
+void profileEndRepetition(void);
+void profileInitialWhite(cells_session* session, int white_pixels);
+void profilePass(cells_session* session, int white_pixels, int detections);
+int profileReport(char* path, char* input_path);
+char erodeBandGeneric(unsigned char src[BMP_WIDTH][BMP_HEIGTH], unsigned char dst[BMP_WIDTH][BMP_HEIGTH], int x_begin, int x_end);
+int selectStructuringElement(char* spec);
+char erodeSteps(cells_session* session, unsigned char src[BMP_WIDTH][BMP_HEIGTH], unsigned char dst[BMP_WIDTH][BMP_HEIGTH]);
+char erodeBand (unsigned char src[BMP_WIDTH][BMP_HEIGTH], unsigned char dst[BMP_WIDTH][BMP_HEIGTH], int x_begin, int x_end);
+char erodeInto (cells_session* session, unsigned char src[BMP_WIDTH][BMP_HEIGTH], unsigned char dst[BMP_WIDTH][BMP_HEIGTH]);
+char erode (cells_session* session, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]);
+unsigned int* sessionAreaTable(cells_session* session, int width, int height);
+int detectNaive(cells_session* session, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], erosion_frontier* frontier);
+void packBinary(unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], uint64_t packed_image[BMP_WIDTH][PACKED_WORDS]);
+void unpackBinary(uint64_t packed_image[BMP_WIDTH][PACKED_WORDS], unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH]);
+char erodePacked(uint64_t src[BMP_WIDTH][PACKED_WORDS], uint64_t dst[BMP_WIDTH][PACKED_WORDS]);
+int countPackedPixels(uint64_t packed_image[BMP_WIDTH][PACKED_WORDS]);
+int countWhitePixels(unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH]);
+void frontierInit(erosion_frontier* frontier, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH]);
+char frontierErode(erosion_frontier* frontier, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH]);
+void frontierClear(erosion_frontier* frontier, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], int x0, int y0, int size);
+void windowListPush(window_list* list, int window);
+int compareWindows(const void* a, const void* b);
+void windowHeapPush(window_list* heap, int window);
+int windowHeapPop(window_list* heap);
+void detectionsReset(cells_session* session);
+int detectionIsNew(cells_session* session, int x, int y);
+void detectionAdd(cells_session* session, int x, int y);
+void printDetections(cells_session* session);
+void drawCell(cells_session* session, unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], int x, int y);
+int labelComponents(cells_session* session, unsigned char* binary, int width, int height, int stride);
+void recordCell(cells_session* session, int x, int y, unsigned char* area, int stride);
+int writeCellTable(cell_table* table, char* path);
+int scheduleOutlook(cells_session* session, unsigned char* binary, int width, int height, int stride);
+void threadPoolStart(cells_session* session, int threads);
+void threadPoolStop(cells_session* session);
+void threadPoolRun(cells_session* session, band_task task, void* arg);
+void bandRange(int begin, int end, int band, int bands, int* band_begin, int* band_end);
+char erodeParallel(cells_session* session, unsigned char src[BMP_WIDTH][BMP_HEIGTH], unsigned char dst[BMP_WIDTH][BMP_HEIGTH], int* white_pixels);
+int detectParallel(cells_session* session, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], erosion_frontier* frontier);
+void rgbToBinarySized(image* rgb, image* binary);
+void binaryToRGBSized(image* binary, image* rgb);
+int countWhitePixelsSized(image* binary);
+void saveErosionStepSized(image* binary, int step);
+char erodeSized(cells_session* session, image* src, image* dst);
+void paintCell(image* rgb, int x, int y);
+void drawCellSized(cells_session* session, image* rgb, int x, int y);
+int detectSized(cells_session* session, image* binary, image* rgb);
+int erodeAndDetectSized(cells_session* session, image* binary, image* rgb, int engine, int* iterations);
+int distanceErodeAndDetect(cells_session* session, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], int* iterations);
+int erodeAndDetect(cells_session* session, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], int engine, int* iterations);
+void sessionInit(cells_session* session, int threads);
+void sessionFree(cells_session* session);
+void* sessionAlloc(cells_session* session, size_t size);
+int runPipeline(cells_session* session, pipeline_job* job, pipeline_stats* stats);
+void pipelineReport(pipeline_stats* stats);
+
+#endif // CELLS_CELLS_H
@@ -0,0 +1,246 @@
+// Per-cell statistics (--cells FILE): area, centroid and bounding box of every detected cell.
+//
+// Before the first erosion pass, labelComponents labels the connected components (8-connected)
+// of the binary image in one raster pass. Scanning a column, the label of a white pixel is decided
+// from at most two of its already visited neighbours: if the pixel at the same y in the previous
+// column is white it is connected to all the others, so its label is taken and nothing else is
+// read; otherwise only the pixel after it (y + 1) can belong to a different set than the ones
+// before it, and the two are united. Equivalent labels are kept in a union-find forest whose roots
+// are always the smallest label, and the area, coordinate sums and bounding box are added up per
+// label in the same pass. The forest is then flattened once and the sums moved to the roots, so
+// no second pass over the image is needed.
+//
+// When a cell is detected, recordCell looks up the labels of the white pixels left in its
+// capturing area, which are the part of the cell that erosion has not removed yet. The cell is
+// the union of the components they belong to, taken in the image before erosion. When erosion
+// splits a blob into several cells, each cell reports the whole blob, with the same component.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "cells.h"
+
+// Sums of a provisional label, moved to the root of its set by labelComponents.
+typedef struct component_stats_data
+{
+    int id;             // Component number, from 1 in scan order (roots only).
+    int area;
+    long sum_x;
+    long sum_y;
+    int x_min;
+    int y_min;
+    int x_max;
+    int y_max;
+} component_stats;
+
+// Labels of the image labelled last by a session (session->labels).
+typedef struct label_state_data
+{
+    int* labels;                   // Provisional label of pixel (x, y) at x * height + y, 0 for black.
+    size_t labels_capacity;
+    int* parents;                  // Union-find forest of the provisional labels.
+    component_stats* components;
+    int components_capacity;
+    int height;                    // Height of the image.
+} label_state;
+
+// Root of the set of label, halving the path on the way.
+static int findRoot(int* parents, int label) {
+    while (parents[label] != label) {
+        parents[label] = parents[parents[label]];
+        label = parents[label];
+    }
+    return label;
+}
+
+// Merge the sets of labels a and b. The smaller root becomes the root of both.
+static void unite(int* parents, int a, int b) {
+    a = findRoot(parents, a);
+    b = findRoot(parents, b);
+    if (a < b) {
+        parents[b] = a;
+    } else if (b < a) {
+        parents[a] = b;
+    }
+}
+
+// Label the connected components of the binary image (pixel (x, y) at binary[x * stride + y]) and
+// add up their area, centroid and bounding box, for recordCell. Returns the number of components.
+int labelComponents(cells_session* session, unsigned char* binary, int width, int height, int stride) {
+    if (session->labels == NULL) {
+        session->labels = (label_state*) calloc(1, sizeof(label_state));
+    }
+    label_state* state = session->labels;
+    size_t size = (size_t) width * height;
+    if (size > state->labels_capacity) {
+        free(state->labels);
+        state->labels = (int*) malloc(size * sizeof(int));
+        state->labels_capacity = size;
+    }
+    state->height = height;
+    int* labels = state->labels;
+    int* parents = state->parents;
+    component_stats* components = state->components;
+
+    int next = 1;
+    for (int x = 0; x < width; x++) {
+        unsigned char* column = binary + (size_t) x * stride;
+        int* current = labels + (size_t) x * height;
+        int* previous = x > 0 ? current - height : current;
+        for (int y = 0; y < height; y++) {
+            if (!column[y]) {
+                current[y] = 0;
+                continue;
+            }
+            // Neighbours already labelled: (x - 1, y - 1 .. y + 1) and (x, y - 1).
+            int up = x > 0 && y > 0 ? previous[y - 1] : 0;
+            int left = x > 0 ? previous[y] : 0;
+            int down = x > 0 && y + 1 < height ? previous[y + 1] : 0;
+            int before = y > 0 ? current[y - 1] : 0;
+            int label;
+            if (left) {
+                label = left;
+            } else if (down) {
+                label = down;
+                if (up) {
+                    unite(parents, down, up);
+                } else if (before) {
+                    unite(parents, down, before);
+                }
+            } else if (up) {
+                label = up;
+            } else if (before) {
+                label = before;
+            } else {
+                if (next >= state->components_capacity) {
+                    state->components_capacity = state->components_capacity ? state->components_capacity * 2 : 1024;
+                    parents = state->parents = (int*) realloc(parents, state->components_capacity * sizeof(int));
+                    components = state->components = (component_stats*) realloc(components, state->components_capacity * sizeof(component_stats));
+                }
+                label = next++;
+                parents[label] = label;
+                component_stats* c = &components[label];
+                c->area = 0;
+                c->sum_x = 0;
+                c->sum_y = 0;
+                c->x_min = x;
+                c->y_min = y;
+                c->x_max = x;
+                c->y_max = y;
+            }
+            current[y] = label;
+
+            // Labels are only merged later, so the pixel is added to its provisional label.
+            component_stats* c = &components[label];
+            c->area++;
+            c->sum_x += x;
+            c->sum_y += y;
+            if (x > c->x_max) c->x_max = x;
+            if (y < c->y_min) c->y_min = y;
+            if (y > c->y_max) c->y_max = y;
+        }
+    }
+
+    // Parents are always smaller labels, so in increasing order every parent is a root already.
+    int count = 0;
+    for (int label = 1; label < next; label++) {
+        if (parents[label] == label) {
+            components[label].id = ++count;
+            continue;
+        }
+        int root = parents[parents[label]];
+        parents[label] = root;
+        component_stats* c = &components[label];
+        component_stats* r = &components[root];
+        r->area += c->area;
+        r->sum_x += c->sum_x;
+        r->sum_y += c->sum_y;
+        if (c->x_min < r->x_min) r->x_min = c->x_min;
+        if (c->y_min < r->y_min) r->y_min = c->y_min;
+        if (c->x_max > r->x_max) r->x_max = c->x_max;
+        if (c->y_max > r->y_max) r->y_max = c->y_max;
+    }
+    return count;
+}
+
+// Append the cell detected with its capturing area at (x, y) to session->cell_records, if it is
+// not NULL. area holds what is left of the capturing area, pixel (x + dx, y + dy) at
+// area[dx * stride + dy], white if not 0; the components of its white pixels are looked up in the
+// last labelComponents of the session.
+void recordCell(cells_session* session, int x, int y, unsigned char* area, int stride) {
+    cell_table* cell_records = session->cell_records;
+    if (cell_records == NULL) {
+        return;
+    }
+    label_state* state = session->labels;
+    if (cell_records->size == cell_records->capacity) {
+        cell_records->capacity = cell_records->capacity ? cell_records->capacity * 2 : 256;
+        cell_records->items = (cell_record*) realloc(cell_records->items, cell_records->capacity * sizeof(cell_record));
+    }
+    cell_record* cell = &cell_records->items[cell_records->size++];
+    cell->x = x;
+    cell->y = y;
+    cell->step = session->cell_records_step;
+    cell->component = 0;
+    cell->area = 0;
+    cell->sum_x = 0;
+    cell->sum_y = 0;
+
+    // Roots already added to the cell. A capturing area rarely holds more than a few components.
+    int roots[testsize * testsize];
+    int root_count = 0;
+    int largest = 0;
+    for (int dx = 0; dx < testsize; dx++) {
+        for (int dy = 0; dy < testsize; dy++) {
+            if (!area[dx * stride + dy]) {
+                continue;
+            }
+            int root = state->parents[state->labels[(size_t) (x + dx) * state->height + y + dy]];
+            int seen = 0;
+            for (int i = 0; i < root_count && !seen; i++) {
+                seen = roots[i] == root;
+            }
+            if (seen) {
+                continue;
+            }
+            roots[root_count++] = root;
+            component_stats* c = &state->components[root];
+            if (cell->area == 0) {
+                cell->x_min = c->x_min;
+                cell->y_min = c->y_min;
+                cell->x_max = c->x_max;
+                cell->y_max = c->y_max;
+            }
+            if (c->area > largest) {
+                largest = c->area;
+                cell->component = c->id;
+            }
+            cell->area += c->area;
+            cell->sum_x += c->sum_x;
+            cell->sum_y += c->sum_y;
+            if (c->x_min < cell->x_min) cell->x_min = c->x_min;
+            if (c->y_min < cell->y_min) cell->y_min = c->y_min;
+            if (c->x_max > cell->x_max) cell->x_max = c->x_max;
+            if (c->y_max > cell->y_max) cell->y_max = c->y_max;
+        }
+    }
+}
+
+// Write the cells of the table to path as CSV, one line per cell in order of detection.
+// Returns 0 if the file cannot be written.
+int writeCellTable(cell_table* table, char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return 0;
+    }
+    fprintf(file, "id,x,y,step,component,area,centroid_x,centroid_y,x_min,y_min,x_max,y_max\n");
+    for (int i = 0; i < table->size; i++) {
+        cell_record* cell = &table->items[i];
+        fprintf(file, "%d,%d,%d,%d,%d,%d,%.2f,%.2f,%d,%d,%d,%d\n", i + 1, cell->x, cell->y, cell->step,
+                cell->component, cell->area, (double) cell->sum_x / cell->area, (double) cell->sum_y / cell->area,
+                cell->x_min, cell->y_min, cell->x_max, cell->y_max);
+    }
+    fclose(file);
+    return 1;
+}
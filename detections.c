@@ -0,0 +1,78 @@
+// The detections of a run, and duplicate suppression (--min-separation R).
+//
+// Every detection is appended to the list session->detections, in the order it was made, and printed or
+// drawn from there once the run is done. The list is also a spatial hash: the picture is cut into
+// squares of DETECTION_GRID pixels, each square is hashed to one of DETECTION_SLOTS chains, and every
+// detection is linked into the chain of its square. Finding the detections near a point only walks
+// the chains of the squares around it, so the cost of a query does not grow with the number of
+// detections or the size of the picture.
+//
+// With a minimum separation R > 0, a window that fires closer than R pixels to an earlier detection
+// of the run (window corner to window corner), from this erosion pass or an earlier one, is taken
+// as the same cell found again: its capturing area is still cleared, but it is not counted, drawn
+// or recorded. R = 0, the default, keeps every detection.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "cells.h"
+
+// Side of the squares of the spatial hash, in pixels (there are DETECTION_SLOTS chains).
+#define DETECTION_GRID 16
+
+int detection_min_separation = 0;
+
+// Chain of the square (gx, gy) of the grid.
+static int detectionSlot(int gx, int gy) {
+    return (int) (((unsigned int) gx * 73856093u ^ (unsigned int) gy * 19349663u) & (DETECTION_SLOTS - 1));
+}
+
+// Forget the detections, at the start of a run.
+void detectionsReset(cells_session* session) {
+    session->detections.size = 0;
+    memset(session->detection_heads, -1, sizeof(session->detection_heads));
+}
+
+// True if a detection at (x, y) is not closer than detection_min_separation to an earlier one.
+int detectionIsNew(cells_session* session, int x, int y) {
+    int r = detection_min_separation;
+    if (r <= 0) {
+        return 1;
+    }
+    detection_list* detections = &session->detections;
+    for (int gx = (x - r) / DETECTION_GRID; gx <= (x + r) / DETECTION_GRID; gx++) {
+        for (int gy = (y - r) / DETECTION_GRID; gy <= (y + r) / DETECTION_GRID; gy++) {
+            // Other squares can share the chain, so every detection is checked by its distance.
+            for (int i = session->detection_heads[detectionSlot(gx, gy)]; i >= 0; i = detections->items[i].next) {
+                int dx = detections->items[i].x - x;
+                int dy = detections->items[i].y - y;
+                if (dx * dx + dy * dy < r * r) {
+                    return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+// Append the detection at (x, y) to session->detections.
+void detectionAdd(cells_session* session, int x, int y) {
+    detection_list* detections = &session->detections;
+    if (detections->size == detections->capacity) {
+        detections->capacity = detections->capacity ? detections->capacity * 2 : 256;
+        detections->items = (detection*) realloc(detections->items, detections->capacity * sizeof(detection));
+    }
+    int slot = detectionSlot(x / DETECTION_GRID, y / DETECTION_GRID);
+    detection* d = &detections->items[detections->size];
+    d->x = x;
+    d->y = y;
+    d->next = session->detection_heads[slot];
+    session->detection_heads[slot] = detections->size++;
+}
+
+// Print the detections of the run, in order.
+void printDetections(cells_session* session) {
+    for (int i = 0; i < session->detections.size; i++) {
+        printf("Cell detected at position (%d, %d)\n", session->detections.items[i].x, session->detections.items[i].y);
+    }
+}
@@ -0,0 +1,369 @@
+// Distance transform engine for erodeAndDetect (ENGINE_DISTANCE).
+//
+// Instead of eroding the image pass by pass, the erosion step at which every pixel turns black is
+// computed once, with two raster passes. Pixel p is white after erosion n exactly when
+// level[p] > n, where level is 0 for black pixels, 1 for white border pixels (closer to the border
+// than the radius of the element), and otherwise
+// 1 + the minimum level of the pixels covered by the structuring element around p.
+//
+// From the levels, every detection window gets the step at which its exclusion frame turns black.
+// That is the only step at which it can fire, since its capturing area only loses white pixels
+// afterwards. Windows are then visited step by step, in the same order as detect. A detection
+// clears its capturing area, which lowers the levels around it; those are updated locally and the
+// nearby windows are rescheduled. The result is the same as the iterative engines.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "cells.h"
+
+// State of the engine for one session (session->distance).
+typedef struct distance_state_data
+{
+    unsigned short levels[BMP_WIDTH][BMP_HEIGTH];
+    int schedule[BMP_WIDTH][BMP_HEIGTH];
+    int level_count[BMP_WIDTH + BMP_HEIGTH];
+    window_list buckets[MAX_EROSIONS + 1];
+    window_list late_windows;
+    int changed[BMP_WIDTH * BMP_HEIGTH];
+
+    // Sliding maxima of the levels, used to schedule all windows at once.
+    unsigned short max_y12[BMP_WIDTH][BMP_HEIGTH];   // max of levels[x][y .. y + 11]
+    unsigned short max_y14[BMP_WIDTH][BMP_HEIGTH];   // max of levels[x][y .. y + 13]
+    unsigned short max_x12[BMP_WIDTH][BMP_HEIGTH];   // max of levels[x .. x + 11][y]
+    unsigned short max_area[BMP_WIDTH][BMP_HEIGTH];  // max of levels[x .. x + 11][y .. y + 11]
+
+    unsigned char snapshot[BMP_WIDTH][BMP_HEIGTH];   // Binary image rebuilt for a snapshot.
+} distance_state;
+
+// out[i * stride] = max(in[i * stride], ..., in[(i + k - 1) * stride]) for 0 <= i <= n - k, using the
+// van Herk/Gil-Werman algorithm: three comparisons per element whatever the window size k.
+void slidingMax(unsigned short* in, unsigned short* out, int n, int stride, int k) {
+    unsigned short prefix[BMP_WIDTH + BMP_HEIGTH];
+    unsigned short suffix[BMP_WIDTH + BMP_HEIGTH];
+    for (int i = 0; i < n; i++) {
+        unsigned short value = in[i * stride];
+        prefix[i] = (i % k == 0 || prefix[i - 1] < value) ? value : prefix[i - 1];
+    }
+    for (int i = n - 1; i >= 0; i--) {
+        unsigned short value = in[i * stride];
+        suffix[i] = (i == n - 1 || (i + 1) % k == 0 || suffix[i + 1] < value) ? value : suffix[i + 1];
+    }
+    for (int i = 0; i + k <= n; i++) {
+        out[i * stride] = suffix[i] > prefix[i + k - 1] ? suffix[i] : prefix[i + k - 1];
+    }
+}
+
+// Compute the erosion level of every pixel with two raster passes. The first pass takes the
+// structuring element entries that come earlier in scan order, the second pass (in reverse) the
+// ones that come later; together they cover every way of reaching a black pixel.
+void computeLevels(distance_state* d, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH]) {
+    unsigned short (*levels)[BMP_HEIGTH] = d->levels;
+    structuring_element* se = erosion_element;
+    int r = se->radius;
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        for (int y = 0; y < BMP_HEIGTH; y++) {
+            int border = x < r || y < r || x >= BMP_WIDTH - r || y >= BMP_HEIGTH - r;
+            if (!binary_image[x][y]) {
+                levels[x][y] = 0;
+            } else if (border) {
+                levels[x][y] = 1;
+            } else {
+                int level = 0xFFFF;
+                for (int k = 0; k < se->count; k++) {
+                    if (se->dx[k] < 0 || (se->dx[k] == 0 && se->dy[k] < 0)) {
+                        if (levels[x + se->dx[k]][y + se->dy[k]] + 1 < level) {
+                            level = levels[x + se->dx[k]][y + se->dy[k]] + 1;
+                        }
+                    }
+                }
+                levels[x][y] = level;
+            }
+        }
+    }
+    for (int x = BMP_WIDTH - 1 - r; x >= r; x--) {
+        for (int y = BMP_HEIGTH - 1 - r; y >= r; y--) {
+            for (int k = 0; k < se->count; k++) {
+                if (se->dx[k] > 0 || (se->dx[k] == 0 && se->dy[k] > 0)) {
+                    if (levels[x + se->dx[k]][y + se->dy[k]] + 1 < levels[x][y]) {
+                        levels[x][y] = levels[x + se->dx[k]][y + se->dy[k]] + 1;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Highest level in the exclusion frame of the window at (x, y), i.e. the step at which the frame is black.
+int frameLevel(distance_state* d, int x, int y) {
+    unsigned short (*levels)[BMP_HEIGTH] = d->levels;
+    int level = 0;
+    for (int dy = -1; dy <= testsize; dy++) {
+        if (levels[x - 1][y + dy] > level) level = levels[x - 1][y + dy];
+        if (levels[x + testsize][y + dy] > level) level = levels[x + testsize][y + dy];
+    }
+    for (int dx = 0; dx < testsize; dx++) {
+        if (levels[x + dx][y - 1] > level) level = levels[x + dx][y - 1];
+        if (levels[x + dx][y + testsize] > level) level = levels[x + dx][y + testsize];
+    }
+    return level;
+}
+
+// Highest level in the capturing area of the window at (x, y): it holds a white pixel after erosion n while n < this.
+int captureLevel(distance_state* d, int x, int y) {
+    unsigned short (*levels)[BMP_HEIGTH] = d->levels;
+    int level = 0;
+    for (int dx = 0; dx < testsize; dx++) {
+        for (int dy = 0; dy < testsize; dy++) {
+            if (levels[x + dx][y + dy] > level) level = levels[x + dx][y + dy];
+        }
+    }
+    return level;
+}
+
+// The step at which the window at (x, y) fires, or 0 if it never does. Windows before the one
+// being processed at step `step` (index <= current) can fire at step + 1 at the earliest.
+int windowStep(distance_state* d, int x, int y, int step, int current) {
+    int fire = frameLevel(d, x, y);
+    int earliest = x * BMP_HEIGTH + y <= current ? step + 1 : step;
+    if (fire < earliest) fire = earliest;
+    if (fire > MAX_EROSIONS || captureLevel(d, x, y) <= fire) {
+        return 0;
+    }
+    return fire;
+}
+
+// Set the level of interior pixel (x, y) to level, keeping level_count up to date.
+void setLevel(distance_state* d, int x, int y, int level) {
+    d->level_count[d->levels[x][y]]--;
+    d->levels[x][y] = level;
+    d->level_count[level]++;
+}
+
+// Clear the capturing area at (x0, y0) after erosion `step`, update the levels it affects, and
+// reschedule the windows around it. `current` is the index of the window that fired.
+void distanceClear(distance_state* d, int x0, int y0, int step, int current) {
+    unsigned short (*levels)[BMP_HEIGTH] = d->levels;
+    int* changed = d->changed;
+    structuring_element* se = erosion_element;
+    int r = se->radius;
+    int head = 0;
+    int tail = 0;
+    int min_x = x0, max_x = x0 + testsize - 1;
+    int min_y = y0, max_y = y0 + testsize - 1;
+    for (int x = x0; x < x0 + testsize; x++) {
+        for (int y = y0; y < y0 + testsize; y++) {
+            if (levels[x][y] > step) {
+                setLevel(d, x, y, step);
+                changed[tail++] = x * BMP_HEIGTH + y;
+            }
+        }
+    }
+    // Breadth-first: a pixel whose structuring element covers a lowered pixel is at most one level higher.
+    while (head < tail) {
+        int x = changed[head] / BMP_HEIGTH;
+        int y = changed[head] % BMP_HEIGTH;
+        int level = levels[x][y] + 1;
+        head++;
+        for (int k = 0; k < se->count; k++) {
+            int nx = x - se->dx[k];
+            int ny = y - se->dy[k];
+            if ((se->dx[k] == 0 && se->dy[k] == 0)
+                || nx < r || ny < r || nx >= BMP_WIDTH - r || ny >= BMP_HEIGTH - r
+                || levels[nx][ny] <= level) {
+                continue;
+            }
+            setLevel(d, nx, ny, level);
+            changed[tail++] = nx * BMP_HEIGTH + ny;
+            if (nx < min_x) min_x = nx;
+            if (nx > max_x) max_x = nx;
+            if (ny < min_y) min_y = ny;
+            if (ny > max_y) max_y = ny;
+        }
+    }
+
+    // Reschedule every window whose capturing area or exclusion frame overlaps a changed pixel.
+    for (int x = min_x - testsize; x <= max_x + 1; x++) {
+        for (int y = min_y - testsize; y <= max_y + 1; y++) {
+            if (x < 1 || y < 1 || x >= BMP_WIDTH - testsize - 1 || y >= BMP_HEIGTH - testsize - 1) {
+                continue;
+            }
+            int fire = windowStep(d, x, y, step, current);
+            if (fire == d->schedule[x][y]) {
+                continue;
+            }
+            d->schedule[x][y] = fire;
+            if (fire == step) {
+                windowHeapPush(&d->late_windows, x * BMP_HEIGTH + y);
+            } else if (fire > 0) {
+                windowListPush(&d->buckets[fire], x * BMP_HEIGTH + y);
+            }
+        }
+    }
+}
+
+// Save the binary image after erosion `step` as a snapshot, rebuilt from the levels.
+void saveDistanceStepImage(distance_state* d, int step) {
+    unsigned char (*binary_image)[BMP_HEIGTH] = d->snapshot;
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        for (int y = 0; y < BMP_HEIGTH; y++) {
+            binary_image[x][y] = d->levels[x][y] > step;
+        }
+    }
+    saveErosionStepImage(binary_image, step);
+}
+
+// The ENGINE_DISTANCE version of erodeAndDetect.
+int distanceErodeAndDetect(cells_session* session, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], int* iterations) {
+    if (session->distance == NULL) {
+        session->distance = (distance_state*) sessionAlloc(session, sizeof(distance_state));
+    }
+    distance_state* d = session->distance;
+    unsigned short (*levels)[BMP_HEIGTH] = d->levels;
+    int (*schedule)[BMP_HEIGTH] = d->schedule;
+    int* level_count = d->level_count;
+    window_list* buckets = d->buckets;
+    window_list* late_windows = &d->late_windows;
+
+    // Computing the levels is the erosion of this engine, scheduling the windows part of detection.
+    profile_mark mark = profileStart();
+    computeLevels(d, binary_image);
+
+    memset(level_count, 0, sizeof(d->level_count));
+    for (int x = 1; x < BMP_WIDTH - 1; x++) {
+        for (int y = 1; y < BMP_HEIGTH - 1; y++) {
+            level_count[levels[x][y]]++;
+        }
+    }
+    profileStop(PROFILE_ERODE, mark);
+    mark = profileStart();
+    int white_pixels = countWhitePixels(binary_image);
+    profileStop(PROFILE_COUNT, mark);
+    profileInitialWhite(session, white_pixels);
+    if (cells_verbose) {
+        printf("Initial white pixels after binary conversion: %d\n", white_pixels);
+    }
+
+    // Schedule every window, in scan order, at the step its exclusion frame turns black.
+    for (int step = 0; step <= MAX_EROSIONS; step++) {
+        buckets[step].size = 0;
+        buckets[step].sorted = 1;
+    }
+    late_windows->size = 0;
+    mark = profileStart();
+    unsigned short (*max_y12)[BMP_HEIGTH] = d->max_y12;
+    unsigned short (*max_y14)[BMP_HEIGTH] = d->max_y14;
+    unsigned short (*max_x12)[BMP_HEIGTH] = d->max_x12;
+    unsigned short (*max_area)[BMP_HEIGTH] = d->max_area;
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        slidingMax(levels[x], max_y12[x], BMP_HEIGTH, 1, testsize);
+        slidingMax(levels[x], max_y14[x], BMP_HEIGTH, 1, testsize + 2);
+    }
+    for (int y = 0; y < BMP_HEIGTH; y++) {
+        slidingMax(&levels[0][y], &max_x12[0][y], BMP_WIDTH, BMP_HEIGTH, testsize);
+        slidingMax(&max_y12[0][y], &max_area[0][y], BMP_WIDTH, BMP_HEIGTH, testsize);
+    }
+    for (int x = 1; x < BMP_WIDTH - testsize - 1; x++) {
+        for (int y = 1; y < BMP_HEIGTH - testsize - 1; y++) {
+            // Same as windowStep(x, y, 1, -1), with the frame and capturing area maxima looked up.
+            int fire = max_y14[x - 1][y - 1];
+            if (max_y14[x + testsize][y - 1] > fire) fire = max_y14[x + testsize][y - 1];
+            if (max_x12[x][y - 1] > fire) fire = max_x12[x][y - 1];
+            if (max_x12[x][y + testsize] > fire) fire = max_x12[x][y + testsize];
+            if (fire < 1) fire = 1;
+            schedule[x][y] = fire <= MAX_EROSIONS && max_area[x][y] > fire ? fire : 0;
+            if (schedule[x][y] > 0) {
+                windowListPush(&buckets[schedule[x][y]], x * BMP_HEIGTH + y);
+            }
+        }
+    }
+
+    profileStop(PROFILE_DETECT, mark);
+
+    int erosion_iterations = 0;
+    int total_cells = 0;
+    char wasEroded;
+    do {
+        erosion_iterations++;
+        int step = erosion_iterations;
+
+        // Pixels eroded by this pass are the interior ones at this level; the rest are still white.
+        wasEroded = level_count[step] > 0;
+        white_pixels = 0;
+        for (int level = step + 1; level < BMP_WIDTH + BMP_HEIGTH; level++) {
+            white_pixels += level_count[level];
+        }
+
+        if (SNAPSHOT_DUE(step)) {
+            mark = profileStart();
+            saveDistanceStepImage(d, step);
+            profileStop(PROFILE_SNAPSHOT, mark);
+        }
+        if (cells_verbose) {
+            printf("After erosion %d: %d white pixels remaining, wasEroded=%d\n",
+                   erosion_iterations, white_pixels, wasEroded);
+        }
+        if (white_pixels == 0 || erosion_iterations > MAX_EROSIONS) {
+            profilePass(session, white_pixels, 0);
+            break;
+        }
+        mark = profileStart();
+        int cells = 0;
+
+        // Visit the windows scheduled at this step in scan order, merged with the ones rescheduled while doing so.
+        window_list* bucket = &buckets[step];
+        if (!bucket->sorted) {
+            qsort(bucket->items, bucket->size, sizeof(int), compareWindows);
+        }
+        int next = 0;
+        while (next < bucket->size || late_windows->size > 0) {
+            int window;
+            if (late_windows->size > 0 && (next == bucket->size || late_windows->items[0] < bucket->items[next])) {
+                window = windowHeapPop(late_windows);
+            } else {
+                window = bucket->items[next++];
+            }
+            int x = window / BMP_HEIGTH;
+            int y = window % BMP_HEIGTH;
+            if (schedule[x][y] != step) {
+                continue;
+            }
+            schedule[x][y] = 0;
+            if (profile_enabled) {
+                session->windows_tested++;
+            }
+            if (frameLevel(d, x, y) <= step && captureLevel(d, x, y) > step) {
+                if (detectionIsNew(session, x, y)) {
+                    cells++;
+                    drawCell(session, bmp_image, x, y);
+                    if (session->cell_records != NULL) {
+                        // The capturing area as the binary image would have it now.
+                        unsigned char area[testsize][testsize];
+                        for (int dx = 0; dx < testsize; dx++) {
+                            for (int dy = 0; dy < testsize; dy++) {
+                                area[dx][dy] = levels[x + dx][y + dy] > step;
+                            }
+                        }
+                        session->cell_records_step = step;
+                        recordCell(session, x, y, &area[0][0], testsize);
+                    }
+                }
+                if (profile_enabled) {
+                    for (int dx = 0; dx < testsize; dx++) {
+                        for (int dy = 0; dy < testsize; dy++) {
+                            session->pixels_cleared += levels[x + dx][y + dy] > step;
+                        }
+                    }
+                }
+                distanceClear(d, x, y, step, window);
+            }
+        }
+        bucket->size = 0;
+        profileStop(PROFILE_DETECT, mark);
+        profilePass(session, white_pixels, cells);
+        total_cells += cells;
+    } while (wasEroded);
+
+    *iterations = erosion_iterations;
+    return total_cells;
+}
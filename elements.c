@@ -0,0 +1,435 @@
+// Structuring elements for erosion (--element).
+//
+// Every element of the registry is listed once as its entries, (dx, dy) meaning the pixel
+// (x + dx, y + dy) must be white for pixel (x, y) to stay white. The lists are X-macros: the same
+// list gives the entries of the registry, used by the frontier and distance engines, and an
+// unrolled erosion kernel for the full engine, which ANDs exactly those pixels with no loop and no
+// test per entry. Other masks can be given on the command line as rows of 0 and 1; they are
+// eroded by erodeBandGeneric, which loops over the entries.
+//
+// Large elements are decomposed: erosion by the combination (Minkowski sum) of two elements is
+// erosion by one, then by the other. rect:WxH erodes by a line of H pixels along y, then by a line
+// of W pixels along x. The line along x uses the van Herk/Gil-Werman running minimum, which takes
+// three ANDs per pixel whatever the length of the line; the line along y takes log2(H) ANDs of 8
+// pixels at a time (see erodeColumnStep). diamond:R erodes R times by the plus, and disk:R
+// alternates the plus and the square R times, which gives an octagon (disk:2 is disk5). Every
+// step only has to make the pixels at least its own radius away from the border right, since
+// the later steps only read those; the border of the whole element is then set to black. The
+// entries of the combination are kept too, for the other engines and to check the steps against.
+//
+// Pixels closer to the image border than the radius of the element are always black, like the
+// border pixels with the 3x3 elements.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "cells.h"
+
+// The entries of the registry elements, drawn with y going down. X marks the pixel itself.
+
+// ###        The element the assignment started with. It is the default.
+// #X#
+// .#.
+#define SE_DEFAULT(E) E(-1, -1) E(0, -1) E(1, -1) E(-1, 0) E(0, 0) E(1, 0) E(0, 1)
+
+// ###        Full 3x3 square.
+// #X#
+// ###
+#define SE_SQUARE(E) E(-1, -1) E(0, -1) E(1, -1) E(-1, 0) E(0, 0) E(1, 0) E(-1, 1) E(0, 1) E(1, 1)
+
+// .#.        Plus: the 4-neighbours.
+// #X#
+// .#.
+#define SE_PLUS(E) E(0, -1) E(-1, 0) E(0, 0) E(1, 0) E(0, 1)
+
+// .###.      5x5 disk: the square without its corners.
+// #####
+// ##X##
+// #####
+// .###.
+#define SE_DISK5(E) E(-1, -2) E(0, -2) E(1, -2) \
+    E(-2, -1) E(-1, -1) E(0, -1) E(1, -1) E(2, -1) \
+    E(-2, 0) E(-1, 0) E(0, 0) E(1, 0) E(2, 0) \
+    E(-2, 1) E(-1, 1) E(0, 1) E(1, 1) E(2, 1) \
+    E(-1, 2) E(0, 2) E(1, 2)
+
+// 8 pixels of a column from p on, as one word. Pixels are 0 or 1, so ANDing two words ANDs the pixels.
+static inline uint64_t loadPixels(unsigned char* p) {
+    uint64_t pixels;
+    memcpy(&pixels, p, sizeof(pixels));
+    return pixels;
+}
+
+// Expansions of an entry list: the dx values, the dy values, a count, and the tests of the kernel
+// for 8 pixels at once and for one pixel.
+#define SE_DX(dx, dy) dx,
+#define SE_DY(dx, dy) dy,
+#define SE_ONE(dx, dy) + 1
+#define SE_AND_WORD(dx, dy) & loadPixels(&src[x + (dx)][y + (dy)])
+#define SE_AND(dx, dy) & src[x + (dx)][y + (dy)]
+
+// Define the erosion kernel `name` for the entry list `entries` of the given radius: the same as
+// erodeBandGeneric, with the entries unrolled and 8 pixels of a column eroded at a time.
+#define SE_KERNEL(name, radius, entries) \
+    static char name(unsigned char src[BMP_WIDTH][BMP_HEIGTH], unsigned char dst[BMP_WIDTH][BMP_HEIGTH], int x_begin, int x_end) { \
+        uint64_t eroded = 0; \
+        for (int x = x_begin; x < x_end; x++) { \
+            int y = (radius); \
+            for (; y + 8 <= BMP_HEIGTH - (radius); y += 8) { \
+                uint64_t result = ~(uint64_t) 0 entries(SE_AND_WORD); \
+                eroded |= loadPixels(&src[x][y]) ^ result; \
+                memcpy(&dst[x][y], &result, sizeof(result)); \
+            } \
+            for (; y < BMP_HEIGTH - (radius); y++) { \
+                unsigned char result = 1 entries(SE_AND); \
+                eroded |= src[x][y] ^ result; \
+                dst[x][y] = result; \
+            } \
+            for (y = 0; y < (radius); y++) { \
+                dst[x][y] = 0; \
+                dst[x][BMP_HEIGTH - 1 - y] = 0; \
+            } \
+        } \
+        return eroded != 0; \
+    }
+
+// Registry entry for the entry list `entries`, eroded by `kernel`.
+#define SE_ENTRY(name, radius, entries, kernel) \
+    { name, radius, 0 entries(SE_ONE), { entries(SE_DX) }, { entries(SE_DY) }, kernel, 0, {{0}} }
+
+SE_KERNEL(erodeBandDefault, 1, SE_DEFAULT)
+SE_KERNEL(erodeBandSquare, 1, SE_SQUARE)
+SE_KERNEL(erodeBandPlus, 1, SE_PLUS)
+SE_KERNEL(erodeBandDisk5, 2, SE_DISK5)
+
+// Indices of the small elements in the registry, for the steps of decomposed elements.
+#define SE_INDEX_SQUARE 1
+#define SE_INDEX_PLUS 2
+
+structuring_element structuring_elements[] = {
+    SE_ENTRY("default", 1, SE_DEFAULT, erodeBandDefault),
+    SE_ENTRY("square", 1, SE_SQUARE, erodeBandSquare),
+    SE_ENTRY("plus", 1, SE_PLUS, erodeBandPlus),
+    SE_ENTRY("disk5", 2, SE_DISK5, erodeBandDisk5),
+};
+int structuring_element_count = sizeof(structuring_elements) / sizeof(structuring_elements[0]);
+
+// The element used by erosion. Set it with selectStructuringElement.
+structuring_element* erosion_element = &structuring_elements[0];
+
+// Element given on the command line as a mask.
+static structuring_element user_element;
+
+// Apply the erosion algorithm with any element to the band of src with x_begin <= x < x_end, as
+// erodeBand does: a white pixel stays white only if every entry of the element covers a white pixel.
+char erodeBandGeneric(unsigned char src[BMP_WIDTH][BMP_HEIGTH], unsigned char dst[BMP_WIDTH][BMP_HEIGTH], int x_begin, int x_end) {
+    structuring_element* se = erosion_element;
+    int radius = se->radius;
+    int count = se->count;
+
+    // The entries as offsets in the image, so the loop below does not go back to se.
+    int offsets[SE_MAX_SIZE * SE_MAX_SIZE];
+    for (int k = 0; k < count; k++) {
+        offsets[k] = se->dx[k] * BMP_HEIGTH + se->dy[k];
+    }
+    char wasEroded = 0;
+    for (int x = x_begin; x < x_end; x++) {
+        for (int y = radius; y < BMP_HEIGTH - radius; y++) {
+            unsigned char* pixel = &src[x][y];
+            int erosion_result = *pixel;
+            for (int k = 0; k < count && erosion_result; k++) {
+                if (pixel[offsets[k]] == 0) {
+                    erosion_result = 0;
+                    wasEroded = 1;
+                }
+            }
+            dst[x][y] = erosion_result;
+        }
+        for (int y = 0; y < radius; y++) {
+            dst[x][y] = 0;
+            dst[x][BMP_HEIGTH - 1 - y] = 0;
+        }
+    }
+    return wasEroded;
+}
+
+// Parse a mask given as rows of 0 and 1 separated by commas, from the top row down, e.g.
+// "010,111,010" for the plus. The mask must be square with an odd size of at most SE_MAX_SIZE;
+// its centre is the pixel itself and is always part of the element. Returns 0 if it is not valid.
+static int parseStructuringElement(char* rows, structuring_element* se) {
+    int size = (int) strcspn(rows, ",");
+    if (size % 2 == 0 || size > SE_MAX_SIZE || (int) strlen(rows) != size * (size + 1) - 1) {
+        return 0;
+    }
+    int centre = size / 2;
+    se->name = rows;
+    se->radius = 0;
+    se->count = 0;
+    for (int dy = -centre; dy <= centre; dy++) {
+        char* row = rows + (dy + centre) * (size + 1);
+        if (dy < centre && row[size] != ',') {
+            return 0;
+        }
+        for (int dx = -centre; dx <= centre; dx++) {
+            char c = row[dx + centre];
+            if (c != '0' && c != '1') {
+                return 0;
+            }
+            if (c == '1' || (dx == 0 && dy == 0)) {
+                se->dx[se->count] = dx;
+                se->dy[se->count] = dy;
+                se->count++;
+                if (abs(dx) > se->radius) se->radius = abs(dx);
+                if (abs(dy) > se->radius) se->radius = abs(dy);
+            }
+        }
+    }
+    // A single pixel never erodes anything, but the border must still turn black.
+    if (se->radius == 0) {
+        se->radius = 1;
+    }
+    se->kernel = erodeBandGeneric;
+    se->step_count = 0;
+    return 1;
+}
+
+// Scratch images of erodeSteps (session->steps): the images between the steps, and the running
+// ANDs of row steps.
+typedef struct step_state_data
+{
+    unsigned char images[2][BMP_WIDTH][BMP_HEIGTH];
+    unsigned char prefix[BMP_WIDTH][BMP_HEIGTH];
+    unsigned char suffix[BMP_WIDTH][BMP_HEIGTH];
+} step_state;
+
+// out = a & b for one column, 8 pixels at a time.
+static void andColumns(unsigned char* out, unsigned char* a, unsigned char* b) {
+    int y = 0;
+    for (; y + 8 <= BMP_HEIGTH; y += 8) {
+        uint64_t pixels = loadPixels(a + y) & loadPixels(b + y);
+        memcpy(out + y, &pixels, sizeof(pixels));
+    }
+    for (; y < BMP_HEIGTH; y++) {
+        out[y] = a[y] & b[y];
+    }
+}
+
+// Erode src by a line of `length` pixels along x into dst: column x of dst is the AND of columns
+// x - length / 2 .. x + length / 2 of src. In blocks of `length` columns, the prefix holds the AND
+// from the start of the block and the suffix the AND to its end, so every window is the suffix
+// of one block and the prefix of the next. Columns closer than length / 2 to the border are black.
+static void erodeRowStep(step_state* scratch, unsigned char src[BMP_WIDTH][BMP_HEIGTH], unsigned char dst[BMP_WIDTH][BMP_HEIGTH], int length) {
+    unsigned char (*step_prefix)[BMP_HEIGTH] = scratch->prefix;
+    unsigned char (*step_suffix)[BMP_HEIGTH] = scratch->suffix;
+    int half = length / 2;
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        if (x % length == 0) {
+            memcpy(step_prefix[x], src[x], BMP_HEIGTH);
+        } else {
+            andColumns(step_prefix[x], step_prefix[x - 1], src[x]);
+        }
+    }
+    for (int x = BMP_WIDTH - 1; x >= 0; x--) {
+        if (x == BMP_WIDTH - 1 || (x + 1) % length == 0) {
+            memcpy(step_suffix[x], src[x], BMP_HEIGTH);
+        } else {
+            andColumns(step_suffix[x], step_suffix[x + 1], src[x]);
+        }
+    }
+    for (int x = half; x < BMP_WIDTH - half; x++) {
+        andColumns(dst[x], step_suffix[x - half], step_prefix[x + half]);
+    }
+    for (int x = 0; x < half; x++) {
+        memset(dst[x], 0, BMP_HEIGTH);
+        memset(dst[BMP_WIDTH - 1 - x], 0, BMP_HEIGTH);
+    }
+}
+
+// Erode src by a line of `length` pixels along y into dst. The running ANDs of erodeRowStep would
+// go pixel by pixel here, since the pixels of a column are next to each other, so the column is
+// ANDed with itself shifted by 1, 2, 4, ... pixels instead, 8 pixels at a time: after the shift by
+// w, pixel y holds the AND of the 2w pixels from y on, and two of those cover the line. That is
+// log2(length) passes over the column. Rows closer than length / 2 to the border are black.
+static void erodeColumnStep(unsigned char src[BMP_WIDTH][BMP_HEIGTH], unsigned char dst[BMP_WIDTH][BMP_HEIGTH], int length) {
+    // Room for the 8-pixel loads and stores past the end of the column.
+    unsigned char runs_a[BMP_HEIGTH + 64];
+    unsigned char runs_b[BMP_HEIGTH + 64];
+    int half = length / 2;
+    for (int x = 0; x < BMP_WIDTH; x++) {
+        unsigned char* runs = runs_a;
+        unsigned char* next = runs_b;
+        memcpy(runs, src[x], BMP_HEIGTH);
+        int w = 1;
+        for (; 2 * w <= length; w *= 2) {
+            for (int y = 0; y + w < BMP_HEIGTH; y += 8) {
+                uint64_t pixels = loadPixels(runs + y) & loadPixels(runs + y + w);
+                memcpy(next + y, &pixels, sizeof(pixels));
+            }
+            unsigned char* swap = runs;
+            runs = next;
+            next = swap;
+        }
+        // runs[y] is now the AND of the w pixels from y on, for y <= BMP_HEIGTH - w.
+        int y = half;
+        for (; y + 8 <= BMP_HEIGTH - half; y += 8) {
+            uint64_t pixels = loadPixels(runs + y - half) & loadPixels(runs + y - half + length - w);
+            memcpy(&dst[x][y], &pixels, sizeof(pixels));
+        }
+        for (; y < BMP_HEIGTH - half; y++) {
+            dst[x][y] = runs[y - half] & runs[y - half + length - w];
+        }
+        memset(dst[x], 0, half);
+        memset(dst[x] + BMP_HEIGTH - half, 0, half);
+    }
+}
+
+// Erode src by the decomposed erosion_element into dst, one step after the other, and set its
+// border to black. Returns 1 if a white pixel away from the border was eroded, like erodeInto.
+char erodeSteps(cells_session* session, unsigned char src[BMP_WIDTH][BMP_HEIGTH], unsigned char dst[BMP_WIDTH][BMP_HEIGTH]) {
+    if (session->steps == NULL) {
+        session->steps = (step_state*) sessionAlloc(session, sizeof(step_state));
+    }
+    step_state* scratch = session->steps;
+    structuring_element* se = erosion_element;
+    unsigned char (*in)[BMP_HEIGTH] = src;
+    for (int s = 0; s < se->step_count; s++) {
+        unsigned char (*out)[BMP_HEIGTH] = s == se->step_count - 1 ? dst : scratch->images[s % 2];
+        se_step* step = &se->steps[s];
+        if (step->type == SE_STEP_ROW) {
+            erodeRowStep(scratch, in, out, step->size);
+        } else if (step->type == SE_STEP_COLUMN) {
+            erodeColumnStep(in, out, step->size);
+        } else {
+            structuring_element* small = &structuring_elements[step->size];
+            small->kernel(in, out, small->radius, BMP_WIDTH - small->radius);
+            for (int x = 0; x < small->radius; x++) {
+                memset(out[x], 0, BMP_HEIGTH);
+                memset(out[BMP_WIDTH - 1 - x], 0, BMP_HEIGTH);
+            }
+        }
+        in = out;
+    }
+
+    int r = se->radius;
+    for (int x = 0; x < r; x++) {
+        memset(dst[x], 0, BMP_HEIGTH);
+        memset(dst[BMP_WIDTH - 1 - x], 0, BMP_HEIGTH);
+    }
+    // dst is never whiter than src, so a pixel was eroded where src and dst differ.
+    uint64_t eroded = 0;
+    for (int x = r; x < BMP_WIDTH - r; x++) {
+        memset(dst[x], 0, r);
+        memset(dst[x] + BMP_HEIGTH - r, 0, r);
+        int y = r;
+        for (; y + 8 <= BMP_HEIGTH - r; y += 8) {
+            eroded |= loadPixels(&src[x][y]) ^ loadPixels(&dst[x][y]);
+        }
+        for (; y < BMP_HEIGTH - r; y++) {
+            eroded |= src[x][y] ^ dst[x][y];
+        }
+    }
+    return eroded != 0;
+}
+
+// Add a step to se. Returns 0 if there are too many.
+static int addStep(structuring_element* se, int type, int size) {
+    if (se->step_count == SE_MAX_STEPS) {
+        return 0;
+    }
+    se->steps[se->step_count].type = type;
+    se->steps[se->step_count].size = size;
+    se->step_count++;
+    return 1;
+}
+
+// Parse a decomposed element: rect:WxH (odd W and H), diamond:R or disk:R, and set its steps and
+// the entries of their combination. Returns 0 if spec is not one of them or is too large.
+static int parseDecomposedElement(char* spec, structuring_element* se) {
+    int width, height, radius;
+    char end;
+    se->step_count = 0;
+    if (sscanf(spec, "rect:%dx%d%c", &width, &height, &end) == 2) {
+        if (width < 1 || height < 1 || width % 2 == 0 || height % 2 == 0 || width > SE_MAX_SIZE || height > SE_MAX_SIZE) {
+            return 0;
+        }
+        if (height > 1) addStep(se, SE_STEP_COLUMN, height);
+        if (width > 1) addStep(se, SE_STEP_ROW, width);
+    } else if (sscanf(spec, "diamond:%d%c", &radius, &end) == 1 || sscanf(spec, "disk:%d%c", &radius, &end) == 1) {
+        if (radius < 1 || radius > SE_MAX_SIZE / 2 || radius > SE_MAX_STEPS) {
+            return 0;
+        }
+        int disk = strncmp(spec, "disk:", 5) == 0;
+        for (int i = 0; i < radius; i++) {
+            addStep(se, SE_STEP_ELEMENT, disk && i % 2 == 1 ? SE_INDEX_SQUARE : SE_INDEX_PLUS);
+        }
+    } else {
+        return 0;
+    }
+
+    // The entries of the combination: start with the pixel itself and add the entries of every step.
+    static unsigned char covered[SE_MAX_SIZE][SE_MAX_SIZE];
+    static unsigned char next[SE_MAX_SIZE][SE_MAX_SIZE];
+    int centre = SE_MAX_SIZE / 2;
+    memset(covered, 0, sizeof(covered));
+    covered[centre][centre] = 1;
+    for (int s = 0; s < se->step_count; s++) {
+        se_step* step = &se->steps[s];
+        memset(next, 0, sizeof(next));
+        for (int dy = 0; dy < SE_MAX_SIZE; dy++) {
+            for (int dx = 0; dx < SE_MAX_SIZE; dx++) {
+                if (!covered[dy][dx]) {
+                    continue;
+                }
+                if (step->type == SE_STEP_ELEMENT) {
+                    structuring_element* small = &structuring_elements[step->size];
+                    for (int k = 0; k < small->count; k++) {
+                        next[dy + small->dy[k]][dx + small->dx[k]] = 1;
+                    }
+                } else {
+                    for (int d = -(step->size / 2); d <= step->size / 2; d++) {
+                        if (step->type == SE_STEP_ROW) {
+                            next[dy][dx + d] = 1;
+                        } else {
+                            next[dy + d][dx] = 1;
+                        }
+                    }
+                }
+            }
+        }
+        memcpy(covered, next, sizeof(covered));
+    }
+    se->name = spec;
+    se->radius = 1;
+    se->count = 0;
+    for (int dy = 0; dy < SE_MAX_SIZE; dy++) {
+        for (int dx = 0; dx < SE_MAX_SIZE; dx++) {
+            if (covered[dy][dx]) {
+                se->dx[se->count] = dx - centre;
+                se->dy[se->count] = dy - centre;
+                se->count++;
+                if (abs(dx - centre) > se->radius) se->radius = abs(dx - centre);
+                if (abs(dy - centre) > se->radius) se->radius = abs(dy - centre);
+            }
+        }
+    }
+    se->kernel = erodeBandGeneric;
+    return 1;
+}
+
+// Use the registry element called `spec`, the decomposed element `spec` (see
+// parseDecomposedElement) or the mask `spec` (see parseStructuringElement).
+// Returns 0 if it is none of them.
+int selectStructuringElement(char* spec) {
+    for (int i = 0; i < structuring_element_count; i++) {
+        if (strcmp(structuring_elements[i].name, spec) == 0) {
+            erosion_element = &structuring_elements[i];
+            return 1;
+        }
+    }
+    if (!parseDecomposedElement(spec, &user_element) && !parseStructuringElement(spec, &user_element)) {
+        return 0;
+    }
+    erosion_element = &user_element;
+    return 1;
+}
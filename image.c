@@ -0,0 +1,330 @@
+// Pipeline steps for images of any size (see image in cbmp.h).
+//
+// Images of the fixed 950x950 size are handed to the functions of cells.c, which stay the fast
+// path. Other sizes use the versions below, which give the same result as the full engine: the
+// same erosion, and the same detections in the same order. Detection tests every window on the
+// image as it was before the first detection, then replays the detections in scan order and
+// tests again only the windows around each cleared capturing area, like detectParallel.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "cells.h"
+
+#define PIXEL(img, x, y) ((img)->data[(size_t) (x) * (img)->stride + (y) * (img)->channels])
+
+// Same as rgbToBinary, for images of any size. binary is resized to the size of rgb.
+void rgbToBinarySized(image* rgb, image* binary) {
+    image_resize(binary, rgb->width, rgb->height, 1);
+    for (int x = 0; x < rgb->width; x++) {
+        for (int y = 0; y < rgb->height; y++) {
+            unsigned char* p = &PIXEL(rgb, x, y);
+            PIXEL(binary, x, y) = p[0] + p[1] + p[2] > BINARY_COLOUR_THRESHOLD ? 1 : 0;
+        }
+    }
+}
+
+// Same as binaryToRGB, for images of any size. rgb is resized to the size of binary.
+void binaryToRGBSized(image* binary, image* rgb) {
+    image_resize(rgb, binary->width, binary->height, BMP_CHANNELS);
+    for (int x = 0; x < binary->width; x++) {
+        for (int y = 0; y < binary->height; y++) {
+            unsigned char* p = &PIXEL(rgb, x, y);
+            p[0] = p[1] = p[2] = PIXEL(binary, x, y) * 255;
+        }
+    }
+}
+
+// Same as countWhitePixels, for images of any size.
+int countWhitePixelsSized(image* binary) {
+    int white_pixels = 0;
+    for (int x = 0; x < binary->width; x++) {
+        unsigned char* column = &PIXEL(binary, x, 0);
+        for (int y = 0; y < binary->height; y++) {
+            white_pixels += column[y];
+        }
+    }
+    return white_pixels;
+}
+
+// Same as saveErosionStepImage, for images of any size.
+void saveErosionStepSized(image* binary, int step) {
+    snapshotSubmit(binary->data, binary->width, binary->height, binary->stride, step);
+}
+
+// Same as erodeInto, for images of any size. dst is resized to the size of src.
+char erodeSized(cells_session* session, image* src, image* dst) {
+    image_resize(dst, src->width, src->height, 1);
+    if (IMAGE_IS_FIXED(src) && IMAGE_IS_FIXED(dst)) {
+        return erodeInto(session, FIXED_BINARY(src), FIXED_BINARY(dst));
+    }
+    structuring_element* se = erosion_element;
+    int r = se->radius;
+    int width = src->width;
+    int height = src->height;
+    char wasEroded = 0;
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) {
+            if (x < r || y < r || x >= width - r || y >= height - r) {
+                PIXEL(dst, x, y) = 0;  // Border pixels are black, as in erodeInto.
+                continue;
+            }
+            if (PIXEL(src, x, y) == 0) {
+                PIXEL(dst, x, y) = 0;
+                continue;
+            }
+            int erosion_result = 1;
+            for (int k = 0; k < se->count && erosion_result; k++) {
+                if (PIXEL(src, x + se->dx[k], y + se->dy[k]) == 0) {
+                    erosion_result = 0;
+                }
+            }
+            if (!erosion_result) {
+                wasEroded = 1;
+            }
+            PIXEL(dst, x, y) = erosion_result;
+        }
+    }
+    return wasEroded;
+}
+
+// Mark the cell detected at (x, y) with a red square on rgb, in either layout.
+void paintCell(image* rgb, int x, int y) {
+    for (int i = 1; i <= testsize; i++) {
+        for (int j = 1; j <= testsize; j++) {
+            if (rgb->layout == IMAGE_FILE_ROWS) {
+                unsigned char* p = rgb->data + (size_t) (rgb->height - 1 - y - j) * rgb->stride + (x + i) * rgb->channels;
+                p[0] = 0;      // Blue
+                p[1] = 0;      // Green
+                p[2] = 255;    // Red
+            } else {
+                unsigned char* p = &PIXEL(rgb, x + i, y + j);
+                p[0] = 255;
+                p[1] = 0;
+                p[2] = 0;
+            }
+        }
+    }
+}
+
+// Same as drawCell, for images of any size. If rgb is NULL the cell is only registered.
+void drawCellSized(cells_session* session, image* rgb, int x, int y) {
+    if (rgb != NULL) {
+        paintCell(rgb, x, y);
+    }
+    detectionAdd(session, x, y);
+}
+
+// Test the window at (x, y) on the binary image as it is now, as detectNaive does.
+static int windowFiresSized(image* binary, int x, int y) {
+    int has_white_pixel = 0;
+    for (int dx = 0; dx < testsize && !has_white_pixel; dx++) {
+        for (int dy = 0; dy < testsize; dy++) {
+            if (PIXEL(binary, x + dx, y + dy)) {
+                has_white_pixel = 1;
+                break;
+            }
+        }
+    }
+    if (!has_white_pixel) {
+        return 0;
+    }
+    for (int d = -1; d <= testsize; d++) {
+        if (PIXEL(binary, x - 1, y + d) || PIXEL(binary, x + testsize, y + d)
+            || PIXEL(binary, x + d, y - 1) || PIXEL(binary, x + d, y + testsize)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Same as detect, for images of any size. Detections are drawn on rgb unless it is NULL.
+int detectSized(cells_session* session, image* binary, image* rgb) {
+    if (IMAGE_IS_FIXED(binary) && (rgb == NULL || IMAGE_IS_FIXED(rgb))) {
+        return detectParallel(session, FIXED_BINARY(binary), rgb != NULL ? FIXED_RGB(rgb) : NULL, NULL);
+    }
+    int width = binary->width;
+    int height = binary->height;
+    unsigned int* table = sessionAreaTable(session, width, height);
+    window_list* candidates = &session->candidates[0];
+    window_list* retest = &session->retest;
+
+    // Summed-area table of the image before any detection, with rows of height + 1 entries.
+    #define TABLE(x, y) table[(size_t) (x) * (height + 1) + (y)]
+    for (int x = 0; x < width; x++) {
+        unsigned int column = 0;
+        for (int y = 0; y < height; y++) {
+            column += PIXEL(binary, x, y);
+            TABLE(x + 1, y + 1) = TABLE(x, y + 1) + column;
+        }
+    }
+    #define TABLE_SUM(x, y, w, h) (TABLE((x) + (w), (y) + (h)) - TABLE(x, (y) + (h)) - TABLE((x) + (w), y) + TABLE(x, y))
+    candidates->size = 0;
+    for (int x = 1; x < width - testsize - 1; x++) {
+        for (int y = 1; y < height - testsize - 1; y++) {
+            unsigned int capture = TABLE_SUM(x, y, testsize, testsize);
+            if (capture != 0 && TABLE_SUM(x - 1, y - 1, testsize + 2, testsize + 2) == capture) {
+                windowListPush(candidates, x * height + y);
+            }
+        }
+    }
+    #undef TABLE_SUM
+    #undef TABLE
+
+    // Replay in scan order, testing again the windows next to every detection.
+    int cells = 0;
+    int next = 0;
+    int last = -1;
+    retest->size = 0;
+    for (;;) {
+        int window;
+        if (retest->size > 0 && (next == candidates->size || retest->items[0] < candidates->items[next])) {
+            window = windowHeapPop(retest);
+        } else if (next < candidates->size) {
+            window = candidates->items[next++];
+        } else {
+            break;
+        }
+        if (window <= last) {
+            continue;
+        }
+        last = window;
+
+        int x = window / height;
+        int y = window % height;
+        if (profile_enabled) {
+            session->windows_tested++;
+        }
+        if (!windowFiresSized(binary, x, y)) {
+            continue;
+        }
+        if (detectionIsNew(session, x, y)) {
+            cells++;
+            drawCellSized(session, rgb, x, y);
+            recordCell(session, x, y, &PIXEL(binary, x, y), binary->stride);
+        }
+
+        // Set all pixels inside the capturing area to black to prevent detecting the same cell twice
+        for (int dx = 0; dx < testsize; dx++) {
+            if (profile_enabled) {
+                for (int dy = 0; dy < testsize; dy++) {
+                    session->pixels_cleared += PIXEL(binary, x + dx, y + dy);
+                }
+            }
+            memset(&PIXEL(binary, x + dx, y), 0, testsize);
+        }
+
+        // Later windows whose capturing area or exclusion frame overlaps the cleared area.
+        for (int wx = x; wx <= x + testsize && wx < width - testsize - 1; wx++) {
+            int y_begin = wx == x ? y + 1 : y - testsize;
+            if (y_begin < 1) y_begin = 1;
+            for (int wy = y_begin; wy <= y + testsize && wy < height - testsize - 1; wy++) {
+                windowHeapPush(retest, wx * height + wy);
+            }
+        }
+    }
+    return cells;
+}
+
+// Same as erodeAndDetect, for images of any size. Images of the fixed size can use any engine;
+// other sizes always use the full engine. rgb may be in either layout: an IMAGE_FILE_ROWS image is
+// not drawn on while detecting, the detections are collected and drawn on it at the end.
+int erodeAndDetectSized(cells_session* session, image* binary, image* rgb, int engine, int* iterations) {
+    if (rgb != NULL && rgb->layout == IMAGE_FILE_ROWS) {
+        int cells = erodeAndDetectSized(session, binary, NULL, engine, iterations);
+        for (int i = 0; i < session->detections.size; i++) {
+            paintCell(rgb, session->detections.items[i].x, session->detections.items[i].y);
+        }
+        return cells;
+    }
+    if (IMAGE_IS_FIXED(binary) && (rgb == NULL || IMAGE_IS_FIXED(rgb))) {
+        return erodeAndDetect(session, FIXED_BINARY(binary), rgb != NULL ? FIXED_RGB(rgb) : NULL, engine, iterations);
+    }
+    detectionsReset(session);
+    if (session->cell_records != NULL) {
+        labelComponents(session, binary->data, binary->width, binary->height, binary->stride);
+    }
+    session->detects_skipped = 0;
+    session->passes_saved = 0;
+
+    // The binary image currently being worked on, and the one the next erosion pass writes to.
+    image* current_image = binary;
+    image* eroded_image = &session->eroded;
+
+    profile_mark mark = profileStart();
+    if (SNAPSHOT_DUE(0)) {
+        saveErosionStepSized(current_image, 0);
+        profileStop(PROFILE_SNAPSHOT, mark);
+    }
+    mark = profileStart();
+    int white_pixels = countWhitePixelsSized(current_image);
+    profileStop(PROFILE_COUNT, mark);
+    profileInitialWhite(session, white_pixels);
+    if (cells_verbose) {
+        printf("Initial white pixels after binary conversion: %d\n", white_pixels);
+    }
+
+    int erosion_iterations = 0;
+    int total_cells = 0;
+    char wasEroded;
+    do {
+        if (cells_verbose) {
+            printf("Starting erosion with structuring element '%s'...\n", erosion_element->name);
+        }
+        mark = profileStart();
+        wasEroded = erodeSized(session, current_image, eroded_image);
+        profileStop(PROFILE_ERODE, mark);
+
+        // Swap the images, so the eroded image becomes the current one.
+        image* previous_image = current_image;
+        current_image = eroded_image;
+        eroded_image = previous_image;
+
+        mark = profileStart();
+        white_pixels = countWhitePixelsSized(current_image);
+        profileStop(PROFILE_COUNT, mark);
+        erosion_iterations++;
+
+        if (SNAPSHOT_DUE(erosion_iterations)) {
+            mark = profileStart();
+            saveErosionStepSized(current_image, erosion_iterations);
+            profileStop(PROFILE_SNAPSHOT, mark);
+        }
+        if (cells_verbose) {
+            printf("After erosion %d: %d white pixels remaining, wasEroded=%d\n",
+                   erosion_iterations, white_pixels, wasEroded);
+        }
+
+        // Stop if no white pixels remain or max erosions reached
+        if (white_pixels == 0 || erosion_iterations > MAX_EROSIONS) {
+            profilePass(session, white_pixels, 0);
+            break;
+        }
+
+        mark = profileStart();
+        session->cell_records_step = erosion_iterations;
+        int outlook = scheduleOutlook(session, current_image->data, current_image->width, current_image->height, current_image->stride);
+        int cells = 0;
+        if (outlook & OUTLOOK_DETECT) {
+            cells = detectSized(session, current_image, rgb);
+        } else {
+            session->detects_skipped++;
+        }
+        profileStop(PROFILE_DETECT, mark);
+        profilePass(session, white_pixels, cells);
+        total_cells += cells;
+
+        // The next pass would leave no white pixels and end the loop (see erodeAndDetect).
+        if (schedule_enabled && save_snapshots == 0 && cells > 0 && white_pixels <= cells * testsize * testsize && countWhitePixelsSized(current_image) == 0) {
+            outlook |= OUTLOOK_LAST;
+        }
+        if ((outlook & OUTLOOK_LAST) && wasEroded) {
+            session->passes_saved++;
+            break;
+        }
+
+    } while (wasEroded);
+
+    *iterations = erosion_iterations;
+    return total_cells;
+}
@@ -1,341 +1,334 @@
-// To compile (linux/mac): gcc main.c -o main.out -std=c99
+// To compile (linux/mac): gcc main.c -o main.out -std=c99 -O2 -pthread
+// Add -O2 -march=native to enable the AVX2 threshold kernel (SSE2 is used on any x86-64).
 // To run (linux/mac): ./main.out "samples/easy/1EASY.bmp" "results/easy/1EASY_RESULT.bmp"
-
-// To compile (win): gcc cbmp.c main.c -o main.exe -std=c99
+// Options (before or after the paths):
+//   --engine NAME                     erosion engine: full, frontier, distance or packed, see
+//                                     cells.h (default frontier)
+//   --threshold N|otsu                pixels whose red + green + blue is above N are white (default
+//                                     270); otsu chooses N for every image, see cbmp.h (not with --tile)
+//   --element NAME|ROWS               structuring element: default, square, plus, disk5, rect:WxH,
+//                                     diamond:R, disk:R, or a mask such as 010,111,010 (rows from
+//                                     the top), see elements.c
+//   --threads N                       threads for erosion (full engine) and detection (default 1)
+//   --io stdio|mmap                   how bitmaps are read and written, see cbmp.h (default stdio)
+//   --huge-pages                      back the frame buffers and the session arena with huge pages
+//                                     where the system has them, see cbmp.h and session.c
+//   --snapshots N                     save the binary image after every Nth erosion pass in results/
+//   --snapshot-format bmp|pbm         file format of the snapshots, see snapshot.c (default bmp)
+//   --repeat N                        run the pipeline N times and print the average time (default 8)
+//   --profile FILE                    time every stage and write min/median/p99 as JSON, see profile.c
+//   --pipeline                        read the next run's image and write the previous one's while
+//                                     eroding, and print how busy every stage was, see pipeline.c
+//                                     (not with --profile)
+//   --min-separation R                count a detection closer than R pixels to an earlier one as the
+//                                     same cell, see detections.c (default 0: keep all)
+//   --cells FILE                      write the area, centroid and bounding box of every detected
+//                                     cell to FILE as CSV, see components.c (also with --tile)
+//   --no-schedule                     call detect after every erosion pass and make every pass, see
+//                                     schedule.c (the cells found are the same)
+// Images of any size can be processed; sizes other than 950x950 always use the full engine.
+// Tiled mode, for bitmaps too large to hold in memory: ./main.out --tile 1024 slide.bmp slide_result.bmp
+//   processes the bitmap in tiles of N x N pixels (plus a halo), reading and writing the files a
+//   tile at a time, so memory use depends on N only.
+// Batch mode: ./main.out --batch samples results/batch
+//   processes every .bmp file under the first path (a directory, or a file listing one path per
+//   line) and writes the annotated images and summary.csv to the second one (a directory).
+//   --workers N                       worker processes (default: number of cores)
+//   --summary FILE                    summary file, CSV or JSON if FILE ends in .json
+//   --pipeline                        overlap reading, processing and writing in every worker
+
+// To compile (win): gcc main.c -o main.exe -std=c99 -O2 -pthread
 // gcc main.c -o main.exe
 // To run (win): main.exe example.bmp example_inv.bmp
 
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#define _FILE_OFFSET_BITS 64
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "cbmp.c"
+#include "cells.c"
+#include "elements.c"
+#include "components.c"
+#include "detections.c"
+#include "schedule.c"
+#include "distance.c"
+#include "parallel.c"
+#include "snapshot.c"
+#include "profile.c"
+#include "image.c"
+#include "session.c"
+#include "pipeline.c"
+#include "batch.c"
+#include "tiled.c"
 #include <time.h>
-
-#define testsize 12
-#define BINARY_COLOUR_THRESHOLD 270
-
-// Get the colour of the RGB image at pixel x, y.
-int getColourIntensity(unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], unsigned int x, unsigned int y) {
-    // Return 1 if pixel is white and 0 if the pixel is black.
-    int sum = bmp_image[x][y][0] + bmp_image[x][y][1] + bmp_image[x][y][2];
-    return sum > BINARY_COLOUR_THRESHOLD;
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// The session holding the RGB and binary images (sized when the input is read) and the scratch of
+// the pipeline.
+cells_session session;
+
+// The cells detected by the last run, for --cells.
+cell_table cells_table;
+
+// Print what the loop below prints for every run, for the runs of --pipeline: called by runPipeline
+// after every stage, on the thread of the stage; only the compute stage, on the main thread, prints.
+void printPipelineRun(void* arg, pipeline_frame* frame, int stage) {
+    int repetitions = *(int*) arg;
+    if (stage != PIPELINE_COMPUTE) {
+        return;
+    }
+    if (binary_threshold == THRESHOLD_OTSU && cells_verbose) {
+        printf("Otsu threshold: %d\n", frame->threshold);
+    }
+    if (cells_verbose) {
+        printDetections(&session);
+    }
+    printf("Total cells detected: %d\n", frame->cells);
+    if (cells_verbose) {
+        printf("Detect calls skipped: %d, erosion passes saved: %d\n", frame->detects_skipped, frame->passes_saved);
+    }
+    // Keep the cells of the last run only, as without --pipeline.
+    if (frame->index + 1 < repetitions) {
+        cells_table.size = 0;
+    }
 }
 
-// Switch colour of pixel (x,y) between black and white.
-void switchColour(unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned int x, unsigned int y) {
-    // Switch between black and white.
-    binary_image[x][y] = !(binary_image[x][y]);
+// Print how to call the program and exit.
+void usage(char* program) {
+    fprintf(stderr, "Usage: %s [--engine full|frontier|distance|packed] [--threshold N|otsu] [--element NAME|ROWS] [--threads N] [--io stdio|mmap] [--huge-pages] [--snapshots N [--snapshot-format bmp|pbm]] [--repeat N] [--profile FILE | --pipeline] [--min-separation R] [--cells FILE] [--no-schedule] <input file path> <output file path>\n", program);
+    fprintf(stderr, "       %s --tile N [--engine ...] <input file path> <output file path>\n", program);
+    fprintf(stderr, "       %s --batch [--workers N] [--summary FILE] [--pipeline] [--engine ...] [--threads N] <input directory or list> <output directory>\n", program);
+    exit(1);
 }
 
-
-// Write a 2D list binary_image from the RGB bitmap bmp_image.
-void rgbToBinary (unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH]) {
-    for (int x = 0; x < BMP_WIDTH; x++) {
-        for (int y = 0; y < BMP_HEIGTH; y++) {
-            if (getColourIntensity(bmp_image, x, y)) {
-                binary_image[x][y] = 1;
+// Main function.
+int main(int argc, char** argv) {
+    //argv[0] is a string with the name of the program
+    //The options are followed by the input image and the output image paths
+    char* input_path = NULL;
+    char* output_path = NULL;
+    int engine = ENGINE_FRONTIER;
+    int threads = 1;
+    int batch = 0;
+    int workers = 0;
+    char* summary_path = NULL;
+    int tile_size = 0;
+    int repetitions = 8;
+    char* profile_path = NULL;
+    char* cells_path = NULL;
+    int pipelined = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "full") == 0) {
+                engine = ENGINE_FULL;
+            } else if (strcmp(argv[i], "frontier") == 0) {
+                engine = ENGINE_FRONTIER;
+            } else if (strcmp(argv[i], "distance") == 0) {
+                engine = ENGINE_DISTANCE;
+            } else if (strcmp(argv[i], "packed") == 0) {
+                engine = ENGINE_PACKED;
             } else {
-                binary_image[x][y] = 0;
+                usage(argv[0]);
             }
-        }
-    }
-}
-
-
-// Write an RGB bitmap bmp_image from the 2D list binary_image.
-// Note that this image will neccisarily be polarised, any pixel will be either completely black or completely white.
-void binaryToRGB (unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]) {
-    for (int x = 0; x < BMP_WIDTH; x++) {
-        for (int y = 0; y < BMP_HEIGTH; y++) {
-            for (int c = 0; c < BMP_CHANNELS; c++) {
-                bmp_image[x][y][c] = binary_image[x][y] * 255;
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "otsu") == 0) {
+                binary_threshold = THRESHOLD_OTSU;
+            } else {
+                binary_threshold = atoi(argv[i]);
+                if (binary_threshold < 0 || binary_threshold > 3 * 255) {
+                    usage(argv[0]);
+                }
+            }
+        } else if (strcmp(argv[i], "--element") == 0 && i + 1 < argc) {
+            if (!selectStructuringElement(argv[++i])) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads < 1 || threads > MAX_THREADS) {
+                usage(argv[0]);
             }
+        } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "stdio") == 0) {
+                bmp_io_backend = BMP_IO_STDIO;
+            } else if (strcmp(argv[i], "mmap") == 0) {
+                bmp_io_backend = BMP_IO_MMAP;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--huge-pages") == 0) {
+            bmp_huge_pages = 1;
+        } else if (strcmp(argv[i], "--snapshots") == 0 && i + 1 < argc) {
+            save_snapshots = atoi(argv[++i]);
+            if (save_snapshots < 1) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--snapshot-format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "bmp") == 0) {
+                snapshot_format = SNAPSHOT_BMP;
+            } else if (strcmp(argv[i], "pbm") == 0) {
+                snapshot_format = SNAPSHOT_PBM;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repetitions = atoi(argv[++i]);
+            if (repetitions < 1) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_path = argv[++i];
+            profile_enabled = 1;
+        } else if (strcmp(argv[i], "--min-separation") == 0 && i + 1 < argc) {
+            detection_min_separation = atoi(argv[++i]);
+            if (detection_min_separation < 0) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--cells") == 0 && i + 1 < argc) {
+            cells_path = argv[++i];
+        } else if (strcmp(argv[i], "--no-schedule") == 0) {
+            schedule_enabled = 0;
+        } else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc) {
+            tile_size = atoi(argv[++i]);
+            if (tile_size < 1) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            pipelined = 1;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch = 1;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+            if (workers < 1) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--summary") == 0 && i + 1 < argc) {
+            summary_path = argv[++i];
+        } else if (input_path == NULL) {
+            input_path = argv[i];
+        } else if (output_path == NULL) {
+            output_path = argv[i];
+        } else {
+            usage(argv[0]);
         }
     }
-}
-
-// Save a snapshot of the current binary image as a BMP under results/step_<step>.bmp
-void saveErosionStepImage(unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], int step) {
-    static unsigned char tmp[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS];
-    binaryToRGB(binary_image, tmp);
-    char path[260];
-    snprintf(path, sizeof(path), "results/step_%d.bmp", step);
-    write_bitmap(tmp, path);
-    printf("Saved erosion snapshot: %s\n", path);
-}
-
-// Apply the erosion algorithm to the binary image using a structuring element.
-char erode (unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]) {
-    char wasEroded = 0;
-
-    // 1 means the pixel is part of the structuring element, 0 means it's ignored.
-    // Define size of structuring element.
-    int se_size = 3;
-
-    // Define center of the structuring element.
-    int se_center = se_size>>1; // Used for making sure the pixel is not at the border. Dividing integers automatically rounds down.
-
-    // Define the structuring element itself.
-    int structuringElement[3][3] = {
-        {1, 1, 0},
-        {1, 1, 1},
-        {1, 1, 0}
-    };
-    
-    // Create a temporary array to store the result.
-    unsigned char temp_image[BMP_WIDTH][BMP_HEIGTH];
-    
-    // Copy the original binary image to the temporary array.
-    for (int x = 0; x < BMP_WIDTH; x++) {
-        for (int y = 0; y < BMP_HEIGTH; y++) {
-            temp_image[x][y] = binary_image[x][y];
-        }
+    //Checking that 2 paths are passed
+    if (output_path == NULL || (batch && cells_path != NULL) || (tile_size > 0 && binary_threshold == THRESHOLD_OTSU)
+        || (pipelined && (profile_path != NULL || tile_size > 0))) {
+        usage(argv[0]);
     }
-
-    printf("Starting erosion with cross-shaped structuring element...\n");
-
-    // Apply the erosion algorithm for non-border pixels
-    for (int x = 1; x < BMP_WIDTH - 1; x++) {
-        for (int y = 1; y < BMP_HEIGTH - 1; y++) {
-
-
-            int erosion_result = 0;
-            
-
-            if (temp_image[x][y]) {
-
-                // Assume erosion passes initially, i.e. that there are no black pixels within the structuring element.
-                erosion_result = 1;
-            
-                // Check if the selected pixel should be eroding by comparing the surrounding grid with the structuring element.
-                
-                // Check each position in the structuring element projected on the binary image.
-                for (int i = 0; i < se_size; i++) {
-                    for (int j = 0; j < se_size; j++) {
-
-                        // Only check positions where the structuring element has a 1.
-                        if (structuringElement[i][j] == 1) {
-
-                            
-
-                            // Calculate the position of the selected entry of the structuring element relative to the selected pixel.
-                            int entry_x = x + i - 1;
-                            int entry_y = y + j - 1;
-                            
-                            // If any black pixel is contain on an entry of the structuring element equal to 1, the erosion happens.
-                            if (temp_image[entry_x][entry_y] == 0) {
-                                erosion_result = 0;
-                                wasEroded = 1;
-                            }
-                        }
-                    }
-                }             
-            }
-
-            // Set the pixel to the result of the erosion, i.e. if the erosion failed (0), then set the pixel to 0 (black). If it succeeded set it to 1 (white).
-            binary_image[x][y] = erosion_result;
+    if (batch) {
+        if (workers == 0) {
+#ifdef _WIN32
+            workers = 1;
+#else
+            workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
         }
+        return runBatch(input_path, output_path, summary_path, workers, engine, threads, pipelined);
     }
-    
-    // Set border pixels to black to avoid boundary issues.
-
-    // Horizontal borders:
-    for (int x = 0; x < BMP_WIDTH; x++) {
-        for (int i = 0; i < se_center; i++) {
-            binary_image[x][i] = 0;  // Top border
-            binary_image[x][BMP_HEIGTH - 1 - i] = 0;  // Bottom border
-        }
+    sessionInit(&session, threads);
+    if (cells_path != NULL) {
+        session.cell_records = &cells_table;
     }
-
-    // Vertical borders:
-    for (int y = 0; y < BMP_HEIGTH; y++) {
-        for (int i = 0; i < se_center; i++) {
-            binary_image[i][y] = 0;  // Left border
-            binary_image[BMP_WIDTH - 1 - i][y] = 0;  // Right border
+    if (tile_size > 0) {
+        save_snapshots = 0;
+        double tiled_start = now_seconds();
+        int erosion_iterations;
+        int total_cells = processTiled(&session, input_path, output_path, tile_size, engine, &erosion_iterations);
+        printf("Total cells detected: %d\n", total_cells);
+        printf("Done!\n");
+        printf("Total time: %f ms\n", (now_seconds() - tiled_start) * 1000.0);
+        if (cells_path != NULL && writeCellTable(&cells_table, cells_path)) {
+            printf("Cells written to %s\n", cells_path);
         }
+#ifndef _WIN32
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        printf("Peak memory: %ld kB\n", (long) usage.ru_maxrss);  // Bytes on macOS.
+#endif
+        sessionFree(&session);
+        return 0;
     }
-    return wasEroded;
-}
-
-
-
-// Detect cells in the binary image using sliding window approach
-int detect(unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS]) {    
-    int cells = 0;
-    for (int x = 1; x < BMP_WIDTH - testsize - 1; x++) {
-        for (int y = 1; y < BMP_HEIGTH - testsize - 1; y++) {
-            
-            // Check if at least one pixel is white in the capturing area (12x12 square)
-            int has_white_pixel = 0;
-            for (int dx = 0; dx < testsize; dx++) {
-                for (int dy = 0; dy < testsize; dy++) {
-                    if (binary_image[x + dx][y + dy] == 1) {
-                        has_white_pixel = 1;
-                        break;
-                    }
-                }
-                if (has_white_pixel) break;
-            }
-            
-            // If at least one pixel is white in the capturing area
-            if (has_white_pixel) {
-                
-                // Check if all pixels in the exclusion frame are black
-                int exclusion_frame_clear = 1;
-                
-                // Check top and bottom rows of exclusion frame
-                for (int dy = -1; dy <= testsize; dy++) {
-                    if (y + dy >= 0 && y + dy < BMP_HEIGTH) {
-                        if (binary_image[x - 1][y + dy] == 1 || binary_image[x + testsize][y + dy] == 1) {
-                            exclusion_frame_clear = 0;
-                            break;
-                        }
-                    }
-                }
-                
-                // Check left and right columns of exclusion frame (excluding corners already checked)
-                if (exclusion_frame_clear) {
-                    for (int dx = 0; dx < testsize; dx++) {
-                        if (x + dx >= 0 && x + dx < BMP_WIDTH) {
-                            if (binary_image[x + dx][y - 1] == 1 || binary_image[x + dx][y + testsize] == 1) {
-                                exclusion_frame_clear = 0;
-                                break;
-                            }
-                        }
-                    }
-                }
-                
-                // If all pixels in the exclusion frame are black, register a cell detection
-                if (exclusion_frame_clear) {
-                    cells++;
-                    for (int i = 1; i <= testsize; i++) {
-                        for (int j = 1; j <= testsize; j++) {
-                            bmp_image[x + i][y + j][0] = 255;
-                            bmp_image[x + i][y + j][1] = 0;
-                            bmp_image[x + i][y + j][2] = 0;
-                        }
-                    }
-                    
-                    // Set all pixels inside the capturing area to black to prevent detecting the same cell twice
-                    for (int dx = 0; dx < testsize; dx++) {
-                        for (int dy = 0; dy < testsize; dy++) {
-                            binary_image[x + dx][y + dy] = 0;
-                        }
-                    }
-                    
-                    printf("Cell detected at position (%d, %d)\n", x, y);
-                }
-            }
+    if (pipelined) {
+        // The runs overlap, so only the time of all of them is measured.
+        char** inputs = (char**) malloc(repetitions * sizeof(char*));
+        char** outputs = (char**) malloc(repetitions * sizeof(char*));
+        for (int i = 0; i < repetitions; i++) {
+            inputs[i] = input_path;
+            outputs[i] = output_path;
         }
-    }
-    return cells;
-}
-
-
-//Declare the array to store the RGB image.
-unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS];
-
-// Declare the array to store the binary images.
-unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH];
-
-// Declare boolean used to check erosion.
-char wasEroded;
-
-// Main function.
-int main(int argc, char** argv) {
-    //argc counts how may arguments are passed
-    //argv[0] is a string with the name of the program
-    //argv[1] is the first command line argument (input image)
-    //argv[2] is the second command line argument (output image)
-    clock_t start, end;
-    double cpu_time_used;
-    //Checking that 2 arguments are passed
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <output file path> <output file path>\n", argv[0]);
-        exit(1);
-    }
-    int totaltime = 0;
-    for (int i = 0; i < 8;i++){
-    start = clock();
-
-    // Load image from file.
-    read_bitmap(argv[1], bmp_image);
-
-    // Write the binary image.
-    rgbToBinary(bmp_image, binary_image);
-
-    // Save the initial binary image as step 0 (before any erosion)
-    saveErosionStepImage(binary_image, 0);
-
-    // Count initial white pixels
-    int initial_white_pixels = 0;
-    for (int x = 0; x < BMP_WIDTH; x++) {
-        for (int y = 0; y < BMP_HEIGTH; y++) {
-            if (binary_image[x][y] == 1) {
-                initial_white_pixels++;
-            }
+        pipeline_job job = { inputs, outputs, repetitions, NULL, printPipelineRun, &repetitions, engine };
+        pipeline_stats stats;
+        runPipeline(&session, &job, &stats);
+        printf("Done!\n");
+        printf("Average time over %d runs: %f ms\n", repetitions, stats.seconds * 1000.0 / repetitions);
+        pipelineReport(&stats);
+        free(inputs);
+        free(outputs);
+        if (cells_path != NULL && writeCellTable(&cells_table, cells_path)) {
+            printf("Cells written to %s\n", cells_path);
         }
+        snapshotStop();
+        sessionFree(&session);
+        return 0;
     }
-    printf("Initial white pixels after binary conversion: %d\n", initial_white_pixels);
-    
-    // Apply limited erosion and detect cells
-    int erosion_iterations = 0;
-    int max_erosions = 100; // Limit erosions to prevent removing all pixels
-    int total_cells = 0;
-    
-    do {
-        // Create a copy to check if erosion changed anything
-        unsigned char temp_copy[BMP_WIDTH][BMP_HEIGTH];
-        for (int x = 0; x < BMP_WIDTH; x++) {
-            for (int y = 0; y < BMP_HEIGTH; y++) {
-                temp_copy[x][y] = binary_image[x][y];
-            }
+    // Run the whole pipeline `repetitions` times and time every run with the wall clock.
+    double total_time = 0;
+    for (int i = 0; i < repetitions; i++) {
+        profileBeginRepetition();
+        cells_table.size = 0;
+        double run_start = now_seconds();
+
+        // Load image from file and write the binary image in the same pass.
+        profile_mark mark = profileStart();
+        int threshold = read_bitmap_image(input_path, binary_threshold, &session.binary, &session.rgb);
+        profileStop(PROFILE_LOAD, mark);
+        if (binary_threshold == THRESHOLD_OTSU && cells_verbose) {
+            printf("Otsu threshold: %d\n", threshold);
         }
-        
-    wasEroded = erode(binary_image, bmp_image);
-    erosion_iterations++;
 
-    // Save snapshot after this erosion iteration
-    saveErosionStepImage(binary_image, erosion_iterations);
-        
-        // Check if erosion actually changed anything
-        
-        // Count remaining white pixels
-        int white_pixels = 0;
-        for (int x = 0; x < BMP_WIDTH; x++) {
-            for (int y = 0; y < BMP_HEIGTH; y++) {
-                if (binary_image[x][y] == 1) {
-                    white_pixels++;
-                }
-            }
-        }
-        
-        printf("After erosion %d: %d white pixels remaining, wasEroded=%d\n", 
-               erosion_iterations, white_pixels, wasEroded);
-        
-        // Stop if no white pixels remain or max erosions reached
-        if (white_pixels == 0 || erosion_iterations > max_erosions) {
-            break;
+        // Apply limited erosion and detect cells
+        int erosion_iterations;
+        int total_cells = erodeAndDetectSized(&session, &session.binary, &session.rgb, engine, &erosion_iterations);
+        if (cells_verbose) {
+            printDetections(&session);
         }
-        
-        total_cells += detect(binary_image, bmp_image);
-        
-    } while (wasEroded);
 
-    // Save image to file
-    write_bitmap(bmp_image, argv[2]);
+        // Save image to file
+        mark = profileStart();
+        write_bitmap_image(&session.rgb, output_path);
+        profileStop(PROFILE_WRITE, mark);
 
-    printf("Total cells detected: %d\n", total_cells);
-
-    end = clock();
-
-    printf("Done!\n");
-    cpu_time_used = end - start;
-    printf("Total time: %f ms\n", cpu_time_used * 1000.0 /CLOCKS_PER_SEC);
-    totaltime += cpu_time_used;
+        printf("Total cells detected: %d\n", total_cells);
+        if (cells_verbose) {
+            printf("Detect calls skipped: %d, erosion passes saved: %d\n", session.detects_skipped, session.passes_saved);
+        }
 
+        double run_time = now_seconds() - run_start;
+        profileEndRepetition();
 
+        printf("Done!\n");
+        printf("Total time: %f ms\n", run_time * 1000.0);
+        total_time += run_time;
+    }
+    printf("Average time over %d runs: %f ms\n", repetitions, total_time * 1000.0 / repetitions);
+    if (profile_path != NULL && profileReport(profile_path, input_path)) {
+        printf("Profile written to %s\n", profile_path);
+    }
+    if (cells_path != NULL && writeCellTable(&cells_table, cells_path)) {
+        printf("Cells written to %s\n", cells_path);
     }
-    int avgtime = totaltime >>3;
-    printf("Total time: %f ms\n", avgtime * 1000.0 /CLOCKS_PER_SEC);
+    snapshotStop();
+    sessionFree(&session);
     return 0;
 }
@@ -0,0 +1,369 @@
+// Parallel mode of the erosion and detection loop (--threads N).
+//
+// A small pool of pthreads, one per session, runs every step on bands of the image. A band is a range of x
+// coordinates, i.e. a set of whole BMP_HEIGTH lines of the [x][y] arrays, so each thread works on
+// contiguous memory. Erosion reads the line before and after its band from the source image (the
+// halo) and writes only its own band of the destination, so bands need no locking.
+//
+// Detection is split in two. The threads test their band of windows against the image as it was
+// before any detection, which gives the candidates. The detections are then replayed on one
+// thread in scan order: a detection clears its capturing area, which can only change the result
+// of the windows around it, so those are tested again. The result is the same as detectNaive.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "cells.h"
+
+typedef struct thread_pool_data thread_pool;
+
+// What a thread of the pool is started with.
+typedef struct pool_thread_data
+{
+    thread_pool* pool;
+    int band;
+} pool_thread;
+
+// The pool of a session (session->pool), NULL while tasks run on the caller only.
+struct thread_pool_data
+{
+    pthread_t threads[MAX_THREADS];
+    pool_thread args[MAX_THREADS];
+    int size;                   // Number of threads besides the caller.
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    band_task task;
+    void* arg;
+    unsigned long generation;   // Incremented for every task, so threads know there is a new one.
+    int pending;                // Threads still working on the current task.
+    int stopping;
+};
+
+// Thread of the pool: wait for a task, run its band and report back.
+static void* poolThread(void* arg) {
+    thread_pool* pool = ((pool_thread*) arg)->pool;
+    int band = ((pool_thread*) arg)->band;
+    unsigned long generation = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == generation && !pool->stopping) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stopping) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        generation = pool->generation;
+        band_task task = pool->task;
+        void* task_arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+
+        task(task_arg, band, pool->size + 1);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Start the pool of the session so its tasks run on `threads` threads, the caller included.
+void threadPoolStart(cells_session* session, int threads) {
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    if (threads == session->threads) {
+        return;
+    }
+    threadPoolStop(session);
+    if (threads > 1) {
+        thread_pool* pool = (thread_pool*) calloc(1, sizeof(thread_pool));
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->start, NULL);
+        pthread_cond_init(&pool->done, NULL);
+        for (int band = 1; band < threads; band++) {
+            pool->args[band - 1].pool = pool;
+            pool->args[band - 1].band = band;
+            if (pthread_create(&pool->threads[band - 1], NULL, poolThread, &pool->args[band - 1]) != 0) {
+                fprintf(stderr, "Could not start thread %d, using %d\n", band, band);
+                threads = band;
+                break;
+            }
+            pool->size = band;
+        }
+        session->pool = pool;
+    }
+    session->threads = threads;
+}
+
+// Stop the threads of the pool of the session. Its tasks run on the caller only afterwards.
+void threadPoolStop(cells_session* session) {
+    thread_pool* pool = session->pool;
+    session->threads = 1;
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->size; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool);
+    session->pool = NULL;
+}
+
+// Run task on every band and wait until all bands are done. The caller runs band 0.
+void threadPoolRun(cells_session* session, band_task task, void* arg) {
+    thread_pool* pool = session->pool;
+    if (pool == NULL || pool->size == 0) {
+        task(arg, 0, 1);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->pending = pool->size;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    task(arg, 0, pool->size + 1);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Split [begin, end) into `bands` ranges of nearly equal size and store range `band` in [*band_begin, *band_end).
+void bandRange(int begin, int end, int band, int bands, int* band_begin, int* band_end) {
+    int length = end - begin;
+    *band_begin = begin + (int) ((long) length * band / bands);
+    *band_end = begin + (int) ((long) length * (band + 1) / bands);
+}
+
+typedef struct erode_task_data
+{
+    unsigned char (*src)[BMP_HEIGTH];
+    unsigned char (*dst)[BMP_HEIGTH];
+    char eroded[MAX_THREADS];
+    int white_pixels[MAX_THREADS];
+} erode_task;
+
+static void erodeTask(void* arg, int band, int bands) {
+    erode_task* task = (erode_task*) arg;
+    int x_begin, x_end;
+    bandRange(erosion_element->radius, BMP_WIDTH - erosion_element->radius, band, bands, &x_begin, &x_end);
+    task->eroded[band] = erodeBand(task->src, task->dst, x_begin, x_end);
+
+    // Count the white pixels of the band while it is still in cache.
+    int white_pixels = 0;
+    for (int x = x_begin; x < x_end; x++) {
+        for (int y = 0; y < BMP_HEIGTH; y++) {
+            white_pixels += task->dst[x][y];
+        }
+    }
+    task->white_pixels[band] = white_pixels;
+}
+
+// Same as erodeInto, on all threads of the pool. Also stores the number of white pixels of dst in *white_pixels.
+// Decomposed elements are eroded step by step on the calling thread.
+char erodeParallel(cells_session* session, unsigned char src[BMP_WIDTH][BMP_HEIGTH], unsigned char dst[BMP_WIDTH][BMP_HEIGTH], int* white_pixels) {
+    erode_task task;
+    if (erosion_element->step_count > 0) {
+        char wasEroded = erodeSteps(session, src, dst);
+        *white_pixels = countWhitePixels(dst);
+        return wasEroded;
+    }
+    task.src = src;
+    task.dst = dst;
+    memset(task.eroded, 0, sizeof(task.eroded));
+    memset(task.white_pixels, 0, sizeof(task.white_pixels));
+    threadPoolRun(session, erodeTask, &task);
+
+    // Vertical borders:
+    for (int x = 0; x < erosion_element->radius; x++) {
+        memset(dst[x], 0, BMP_HEIGTH);  // Left border
+        memset(dst[BMP_WIDTH - 1 - x], 0, BMP_HEIGTH);  // Right border
+    }
+
+    char wasEroded = 0;
+    *white_pixels = 0;
+    for (int band = 0; band < MAX_THREADS; band++) {
+        wasEroded |= task.eroded[band];
+        *white_pixels += task.white_pixels[band];
+    }
+    return wasEroded;
+}
+
+// Detection on the image of the session: the summed-area table of the image before any detection
+// (session->area_table), and the candidate windows of every band (session->candidates).
+typedef struct detect_task_data
+{
+    cells_session* session;
+    unsigned char (*image)[BMP_HEIGTH];
+    unsigned int (*area)[BMP_HEIGTH + 1];
+} detect_task;
+
+// First pass of the table: running sums down every line of the band.
+static void columnSumTask(void* arg, int band, int bands) {
+    unsigned char (*detect_image)[BMP_HEIGTH] = ((detect_task*) arg)->image;
+    unsigned int (*parallel_area)[BMP_HEIGTH + 1] = ((detect_task*) arg)->area;
+    int x_begin, x_end;
+    bandRange(0, BMP_WIDTH, band, bands, &x_begin, &x_end);
+    for (int x = x_begin; x < x_end; x++) {
+        unsigned int column = 0;
+        for (int y = 0; y < BMP_HEIGTH; y++) {
+            column += detect_image[x][y];
+            parallel_area[x + 1][y + 1] = column;
+        }
+    }
+}
+
+// Second pass of the table: add up the line sums along x, for the band of y coordinates.
+static void rowSumTask(void* arg, int band, int bands) {
+    unsigned int (*parallel_area)[BMP_HEIGTH + 1] = ((detect_task*) arg)->area;
+    int y_begin, y_end;
+    bandRange(1, BMP_HEIGTH + 1, band, bands, &y_begin, &y_end);
+    for (int x = 1; x < BMP_WIDTH; x++) {
+        for (int y = y_begin; y < y_end; y++) {
+            parallel_area[x + 1][y] += parallel_area[x][y];
+        }
+    }
+}
+
+// Test the windows of the band on the image before any detection.
+static void candidateTask(void* arg, int band, int bands) {
+    unsigned int (*parallel_area)[BMP_HEIGTH + 1] = ((detect_task*) arg)->area;
+    int x_begin, x_end;
+    bandRange(1, BMP_WIDTH - testsize - 1, band, bands, &x_begin, &x_end);
+    window_list* list = &((detect_task*) arg)->session->candidates[band];
+    list->size = 0;
+    for (int x = x_begin; x < x_end; x++) {
+        for (int y = 1; y < BMP_HEIGTH - testsize - 1; y++) {
+            unsigned int capture = AREA_SUM(parallel_area, x, y, testsize, testsize);
+            if (capture != 0 && AREA_SUM(parallel_area, x - 1, y - 1, testsize + 2, testsize + 2) == capture) {
+                windowListPush(list, x * BMP_HEIGTH + y);
+            }
+        }
+    }
+}
+
+// Test the window at (x, y) on the binary image as it is now, as detectNaive does.
+static int windowFires(unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], int x, int y) {
+    int has_white_pixel = 0;
+    for (int dx = 0; dx < testsize && !has_white_pixel; dx++) {
+        for (int dy = 0; dy < testsize; dy++) {
+            if (binary_image[x + dx][y + dy]) {
+                has_white_pixel = 1;
+                break;
+            }
+        }
+    }
+    if (!has_white_pixel) {
+        return 0;
+    }
+    for (int d = -1; d <= testsize; d++) {
+        if (binary_image[x - 1][y + d] || binary_image[x + testsize][y + d]
+            || binary_image[x + d][y - 1] || binary_image[x + d][y + testsize]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Detect cells in the binary image using sliding window approach, on all threads of the pool.
+// Both window tests are box sums of a summed-area table: the capturing area (12x12 square) must
+// hold a white pixel and the exclusion frame around it (14x14 minus the capturing area) none.
+// After a detection the capturing area is cleared and the windows around it are tested again on
+// the pixels (see above), so the result is the same as detectNaive.
+// If frontier is not NULL, the pixels cleared after a detection are reported to it.
+int detectParallel(cells_session* session, unsigned char binary_image[BMP_WIDTH][BMP_HEIGTH], unsigned char bmp_image[BMP_WIDTH][BMP_HEIGTH][BMP_CHANNELS], erosion_frontier* frontier) {
+    window_list* candidates = session->candidates;
+    window_list* retest = &session->retest;
+    detect_task task;
+    task.session = session;
+    task.image = binary_image;
+    task.area = (unsigned int (*)[BMP_HEIGTH + 1]) sessionAreaTable(session, BMP_WIDTH, BMP_HEIGTH);
+    threadPoolRun(session, columnSumTask, &task);
+    threadPoolRun(session, rowSumTask, &task);
+    for (int band = 0; band < MAX_THREADS; band++) {
+        candidates[band].size = 0;
+    }
+    threadPoolRun(session, candidateTask, &task);
+
+    // Replay in scan order. The candidates of band 0, 1, ... are already in that order, and the
+    // windows to test again after a detection come out of a heap in that order.
+    int cells = 0;
+    int band = 0;
+    int next = 0;
+    int last = -1;
+    retest->size = 0;
+    for (;;) {
+        while (band < MAX_THREADS && next == candidates[band].size) {
+            band++;
+            next = 0;
+        }
+        int window;
+        if (retest->size > 0 && (band == MAX_THREADS || retest->items[0] < candidates[band].items[next])) {
+            window = windowHeapPop(retest);
+        } else if (band < MAX_THREADS) {
+            window = candidates[band].items[next++];
+        } else {
+            break;
+        }
+        if (window <= last) {
+            continue;
+        }
+        last = window;
+
+        int x = window / BMP_HEIGTH;
+        int y = window % BMP_HEIGTH;
+        if (profile_enabled) {
+            session->windows_tested++;
+        }
+        if (!windowFires(binary_image, x, y)) {
+            continue;
+        }
+        if (detectionIsNew(session, x, y)) {
+            cells++;
+            drawCell(session, bmp_image, x, y);
+            recordCell(session, x, y, binary_image[x] + y, BMP_HEIGTH);
+        }
+        if (profile_enabled) {
+            for (int dx = 0; dx < testsize; dx++) {
+                for (int dy = 0; dy < testsize; dy++) {
+                    session->pixels_cleared += binary_image[x + dx][y + dy];
+                }
+            }
+        }
+
+        // Set all pixels inside the capturing area to black to prevent detecting the same cell twice
+        if (frontier != NULL) {
+            frontierClear(frontier, binary_image, x, y, testsize);
+        } else {
+            for (int dx = 0; dx < testsize; dx++) {
+                memset(&binary_image[x + dx][y], 0, testsize);
+            }
+        }
+
+        // Later windows whose capturing area or exclusion frame overlaps the cleared area.
+        for (int wx = x; wx <= x + testsize && wx < BMP_WIDTH - testsize - 1; wx++) {
+            int y_begin = wx == x ? y + 1 : y - testsize;
+            if (y_begin < 1) y_begin = 1;
+            for (int wy = y_begin; wy <= y + testsize && wy < BMP_HEIGTH - testsize - 1; wy++) {
+                windowHeapPush(retest, wx * BMP_HEIGTH + wy);
+            }
+        }
+    }
+    return cells;
+}
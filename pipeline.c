@@ -0,0 +1,241 @@
+// Image pipeline (--pipeline): loading, processing and writing of a run of images overlapped.
+//
+// Processing an image one step after the other leaves the CPU idle while the file is read and the
+// disk idle while the image is eroded. Here every image goes through three stages on three
+// threads: load (read_bitmap_image) on a thread of its own, compute (erodeAndDetectSized) on the
+// calling thread and the thread pool of the session, and write (write_bitmap_image) on a thread of
+// its own. So image N + 1 is read and image N - 1 written while image N is processed.
+//
+// The images travel in PIPELINE_FRAMES frames, each with its binary and RGB image, which are
+// passed from stage to stage through single-producer single-consumer rings: free frames from the
+// write stage to the load stage, loaded frames to the compute stage and computed frames to the
+// write stage. Every ring has exactly one thread putting frames in and one taking them out, so
+// it needs no lock: the producer publishes a slot by advancing the tail with a release store, and
+// the consumer frees it by advancing the head. As there are fewer frames than slots, a ring is
+// never full; the number of frames bounds how far the load stage runs ahead. A stage with no frame
+// to take yields for a while, then sleeps for at most half a millisecond at a time: stages take
+// milliseconds per image, so the delay hardly shows. A NULL frame ends the run.
+//
+// Every stage adds up the time it spends working and waiting (pipeline_stats). The stage busy for
+// the largest part of the run is the bottleneck; pipelineReport prints them.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "cells.h"
+
+// Slots of a ring: one more than the frames, so the NULL frame always fits.
+#define PIPELINE_RING (PIPELINE_FRAMES + 1)
+
+// Times a stage yields its CPU before it starts sleeping while waiting for a frame, and how long it
+// sleeps then (ns).
+#define PIPELINE_SPINS 16
+#define PIPELINE_MIN_SLEEP 50000L
+#define PIPELINE_MAX_SLEEP 500000L
+
+// Ring of frames from one stage to the next.
+typedef struct pipeline_ring_data
+{
+    pipeline_frame* slots[PIPELINE_RING];
+    unsigned long head;             // Frames taken so far, written by the consumer only.
+    char padding[64];               // Keeps head and tail on separate cache lines.
+    unsigned long tail;             // Frames put so far, written by the producer only.
+} pipeline_ring;
+
+// State of a run of runPipeline.
+typedef struct pipeline_run_data
+{
+    cells_session* session;
+    pipeline_job* job;
+    pipeline_stats* stats;
+    int taken;                      // Images handed out so far, if job->next is NULL.
+    pipeline_ring free_frames;      // Write stage to load stage.
+    pipeline_ring loaded;           // Load stage to compute stage.
+    pipeline_ring computed;         // Compute stage to write stage.
+} pipeline_run;
+
+// Wait a little, the spins-th time in a row: yield the CPU at first, then sleep for longer and
+// longer, up to PIPELINE_MAX_SLEEP, so a stage waiting for a slow one takes next to no CPU time.
+static void pipelineWait(int spins) {
+    if (spins < PIPELINE_SPINS) {
+        sched_yield();
+        return;
+    }
+    long sleep = PIPELINE_MIN_SLEEP << (spins - PIPELINE_SPINS < 4 ? spins - PIPELINE_SPINS : 4);
+    struct timespec pause = { 0, sleep < PIPELINE_MAX_SLEEP ? sleep : PIPELINE_MAX_SLEEP };
+    nanosleep(&pause, NULL);
+}
+
+// Put frame in the ring. Only the producer of the ring calls this.
+static void ringPut(pipeline_ring* ring, pipeline_frame* frame) {
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    for (int spins = 0; tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == PIPELINE_RING; spins++) {
+        pipelineWait(spins);
+    }
+    ring->slots[tail % PIPELINE_RING] = frame;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Take the next frame from the ring, waiting for one if it is empty, and add the time waited to
+// *waiting. Only the consumer of the ring calls this.
+static pipeline_frame* ringTake(pipeline_ring* ring, double* waiting) {
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+        double start = now_seconds();
+        for (int spins = 0; head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE); spins++) {
+            pipelineWait(spins);
+        }
+        *waiting += now_seconds() - start;
+    }
+    pipeline_frame* frame = ring->slots[head % PIPELINE_RING];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return frame;
+}
+
+// Load the next image of the run into frame. Returns 0 if there are none left.
+static int pipelineLoad(pipeline_run* run, pipeline_frame* frame) {
+    pipeline_job* job = run->job;
+    int index = job->next != NULL ? job->next(job->arg) : (run->taken < job->count ? run->taken++ : -1);
+    if (index < 0) {
+        return 0;
+    }
+    double start = now_seconds();
+    frame->index = index;
+    frame->threshold = read_bitmap_image(job->inputs[index], binary_threshold, &frame->binary, &frame->rgb);
+    frame->seconds[PIPELINE_LOAD] = now_seconds() - start;
+    run->stats->busy[PIPELINE_LOAD] += frame->seconds[PIPELINE_LOAD];
+    if (job->hook != NULL) {
+        job->hook(job->arg, frame, PIPELINE_LOAD);
+    }
+    return 1;
+}
+
+// Erode the image of frame and detect its cells.
+static void pipelineCompute(pipeline_run* run, pipeline_frame* frame) {
+    pipeline_job* job = run->job;
+    cells_session* session = run->session;
+    double start = now_seconds();
+    frame->cells = erodeAndDetectSized(session, &frame->binary, &frame->rgb, job->engine, &frame->iterations);
+    frame->detects_skipped = session->detects_skipped;
+    frame->passes_saved = session->passes_saved;
+    frame->seconds[PIPELINE_COMPUTE] = now_seconds() - start;
+    run->stats->busy[PIPELINE_COMPUTE] += frame->seconds[PIPELINE_COMPUTE];
+    run->stats->frames++;
+    if (job->hook != NULL) {
+        job->hook(job->arg, frame, PIPELINE_COMPUTE);
+    }
+}
+
+// Write the image of frame to its output file.
+static void pipelineWrite(pipeline_run* run, pipeline_frame* frame) {
+    pipeline_job* job = run->job;
+    double start = now_seconds();
+    write_bitmap_image(&frame->rgb, job->outputs[frame->index]);
+    frame->seconds[PIPELINE_WRITE] = now_seconds() - start;
+    run->stats->busy[PIPELINE_WRITE] += frame->seconds[PIPELINE_WRITE];
+    if (job->hook != NULL) {
+        job->hook(job->arg, frame, PIPELINE_WRITE);
+    }
+}
+
+// Load stage: fill free frames until the images run out.
+static void* pipelineLoader(void* arg) {
+    pipeline_run* run = (pipeline_run*) arg;
+    for (;;) {
+        pipeline_frame* frame = ringTake(&run->free_frames, &run->stats->waiting[PIPELINE_LOAD]);
+        if (!pipelineLoad(run, frame)) {
+            ringPut(&run->loaded, NULL);
+            return NULL;
+        }
+        ringPut(&run->loaded, frame);
+    }
+}
+
+// Write stage: write computed frames and hand them back to the load stage.
+static void* pipelineWriter(void* arg) {
+    pipeline_run* run = (pipeline_run*) arg;
+    for (;;) {
+        pipeline_frame* frame = ringTake(&run->computed, &run->stats->waiting[PIPELINE_WRITE]);
+        if (frame == NULL) {
+            return NULL;
+        }
+        pipelineWrite(run, frame);
+        ringPut(&run->free_frames, frame);
+    }
+}
+
+// Process the images of job with the session, loading and writing them on two more threads while
+// the session computes (see above). The images are computed and written in the order they are
+// loaded. If the threads cannot be started, every image is processed on the calling thread. The
+// times of the stages are stored in *stats. Returns the number of images processed.
+int runPipeline(cells_session* session, pipeline_job* job, pipeline_stats* stats) {
+    pipeline_run run;
+    pipeline_frame frames[PIPELINE_FRAMES];
+    memset(&run, 0, sizeof(run));
+    memset(frames, 0, sizeof(frames));
+    memset(stats, 0, sizeof(*stats));
+    run.session = session;
+    run.job = job;
+    run.stats = stats;
+    for (int f = 0; f < PIPELINE_FRAMES; f++) {
+        ringPut(&run.free_frames, &frames[f]);
+    }
+
+    double start = now_seconds();
+    pthread_t loader, writer;
+    int writing = pthread_create(&writer, NULL, pipelineWriter, &run) == 0;
+    int loading = writing && pthread_create(&loader, NULL, pipelineLoader, &run) == 0;
+    if (loading) {
+        for (;;) {
+            pipeline_frame* frame = ringTake(&run.loaded, &stats->waiting[PIPELINE_COMPUTE]);
+            if (frame == NULL) {
+                break;
+            }
+            pipelineCompute(&run, frame);
+            ringPut(&run.computed, frame);
+        }
+        pthread_join(loader, NULL);
+    } else {
+        fprintf(stderr, "Could not start the pipeline threads, processing one image at a time\n");
+    }
+    if (writing) {
+        ringPut(&run.computed, NULL);
+        pthread_join(writer, NULL);
+    }
+    if (!loading) {
+        while (pipelineLoad(&run, &frames[0])) {
+            pipelineCompute(&run, &frames[0]);
+            pipelineWrite(&run, &frames[0]);
+        }
+    }
+    stats->seconds = now_seconds() - start;
+
+    for (int f = 0; f < PIPELINE_FRAMES; f++) {
+        image_free(&frames[f].binary);
+        image_free(&frames[f].rgb);
+    }
+    return stats->frames;
+}
+
+// Print the time per image of a run and how much of it every stage was busy and waiting. The
+// busiest stage sets the rate of the pipeline.
+void pipelineReport(pipeline_stats* stats) {
+    static const char* names[PIPELINE_STAGES] = { "load", "compute", "write" };
+    int frames = stats->frames > 0 ? stats->frames : 1;
+    double seconds = stats->seconds > 0 ? stats->seconds : 1;
+    int bottleneck = 0;
+    for (int stage = 1; stage < PIPELINE_STAGES; stage++) {
+        if (stats->busy[stage] > stats->busy[bottleneck]) {
+            bottleneck = stage;
+        }
+    }
+    printf("Pipeline: %d images in %.3f ms, %.3f ms per image\n", stats->frames, stats->seconds * 1000.0, stats->seconds * 1000.0 / frames);
+    for (int stage = 0; stage < PIPELINE_STAGES; stage++) {
+        printf("  %-8s %8.3f ms per image, busy %5.1f%%, waiting %5.1f%%%s\n", names[stage],
+               stats->busy[stage] * 1000.0 / frames, 100.0 * stats->busy[stage] / seconds,
+               100.0 * stats->waiting[stage] / seconds, stage == bottleneck ? " (bottleneck)" : "");
+    }
+}
@@ -0,0 +1,216 @@
+// Stage-level profiling of the pipeline (--profile FILE).
+//
+// Every stage (load, erode, count, detect, snapshot, write) is timed with the monotonic wall
+// clock and, on x86, the time stamp counter, and the times are added up per repetition of main.
+// Each erosion pass also records what it did: the white pixels left, the pixels turned black by
+// the erosion, the windows tested by detection and the detections. At the end, profileReport
+// writes the min, median and 99th percentile of every stage over the repetitions as JSON, with
+// the passes of the last repetition, so runs on different slides or versions can be compared.
+// Every repetition also records the page faults of the process (where getrusage has them) and the
+// buffers allocated (bmp_allocations) while it ran: after the first frame both should be about 0,
+// as every buffer is kept for the next frame (see cbmp.h and session.c).
+// When profiling is off, profileStart and profileStop return at once and nothing is recorded.
+// The profile is of the process, not of a session: profile one image at a time.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "cells.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_CYCLES() __rdtsc()
+#else
+#define PROFILE_CYCLES() 0
+#endif
+
+// Counters of one erosion pass.
+typedef struct profile_pass_data
+{
+    int white_pixels;       // White pixels after the erosion.
+    int pixels_flipped;     // Pixels turned black by the erosion.
+    int windows_tested;     // Windows tested on the image by detection.
+    int detections;
+} profile_pass;
+
+// Times of one repetition, per stage.
+typedef struct profile_repetition_data
+{
+    double seconds[PROFILE_STAGES + 1];     // The last entry is the whole repetition.
+    uint64_t cycles[PROFILE_STAGES + 1];
+    int calls[PROFILE_STAGES];
+    long minor_faults;      // Page faults served without reading from disk.
+    long major_faults;
+    long allocations;       // Buffers allocated, see bmp_allocations.
+} profile_repetition;
+
+static const char* profile_stage_names[PROFILE_STAGES + 1] = { "load", "erode", "count", "detect", "snapshot", "write", "total" };
+
+int profile_enabled = 0;
+
+static profile_repetition* profile_repetitions = NULL;
+static int profile_repetition_count = 0;
+static int profile_repetition_capacity = 0;
+static profile_mark profile_repetition_start;
+static profile_pass profile_passes[MAX_EROSIONS + 2];
+static int profile_pass_count = 0;
+static int profile_last_white = 0;
+static profile_repetition profile_memory_start;     // Counters when the repetition started.
+
+// Page faults of the process so far, into the counters of repetition.
+static void profileFaults(profile_repetition* repetition) {
+    repetition->minor_faults = 0;
+    repetition->major_faults = 0;
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        repetition->minor_faults = usage.ru_minflt;
+        repetition->major_faults = usage.ru_majflt;
+    }
+#endif
+    repetition->allocations = bmp_allocations;
+}
+
+// Current time, to be passed to profileStop.
+profile_mark profileStart(void) {
+    profile_mark mark = { 0, 0 };
+    if (profile_enabled) {
+        mark.seconds = now_seconds();
+        mark.cycles = PROFILE_CYCLES();
+    }
+    return mark;
+}
+
+// Add the time since start to `stage` of the current repetition.
+void profileStop(int stage, profile_mark start) {
+    if (!profile_enabled) {
+        return;
+    }
+    profile_repetition* repetition = &profile_repetitions[profile_repetition_count];
+    repetition->seconds[stage] += now_seconds() - start.seconds;
+    repetition->cycles[stage] += PROFILE_CYCLES() - start.cycles;
+    repetition->calls[stage]++;
+}
+
+// Start a repetition of the pipeline.
+void profileBeginRepetition(void) {
+    if (!profile_enabled) {
+        return;
+    }
+    if (profile_repetition_count == profile_repetition_capacity) {
+        profile_repetition_capacity = profile_repetition_capacity == 0 ? 16 : profile_repetition_capacity * 2;
+        profile_repetitions = (profile_repetition*) realloc(profile_repetitions, profile_repetition_capacity * sizeof(profile_repetition));
+    }
+    memset(&profile_repetitions[profile_repetition_count], 0, sizeof(profile_repetition));
+    profile_pass_count = 0;
+    profileFaults(&profile_memory_start);
+    profile_repetition_start = profileStart();
+}
+
+// End the repetition started by profileBeginRepetition.
+void profileEndRepetition(void) {
+    if (!profile_enabled) {
+        return;
+    }
+    profile_repetition* repetition = &profile_repetitions[profile_repetition_count];
+    repetition->seconds[PROFILE_STAGES] = now_seconds() - profile_repetition_start.seconds;
+    repetition->cycles[PROFILE_STAGES] = PROFILE_CYCLES() - profile_repetition_start.cycles;
+    profileFaults(repetition);
+    repetition->minor_faults -= profile_memory_start.minor_faults;
+    repetition->major_faults -= profile_memory_start.major_faults;
+    repetition->allocations -= profile_memory_start.allocations;
+    profile_repetition_count++;
+}
+
+// Record the white pixels of the image before the first erosion pass.
+void profileInitialWhite(cells_session* session, int white_pixels) {
+    session->windows_tested = 0;
+    session->pixels_cleared = 0;
+    if (!profile_enabled) {
+        return;
+    }
+    profile_last_white = white_pixels;
+}
+
+// Record an erosion pass: white_pixels after the erosion, and the detections of the pass (the
+// windows tested and pixels cleared by detection are counted in the session by the detect functions).
+void profilePass(cells_session* session, int white_pixels, int detections) {
+    int windows_tested = session->windows_tested;
+    int pixels_cleared = session->pixels_cleared;
+    session->windows_tested = 0;
+    session->pixels_cleared = 0;
+    if (!profile_enabled || profile_pass_count == MAX_EROSIONS + 2) {
+        return;
+    }
+    profile_pass* pass = &profile_passes[profile_pass_count++];
+    pass->white_pixels = white_pixels;
+    pass->pixels_flipped = profile_last_white - white_pixels;
+    pass->windows_tested = windows_tested;
+    pass->detections = detections;
+    profile_last_white = white_pixels - pixels_cleared;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static int compareCycles(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+// Write the profile of all repetitions to path as JSON. Returns 0 if the file cannot be written.
+int profileReport(char* path, char* input_path) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        return 0;
+    }
+    int n = profile_repetition_count;
+    double* seconds = (double*) malloc((n > 0 ? n : 1) * sizeof(double));
+    uint64_t* cycles = (uint64_t*) malloc((n > 0 ? n : 1) * sizeof(uint64_t));
+
+    fprintf(out, "{\n  \"input\": \"%s\",\n  \"repetitions\": %d,\n  \"stages\": [\n", input_path, n);
+    for (int stage = 0; stage <= PROFILE_STAGES; stage++) {
+        for (int r = 0; r < n; r++) {
+            seconds[r] = profile_repetitions[r].seconds[stage];
+            cycles[r] = profile_repetitions[r].cycles[stage];
+        }
+        qsort(seconds, n, sizeof(double), compareDoubles);
+        qsort(cycles, n, sizeof(uint64_t), compareCycles);
+        // Nearest rank: the 99th percentile of fewer than 100 repetitions is the largest one.
+        int median = n > 0 ? (n - 1) / 2 : 0;
+        int p99 = n > 0 ? (int) ((99L * n + 99) / 100) - 1 : 0;
+        int calls = n > 0 && stage < PROFILE_STAGES ? profile_repetitions[n - 1].calls[stage] : 1;
+        fprintf(out, "    {\"stage\": \"%s\", \"calls\": %d, \"min_ms\": %.4f, \"median_ms\": %.4f, \"p99_ms\": %.4f, \"median_cycles\": %llu}%s\n",
+                profile_stage_names[stage], calls,
+                n > 0 ? seconds[0] * 1000 : 0, n > 0 ? seconds[median] * 1000 : 0, n > 0 ? seconds[p99] * 1000 : 0,
+                n > 0 ? (unsigned long long) cycles[median] : 0ULL, stage < PROFILE_STAGES ? "," : "");
+    }
+    fprintf(out, "  ],\n  \"memory\": [\n");
+    for (int r = 0; r < n; r++) {
+        profile_repetition* repetition = &profile_repetitions[r];
+        fprintf(out, "    {\"repetition\": %d, \"minor_faults\": %ld, \"major_faults\": %ld, \"allocations\": %ld}%s\n",
+                r + 1, repetition->minor_faults, repetition->major_faults, repetition->allocations, r + 1 < n ? "," : "");
+    }
+    fprintf(out, "  ],\n  \"passes\": [\n");
+    for (int i = 0; i < profile_pass_count; i++) {
+        profile_pass* pass = &profile_passes[i];
+        fprintf(out, "    {\"pass\": %d, \"white_pixels\": %d, \"pixels_flipped\": %d, \"windows_tested\": %d, \"detections\": %d}%s\n",
+                i + 1, pass->white_pixels, pass->pixels_flipped, pass->windows_tested, pass->detections,
+                i + 1 < profile_pass_count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    free(seconds);
+    free(cycles);
+    fclose(out);
+    return 1;
+}
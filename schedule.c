@@ -0,0 +1,205 @@
+// Scheduling of the erosion and detection loop: which detect calls can be skipped, and when the
+// loop can stop early. Used by the full and frontier engines and by the runtime-sized loop; the
+// distance engine only visits windows that can fire anyway.
+//
+// A window fires only if its capturing area holds a white pixel and its exclusion frame is all
+// black. The frame is a closed ring one pixel wide, which no 8-connected path of white pixels can
+// cross, so the component of that pixel lies inside the capturing area: its bounding box is at
+// most testsize x testsize. Before every detect call, scheduleOutlook labels the components of the
+// image and if none is that small, detect cannot find anything and is skipped. Since a detect call
+// that finds nothing does not change the image, the result is the same as if it had run.
+//
+// The components are labelled by runs: every column is cut into runs of white pixels (black
+// pixels are skipped 8 at a time), and a run is united with the runs of the previous column that
+// touch it, diagonally included. Only the bounding box of every set is kept. Late in the loop the
+// image is almost black and this takes a small part of the time of one detect call.
+//
+// The same scan finds the longest vertical run. If the structuring element holds the pixels u
+// above and d below the pixel itself, no pixel of a run of at most u + d pixels survives the next
+// erosion pass. So if no run is longer, the next pass turns the image black, no window can fire in
+// it and the loop would end there: it ends after this pass instead of making it. The loops also
+// end early when the detections of the pass have cleared the last white pixels, which they check
+// only when few enough pixels were left for that. Neither is done when snapshots are saved, since
+// the last pass would be missing.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "cells.h"
+
+// Run the scheduler (on by default, --no-schedule turns it off). The detect calls skipped and the
+// erosion passes not made by the last run are in session->detects_skipped and passes_saved.
+int schedule_enabled = 1;
+
+// Bounding box of a set of runs, and its parent in the union-find forest.
+typedef struct schedule_set_data
+{
+    int parent;
+    int x_min;
+    int x_max;
+    int y_min;
+    int y_max;
+} schedule_set;
+
+// A run of white pixels of a column, y_begin <= y <= y_end, and its set.
+typedef struct schedule_run_data
+{
+    int y_begin;
+    int y_end;
+    int set;
+} schedule_run;
+
+// Scratch of scheduleOutlook (session->schedule).
+typedef struct schedule_state_data
+{
+    schedule_set* sets;
+    int sets_capacity;
+    schedule_run* runs[2];      // Runs of the previous and the current column.
+    int runs_capacity;
+} schedule_state;
+
+// Root of the set s, halving the path on the way.
+static int scheduleRoot(schedule_set* sets, int s) {
+    while (sets[s].parent != s) {
+        sets[s].parent = sets[sets[s].parent].parent;
+        s = sets[s].parent;
+    }
+    return s;
+}
+
+// Merge the sets of a and b and their bounding boxes. Returns the root of both.
+static int scheduleUnite(schedule_set* sets, int a, int b) {
+    a = scheduleRoot(sets, a);
+    b = scheduleRoot(sets, b);
+    if (a == b) {
+        return a;
+    }
+    if (b < a) {
+        int t = a;
+        a = b;
+        b = t;
+    }
+    sets[b].parent = a;
+    if (sets[b].x_min < sets[a].x_min) sets[a].x_min = sets[b].x_min;
+    if (sets[b].x_max > sets[a].x_max) sets[a].x_max = sets[b].x_max;
+    if (sets[b].y_min < sets[a].y_min) sets[a].y_min = sets[b].y_min;
+    if (sets[b].y_max > sets[a].y_max) sets[a].y_max = sets[b].y_max;
+    return a;
+}
+
+// Pixels of erosion_element right above and right below the pixel itself, without a gap: a
+// vertical run of at most that many pixels is removed whole by one erosion pass.
+static int scheduleVanishingRun(void) {
+    structuring_element* se = erosion_element;
+    int reach = 0;
+    for (int direction = -1; direction <= 1; direction += 2) {
+        for (int dy = direction; ; dy += direction) {
+            int found = 0;
+            for (int k = 0; k < se->count && !found; k++) {
+                found = se->dx[k] == 0 && se->dy[k] == dy;
+            }
+            if (!found) {
+                break;
+            }
+            reach++;
+        }
+    }
+    return reach;
+}
+
+// Look at the binary image (pixel (x, y) at binary[x * stride + y]) before a detect call. Returns
+// OUTLOOK_DETECT if a component is small enough for a window to fire on it, and OUTLOOK_LAST if the
+// next erosion pass turns the image black. With the scheduler off, always returns OUTLOOK_DETECT.
+int scheduleOutlook(cells_session* session, unsigned char* binary, int width, int height, int stride) {
+    if (!schedule_enabled) {
+        return OUTLOOK_DETECT;
+    }
+    if (session->schedule == NULL) {
+        session->schedule = (schedule_state*) calloc(1, sizeof(schedule_state));
+    }
+    schedule_state* state = session->schedule;
+    int max_runs = height / 2 + 1;
+    if (max_runs > state->runs_capacity) {
+        free(state->runs[0]);
+        free(state->runs[1]);
+        state->runs[0] = (schedule_run*) malloc(max_runs * sizeof(schedule_run));
+        state->runs[1] = (schedule_run*) malloc(max_runs * sizeof(schedule_run));
+        state->runs_capacity = max_runs;
+    }
+    schedule_set* sets = state->sets;
+
+    int set_count = 0;
+    int previous_count = 0;
+    int longest_run = 0;
+    schedule_run* previous = state->runs[0];
+    schedule_run* current = state->runs[1];
+    for (int x = 0; x < width; x++) {
+        unsigned char* column = binary + (size_t) x * stride;
+        int count = 0;
+        int next = 0;    // First run of the previous column that can touch the current run.
+        int y = 0;
+        while (y < height) {
+            uint64_t word;
+            if (y + 8 <= height && (memcpy(&word, column + y, sizeof(word)), word == 0)) {
+                y += 8;
+                continue;
+            }
+            if (!column[y]) {
+                y++;
+                continue;
+            }
+            schedule_run* run = &current[count++];
+            run->y_begin = y;
+            while (y < height && column[y]) {
+                y++;
+            }
+            run->y_end = y - 1;
+            if (y - run->y_begin > longest_run) {
+                longest_run = y - run->y_begin;
+            }
+
+            // Runs of the previous column from y_begin - 1 to y_end + 1 touch this one.
+            while (next < previous_count && previous[next].y_end < run->y_begin - 1) {
+                next++;
+            }
+            run->set = -1;
+            for (int i = next; i < previous_count && previous[i].y_begin <= run->y_end + 1; i++) {
+                run->set = run->set < 0 ? scheduleRoot(sets, previous[i].set) : scheduleUnite(sets, run->set, previous[i].set);
+            }
+            if (run->set < 0) {
+                if (set_count == state->sets_capacity) {
+                    state->sets_capacity = state->sets_capacity ? state->sets_capacity * 2 : 1024;
+                    sets = state->sets = (schedule_set*) realloc(sets, state->sets_capacity * sizeof(schedule_set));
+                }
+                run->set = set_count++;
+                schedule_set* s = &sets[run->set];
+                s->parent = run->set;
+                s->x_min = x;
+                s->x_max = x;
+                s->y_min = run->y_begin;
+                s->y_max = run->y_end;
+            } else {
+                schedule_set* s = &sets[run->set];
+                s->x_max = x;
+                if (run->y_begin < s->y_min) s->y_min = run->y_begin;
+                if (run->y_end > s->y_max) s->y_max = run->y_end;
+            }
+        }
+        schedule_run* swap = previous;
+        previous = current;
+        current = swap;
+        previous_count = count;
+    }
+
+    int outlook = 0;
+    for (int s = 0; s < set_count; s++) {
+        if (sets[s].parent == s && sets[s].x_max - sets[s].x_min < testsize && sets[s].y_max - sets[s].y_min < testsize) {
+            outlook |= OUTLOOK_DETECT;
+            break;
+        }
+    }
+    if (save_snapshots == 0 && longest_run <= scheduleVanishingRun()) {
+        outlook |= OUTLOOK_LAST;
+    }
+    return outlook;
+}
@@ -0,0 +1,103 @@
+// Sessions: everything the processing of one image keeps between calls (see cells_session in
+// cells.h). The modules allocate their scratch in the session the first time they need it, so a
+// session only holds what its images used; sessionFree gives it all back.
+//
+// Scratch of a fixed size (the states of the frontier and distance engines and of erodeSteps)
+// comes from the arena of the session: blocks of SESSION_ARENA_BLOCK bytes, or one block for a
+// larger piece, allocated with bmp_buffer_alloc so they are backed by huge pages with
+// --huge-pages. Nothing is given back to the arena before sessionFree, which frees the blocks.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "cells.h"
+
+// Block of the arena. What sessionAlloc hands out follows the header.
+typedef struct arena_block_data
+{
+    struct arena_block_data* next;
+    size_t size;        // Bytes of the block, the header included.
+    size_t used;        // Bytes handed out so far, the header included.
+    int mapped;         // See bmp_buffer_alloc.
+} arena_block;
+
+// Set up an empty session whose tasks run on `threads` threads, the caller included.
+void sessionInit(cells_session* session, int threads) {
+    memset(session, 0, sizeof(*session));
+    threadPoolStart(session, threads);
+}
+
+// Zeroed memory of size bytes from the arena of the session, aligned to SESSION_ARENA_ALIGN bytes
+// and kept until sessionFree. Returns NULL if there is not enough memory.
+void* sessionAlloc(cells_session* session, size_t size) {
+    size_t header = (sizeof(arena_block) + SESSION_ARENA_ALIGN - 1) / SESSION_ARENA_ALIGN * SESSION_ARENA_ALIGN;
+    size = (size + SESSION_ARENA_ALIGN - 1) / SESSION_ARENA_ALIGN * SESSION_ARENA_ALIGN;
+    arena_block* block = session->arena;
+    if (block == NULL || block->used + size + SESSION_ARENA_ALIGN > block->size) {
+        // A piece that does not fit in a block of the usual size gets a block of its own, behind
+        // the current one, which stays in use for the smaller pieces.
+        int own = header + size + SESSION_ARENA_ALIGN > SESSION_ARENA_BLOCK;
+        size_t block_size = own ? header + size + SESSION_ARENA_ALIGN : SESSION_ARENA_BLOCK;
+        int mapped;
+        block = (arena_block*) bmp_buffer_alloc(block_size, &mapped);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->size = block_size;
+        block->used = header;
+        block->mapped = mapped;
+        if (own && session->arena != NULL) {
+            block->next = session->arena->next;
+            session->arena->next = block;
+        } else {
+            block->next = session->arena;
+            session->arena = block;
+        }
+    }
+    uintptr_t start = ((uintptr_t) block + block->used + SESSION_ARENA_ALIGN - 1) & ~(uintptr_t) (SESSION_ARENA_ALIGN - 1);
+    block->used = start + size - (uintptr_t) block;
+    memset((void*) start, 0, size);
+    return (void*) start;
+}
+
+// Stop the thread pool of the session and free its images and scratch. The cell table is the
+// caller's. The session can be set up again with sessionInit.
+void sessionFree(cells_session* session) {
+    threadPoolStop(session);
+    image_free(&session->rgb);
+    image_free(&session->binary);
+    image_free(&session->eroded);
+    free(session->detections.items);
+    if (session->distance != NULL) {
+        for (int step = 0; step <= MAX_EROSIONS; step++) {
+            free(session->distance->buckets[step].items);
+        }
+        free(session->distance->late_windows.items);
+    }
+    if (session->labels != NULL) {
+        free(session->labels->labels);
+        free(session->labels->parents);
+        free(session->labels->components);
+        free(session->labels);
+    }
+    if (session->schedule != NULL) {
+        free(session->schedule->sets);
+        free(session->schedule->runs[0]);
+        free(session->schedule->runs[1]);
+        free(session->schedule);
+    }
+    if (session->area_table != NULL) {
+        bmp_buffer_free(session->area_table, session->area_table_size * sizeof(unsigned int), session->area_table_mapped);
+    }
+    for (int band = 0; band < MAX_THREADS; band++) {
+        free(session->candidates[band].items);
+    }
+    free(session->retest.items);
+    while (session->arena != NULL) {
+        arena_block* block = session->arena;
+        session->arena = block->next;
+        bmp_buffer_free(block, block->size, block->mapped);
+    }
+    memset(session, 0, sizeof(*session));
+}
@@ -0,0 +1,190 @@
+// Erosion snapshots (--snapshots N), written by a background thread.
+//
+// Saving a snapshot used to mean expanding the binary image to RGB, encoding a whole bitmap and
+// writing it out after every erosion pass, on the thread running the loop. Now the loop only packs
+// the image into bits (one 64-bit word per 64 pixels of a column) and puts it in a small queue;
+// a writer thread takes it from there and writes the file. If the writer falls behind and the
+// queue is full, the loop waits for a free slot, so every snapshot is written.
+//
+// Snapshots are written as results/step_<step>.bmp, or as results/step_<step>.pbm (a bit-packed
+// black and white image that most image viewers open, about 24 times smaller) with --snapshot-format pbm.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "cells.h"
+
+// Snapshots waiting for the writer at most.
+#define SNAPSHOT_QUEUE 8
+
+// A snapshot in the queue: the binary image after erosion `step`, bit-packed by columns.
+typedef struct snapshot_data
+{
+    int step;
+    int width;
+    int height;
+    int words;          // 64-bit words per column.
+    int ready;          // Packed, so the writer can take it.
+    size_t capacity;    // Words allocated for bits.
+    uint64_t* bits;     // Bit y % 64 of bits[x * words + y / 64] is pixel (x, y).
+} snapshot;
+
+int snapshot_format = SNAPSHOT_BMP;
+int snapshots_queued = 0;                  // Since the start, for reports.
+
+static snapshot snapshot_queue[SNAPSHOT_QUEUE];
+static int queue_head = 0;                 // Next snapshot for the writer.
+static int queue_count = 0;                // Slots reserved, ready or still being packed by a session.
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_space = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_thread;
+static int writer_running = 0;
+static int writer_stopping = 0;
+static int snapshots_waited = 0;           // Snapshots that waited for a free slot.
+
+// Write the snapshot as a 24-bit bitmap.
+static void writeSnapshotBMP(snapshot* shot, char* path) {
+    static image binary;
+    image_resize(&binary, shot->width, shot->height, 1);
+    for (int x = 0; x < shot->width; x++) {
+        uint64_t* column = shot->bits + (size_t) x * shot->words;
+        unsigned char* pixels = binary.data + (size_t) x * binary.stride;
+        for (int y = 0; y < shot->height; y++) {
+            pixels[y] = (column[y / 64] >> (y % 64)) & 1;
+        }
+    }
+    write_bitmap_binary(&binary, path);
+}
+
+// Write the snapshot as a binary PBM: rows from the top, 8 pixels per byte, 1 for black.
+static void writeSnapshotPBM(snapshot* shot, char* path) {
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL) {
+        perror(path);
+        return;
+    }
+    fprintf(fp, "P4\n%d %d\n", shot->width, shot->height);
+    int row_bytes = (shot->width + 7) / 8;
+    unsigned char* row = (unsigned char*) malloc(row_bytes);
+    for (int y = 0; y < shot->height; y++) {
+        memset(row, 0, row_bytes);
+        for (int x = 0; x < shot->width; x++) {
+            int white = (shot->bits[(size_t) x * shot->words + y / 64] >> (y % 64)) & 1;
+            if (!white) {
+                row[x / 8] |= 0x80 >> (x % 8);
+            }
+        }
+        fwrite(row, 1, row_bytes, fp);
+    }
+    free(row);
+    fclose(fp);
+}
+
+// Writer thread: write the snapshots of the queue in order until snapshotStop.
+static void* snapshotWriter(void* arg) {
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (!(queue_count > 0 && snapshot_queue[queue_head].ready) && !(queue_count == 0 && writer_stopping)) {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        }
+        if (queue_count == 0) {
+            pthread_mutex_unlock(&queue_lock);
+            return NULL;
+        }
+        snapshot* shot = &snapshot_queue[queue_head];
+        pthread_mutex_unlock(&queue_lock);
+
+        char path[260];
+        snprintf(path, sizeof(path), "results/step_%d.%s", shot->step, snapshot_format == SNAPSHOT_PBM ? "pbm" : "bmp");
+        if (snapshot_format == SNAPSHOT_PBM) {
+            writeSnapshotPBM(shot, path);
+        } else {
+            writeSnapshotBMP(shot, path);
+        }
+
+        pthread_mutex_lock(&queue_lock);
+        shot->ready = 0;
+        queue_head = (queue_head + 1) % SNAPSHOT_QUEUE;
+        queue_count--;
+        pthread_cond_broadcast(&queue_space);
+        pthread_mutex_unlock(&queue_lock);
+    }
+}
+
+// Queue a snapshot of the binary image (pixel (x, y) at binary[x * stride + y]) after erosion
+// `step`. Starts the writer thread the first time. Waits for the writer only if the queue is full.
+void snapshotSubmit(unsigned char* binary, int width, int height, int stride, int step) {
+    pthread_mutex_lock(&queue_lock);
+    if (!writer_running) {
+        if (pthread_create(&writer_thread, NULL, snapshotWriter, NULL) != 0) {
+            pthread_mutex_unlock(&queue_lock);
+            fprintf(stderr, "Could not start the snapshot writer\n");
+            return;
+        }
+        writer_running = 1;
+    }
+    if (queue_count == SNAPSHOT_QUEUE) {
+        snapshots_waited++;
+        while (queue_count == SNAPSHOT_QUEUE) {
+            pthread_cond_wait(&queue_space, &queue_lock);
+        }
+    }
+    // Reserve the slot after the last one reserved, so a session submitting at the same time packs
+    // into another one. The writer does not touch it until it is marked ready.
+    snapshot* shot = &snapshot_queue[(queue_head + queue_count) % SNAPSHOT_QUEUE];
+    queue_count++;
+    pthread_mutex_unlock(&queue_lock);
+
+    shot->step = step;
+    shot->width = width;
+    shot->height = height;
+    shot->words = (height + 63) / 64;
+    size_t words = (size_t) width * shot->words;
+    if (words > shot->capacity) {
+        free(shot->bits);
+        shot->bits = (uint64_t*) malloc(words * sizeof(uint64_t));
+        shot->capacity = words;
+    }
+    for (int x = 0; x < width; x++) {
+        unsigned char* pixels = binary + (size_t) x * stride;
+        uint64_t* column = shot->bits + (size_t) x * shot->words;
+        for (int w = 0; w < shot->words; w++) {
+            uint64_t word = 0;
+            int y_end = (w + 1) * 64 < height ? (w + 1) * 64 : height;
+            for (int y = w * 64; y < y_end; y++) {
+                word |= (uint64_t) (pixels[y] != 0) << (y % 64);
+            }
+            column[w] = word;
+        }
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    shot->ready = 1;
+    snapshots_queued++;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+    if (cells_verbose) {
+        printf("Queued erosion snapshot %d\n", step);
+    }
+}
+
+// Write the snapshots still in the queue and stop the writer thread. Returns the number of
+// snapshots that waited for the writer because the queue was full since the last call.
+int snapshotStop(void) {
+    if (writer_running) {
+        pthread_mutex_lock(&queue_lock);
+        writer_stopping = 1;
+        pthread_cond_signal(&queue_ready);
+        pthread_mutex_unlock(&queue_lock);
+        pthread_join(writer_thread, NULL);
+        writer_running = 0;
+        writer_stopping = 0;
+    }
+    int waited = snapshots_waited;
+    snapshots_waited = 0;
+    return waited;
+}
@@ -0,0 +1,135 @@
+// Tiled mode of main (--tile N): process a bitmap of any size, even one larger than memory, a tile
+// at a time.
+//
+// The picture is cut into tiles of N x N pixels. Every tile is read from the file with a halo of
+// pixels around it and processed as an image of its own, whose edges are black like the picture
+// border. That makes the result wrong next to tile edges that are inside the picture. Every pass
+// spreads the difference by up to TILE_SPREAD pixels: the radius of the structuring element for
+// the erosion, and a window plus its frame for a detection, which clears a square decided by the
+// pixels one further out. So the halo is sized for as many passes as the tile before made; a tile
+// that makes more is read and processed again with a halo sized for those. Each tile counts the
+// detections whose window is in its core, so every cell is counted once, and writes its core to
+// the output file, red squares of detections in the halo included. The same goes for the cells of
+// cell_records, whose components are labelled per tile, so a component that crosses tiles gets a
+// number in each of them.
+// Memory use depends on N only, not on the size of the picture.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "cells.h"
+
+// Pixels an erosion pass and its detections spread a difference by at most.
+#define TILE_SPREAD (erosion_element->radius + testsize + 1)
+
+// Erosion passes the halo of the first tile is sized for.
+#define TILE_FIRST_PASSES 16
+
+// Pixels read around a tile processed with up to `passes` erosion passes: the spread of every pass,
+// of the detection after the last one and the minimum separation of detections.
+static int tileHalo(int passes) {
+    return TILE_SPREAD * (passes + 1) + detection_min_separation;
+}
+
+// Process the bitmap at input_path tile by tile with the session (the tiles are read into its
+// images) and write the annotated bitmap to output_path. Detections are printed in picture
+// coordinates if cells_verbose is set. Returns the number of cells detected and stores the largest
+// number of erosion passes of a tile in *iterations.
+int processTiled(cells_session* session, char* input_path, char* output_path, int tile_size, int engine, int* iterations) {
+    image* binary = &session->binary;
+    image* rgb = &session->rgb;
+    cell_table* cell_records = session->cell_records;
+
+    int width, height;
+    bmp_stream* input = bmp_stream_open(input_path, &width, &height);
+    bmp_stream* output = bmp_stream_create(output_path, input);
+
+    // Detections are printed here, in picture coordinates, and not by the tiles.
+    int verbose = cells_verbose;
+    cells_verbose = 0;
+
+    int total_cells = 0;
+    int total_components = 0;
+    int passes = TILE_FIRST_PASSES;
+    *iterations = 0;
+    for (int y0 = 0; y0 < height; y0 += tile_size) {
+        for (int x0 = 0; x0 < width; x0 += tile_size) {
+            int x1 = x0 + tile_size < width ? x0 + tile_size : width;
+            int y1 = y0 + tile_size < height ? y0 + tile_size : height;
+
+            // The tile with its halo, clipped to the picture. Processed again with a larger halo
+            // if it makes more passes than the halo is sized for, unless it covers the picture.
+            int first_record = cell_records != NULL ? cell_records->size : 0;
+            int halo_x0, halo_y0, halo_x1, halo_y1;
+            int tile_iterations;
+            for (;;) {
+                int halo = tileHalo(passes);
+                halo_x0 = x0 - halo > 0 ? x0 - halo : 0;
+                halo_y0 = y0 - halo > 0 ? y0 - halo : 0;
+                halo_x1 = x1 + halo < width ? x1 + halo : width;
+                halo_y1 = y1 + halo < height ? y1 + halo : height;
+                int tile_width = halo_x1 - halo_x0;
+                int tile_height = halo_y1 - halo_y0;
+
+                if (cell_records != NULL) {
+                    cell_records->size = first_record;
+                }
+                bmp_stream_read(input, halo_x0, halo_y0, tile_width, tile_height, binary_threshold, binary, rgb);
+                erodeAndDetectSized(session, binary, rgb, engine, &tile_iterations);
+                int whole = halo_x0 == 0 && halo_y0 == 0 && halo_x1 == width && halo_y1 == height;
+                int enough = tile_iterations <= passes;
+                passes = tile_iterations;
+                if (enough || whole) {
+                    break;
+                }
+            }
+            if (tile_iterations > *iterations) {
+                *iterations = tile_iterations;
+            }
+
+            // Keep the cells of the core, in picture coordinates and with numbers of their own.
+            if (cell_records != NULL) {
+                int kept = first_record;
+                int last_component = 0;
+                for (int i = first_record; i < cell_records->size; i++) {
+                    cell_record cell = cell_records->items[i];
+                    if (cell.component > last_component) {
+                        last_component = cell.component;
+                    }
+                    cell.x += halo_x0;
+                    cell.y += halo_y0;
+                    if (cell.x < x0 || cell.x >= x1 || cell.y < y0 || cell.y >= y1) {
+                        continue;
+                    }
+                    cell.component += total_components;
+                    cell.sum_x += (long) cell.area * halo_x0;
+                    cell.sum_y += (long) cell.area * halo_y0;
+                    cell.x_min += halo_x0;
+                    cell.y_min += halo_y0;
+                    cell.x_max += halo_x0;
+                    cell.y_max += halo_y0;
+                    cell_records->items[kept++] = cell;
+                }
+                cell_records->size = kept;
+                total_components += last_component;
+            }
+
+            for (int i = 0; i < session->detections.size; i++) {
+                int x = halo_x0 + session->detections.items[i].x;
+                int y = halo_y0 + session->detections.items[i].y;
+                if (x >= x0 && x < x1 && y >= y0 && y < y1) {
+                    total_cells++;
+                    if (verbose) {
+                        printf("Cell detected at position (%d, %d)\n", x, y);
+                    }
+                }
+            }
+            bmp_stream_write(output, x0, y0, x1 - x0, y1 - y0, rgb, x0 - halo_x0, y0 - halo_y0);
+        }
+    }
+
+    cells_verbose = verbose;
+    bmp_stream_close(output);
+    bmp_stream_close(input);
+    return total_cells;
+}